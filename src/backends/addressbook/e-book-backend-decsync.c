@@ -41,6 +41,7 @@
 #include <glib/gi18n-lib.h>
 
 #include <e-source/e-source-decsync.h>
+#include <backends/utils/decsync-monitor.h>
 #include <json.h>
 #include <libdecsync.h>
 
@@ -60,6 +61,9 @@
  */
 #define SQLITEDB_FOLDER_ID   "folder_id"
 #define SQLITE_REVISION_KEY  "revision"
+/* followed by the UID, the SHA-1 of the vCard last applied from or
+ * written to DecSync for it */
+#define SQLITE_DIGEST_KEY_PREFIX "resource-digest:"
 
 /* Forward Declarations */
 static gboolean	book_backend_decsync_refresh_start (EBookBackendDecsync *bf);
@@ -78,6 +82,13 @@ struct _EBookBackendDecsyncPrivate {
 
 	EBookSqlite *sqlitedb;
 	Decsync   decsync;
+
+	guint     refresh_timeout_id;
+	/* resources entries dropped as they were unchanged */
+	guint     resource_skips;
+	/* refreshes soon after other apps wrote new entries; the timer
+	 * above is only a fallback then */
+	DecsyncMonitor *monitor;
 };
 
 G_DEFINE_TYPE_WITH_CODE (
@@ -686,6 +697,70 @@ e_book_backend_decsync_new_revision (EBookBackendDecsync *bf,
 	return g_strdup (time_string);
 }
 
+/* Returns the digest of a resource as DecSync has it, @vcard being NULL
+ * for a removed one */
+static gchar *
+e_book_backend_decsync_compute_digest (const gchar *vcard)
+{
+	return g_compute_checksum_for_string (G_CHECKSUM_SHA1, vcard ? vcard : "", -1);
+}
+
+/* Remembers @vcard as the resource @uid last applied from or written to
+ * DecSync, @vcard being NULL for a removed one, so that a removal which
+ * is published again is skipped as well; within the transaction of the
+ * change when there is one */
+static void
+e_book_backend_decsync_set_digest (EBookBackendDecsync *bf,
+                                   const gchar *uid,
+                                   const gchar *vcard)
+{
+	GError *local_error = NULL;
+	gchar *key, *digest;
+	gboolean success;
+
+	key = g_strconcat (SQLITE_DIGEST_KEY_PREFIX, uid, NULL);
+	digest = e_book_backend_decsync_compute_digest (vcard);
+
+	success = e_book_sqlite_set_key_value (bf->priv->sqlitedb, key, digest, &local_error);
+
+	if (!success) {
+		g_warning (
+			G_STRLOC ": Error setting resource digest: %s",
+			local_error->message);
+		g_clear_error (&local_error);
+	}
+
+	g_free (digest);
+	g_free (key);
+}
+
+/* Whether @vcard is the resource @uid last applied from or written to
+ * DecSync */
+static gboolean
+e_book_backend_decsync_is_unchanged (EBookBackendDecsync *bf,
+                                     const gchar *uid,
+                                     const gchar *vcard)
+{
+	gchar *key, *digest, *stored = NULL;
+	gboolean unchanged;
+
+	key = g_strconcat (SQLITE_DIGEST_KEY_PREFIX, uid, NULL);
+
+	if (!e_book_sqlite_get_key_value (bf->priv->sqlitedb, key, &stored, NULL)) {
+		g_free (key);
+		return FALSE;
+	}
+
+	digest = e_book_backend_decsync_compute_digest (vcard);
+	unchanged = g_strcmp0 (stored, digest) == 0;
+
+	g_free (digest);
+	g_free (stored);
+	g_free (key);
+
+	return unchanged;
+}
+
 /* For now just bump the revision and set it in the DB every
  * time the revision bumps, this is the safest approach and
  * its unclear so far if bumping the revision string for 
@@ -850,6 +925,7 @@ do_create (EBookBackendDecsync *bf,
 			value_json = json_object_new_string (vcards[ii]);
 			value_string = json_object_to_json_string (value_json);
 			decsync_set_entry(bf->priv->decsync, path, 2, key_string, value_string);
+			e_book_backend_decsync_set_digest (bf, id, vcards[ii]);
 			json_object_put (value_json);
 
 			g_free (id);
@@ -1085,6 +1161,13 @@ book_backend_decsync_dispose (GObject *object)
 
 	bf = E_BOOK_BACKEND_DECSYNC (object);
 
+	if (bf->priv->refresh_timeout_id) {
+		g_source_remove (bf->priv->refresh_timeout_id);
+		bf->priv->refresh_timeout_id = 0;
+	}
+
+	g_clear_pointer (&bf->priv->monitor, decsync_monitor_free);
+
 	g_rw_lock_writer_lock (&(bf->priv->lock));
 
 	if (bf->priv->cursors) {
@@ -1330,6 +1413,7 @@ book_backend_decsync_modify_contacts_sync_with_decsync (EBookBackendSync *backen
 			value_json = json_object_new_string (vcards[ii]);
 			value_string = json_object_to_json_string (value_json);
 			decsync_set_entry (bf->priv->decsync, path, 2, key_string, value_string);
+			e_book_backend_decsync_set_digest (bf, id, vcards[ii]);
 			json_object_put (value_json);
 		}
 
@@ -1536,6 +1620,7 @@ book_backend_decsync_remove_contacts_sync_with_decsync (EBookBackendSync *backen
 			key_string = json_object_to_json_string (NULL);
 			value_string = json_object_to_json_string (NULL);
 			decsync_set_entry (bf->priv->decsync, path, 2, key_string, value_string);
+			e_book_backend_decsync_set_digest (bf, uids[ii], NULL);
 		}
 
 		/* First load the EContacts which need to be removed, we might delete some
@@ -2159,7 +2244,7 @@ updateName (Extra *extra, const gchar *name)
 	}
 }
 
-static void
+static gboolean
 updateContacts (const gchar *uid, const gchar *vcard, Extra *extra)
 {
 	EBookBackend *backend;
@@ -2176,21 +2261,23 @@ updateContacts (const gchar *uid, const gchar *vcard, Extra *extra)
 	g_rw_lock_reader_lock (&(bf->priv->lock));
 	success = e_book_sqlite_has_contact (bf->priv->sqlitedb, uid, &exists, NULL);
 	g_rw_lock_reader_unlock (&(bf->priv->lock));
-	if (!success) return;
+	if (!success) return FALSE;
 
 	uids[0] = uid;
 	uids[1] = '\0';
 	vcards[0] = vcard;
 	vcards[1] = '\0';
 	if (exists)
-		book_backend_decsync_modify_contacts_sync_with_decsync (backend_sync, vcards, uids, 0, &out_contacts, NULL, NULL, FALSE);
+		success = book_backend_decsync_modify_contacts_sync_with_decsync (backend_sync, vcards, uids, 0, &out_contacts, NULL, NULL, FALSE);
 	else
-		book_backend_decsync_create_contacts_sync_with_decsync (backend_sync, vcards, uids, 0, &out_contacts, NULL, NULL, FALSE);
+		success = book_backend_decsync_create_contacts_sync_with_decsync (backend_sync, vcards, uids, 0, &out_contacts, NULL, NULL, FALSE);
 	for (link = out_contacts; link; link = g_slist_next (link)) {
 		e_book_backend_notify_update (backend, E_CONTACT (link->data));
 	}
 
 	g_slist_free_full (out_contacts, g_object_unref);
+
+	return success;
 }
 
 static void
@@ -2237,6 +2324,7 @@ static void
 resourcesListener (const gchar **path, int len, const char *datetime, const char *key_string, const char *value_string, void *extra_void)
 {
 	Extra *extra;
+	EBookBackendDecsync *bf;
 	const gchar *uid, *vcard;
 	json_object *value;
 
@@ -2247,12 +2335,25 @@ resourcesListener (const gchar **path, int len, const char *datetime, const char
 		return;
 	}
 	uid = path[0];
+	vcard = value ? json_object_get_string (value) : NULL;
+
+	/* other devices publish what we have again, our own entries too */
+	bf = E_BOOK_BACKEND_DECSYNC (extra->backend);
+	if (e_book_backend_decsync_is_unchanged (bf, uid, vcard)) {
+		bf->priv->resource_skips++;
+		d (printf ("skipping unchanged resource %s, %u skipped so far\n", uid, bf->priv->resource_skips));
+		json_object_put (value);
+		return;
+	}
+
 	if (value == NULL) {
 		removeContacts(uid, extra);
-	} else {
-		vcard = json_object_get_string (value);
-		updateContacts(uid, vcard, extra);
+		e_book_backend_decsync_set_digest (bf, uid, NULL);
+	} else if (updateContacts(uid, vcard, extra)) {
+		/* what failed may work out the next time */
+		e_book_backend_decsync_set_digest (bf, uid, vcard);
 	}
+	json_object_put (value);
 }
 
 static gboolean
@@ -2296,6 +2397,7 @@ book_backend_decsync_refresh_start (EBookBackendDecsync *bf)
 {
 	ESource *source;
 	ESourceRefresh *extension;
+	ESourceDecsync *decsync_extension;
 	const gchar *extension_name;
 	guint interval_in_minutes = 0;
 
@@ -2310,8 +2412,22 @@ book_backend_decsync_refresh_start (EBookBackendDecsync *bf)
 			interval_in_minutes = 30;
 	}
 
+	if (bf->priv->refresh_timeout_id) {
+		g_source_remove (bf->priv->refresh_timeout_id);
+		bf->priv->refresh_timeout_id = 0;
+	}
+
 	if (interval_in_minutes > 0) {
-		e_named_timeout_add_seconds (interval_in_minutes * 60, book_backend_decsync_refresh_cb, bf);
+		bf->priv->refresh_timeout_id = e_named_timeout_add_seconds (interval_in_minutes * 60, book_backend_decsync_refresh_cb, bf);
+
+		extension_name = E_SOURCE_EXTENSION_DECSYNC_BACKEND;
+		decsync_extension = e_source_get_extension (source, extension_name);
+		if (!bf->priv->monitor)
+			bf->priv->monitor = decsync_monitor_new (
+				e_source_decsync_get_decsync_dir (decsync_extension), "contacts",
+				e_source_decsync_get_collection (decsync_extension),
+				e_source_decsync_get_appid (decsync_extension),
+				book_backend_decsync_refresh_cb, bf);
 	}
 	return FALSE;
 }
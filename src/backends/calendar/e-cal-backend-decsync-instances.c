@@ -0,0 +1,447 @@
+/* Evolution calendar - iCalendar decsync backend.
+ *
+ * Copyright (C) 2018 Aldo Gunsing
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "evolution-decsync-config.h"
+
+#include "e-cal-backend-decsync-instances.h"
+
+/* The window is expanded this much wider, so that the instances which
+ * touch it are all there, whichever way the time zones go */
+#define WINDOW_PADDING (24 * 60 * 60)
+
+/* A component with more instances in its window is not kept expanded */
+#define MAX_INSTANCES 4096
+
+/* The occurrences are summarized for this many months, starting this
+ * many before the one they are made in */
+#define N_OCCURRENCE_MONTHS 64
+#define OCCURRENCE_MONTHS_PAST 24
+
+struct _ECalBackendDecsyncOccurrences {
+	/* when it was made */
+	gint64 now;
+	/* the start of the first instance which ends after now, G_MAXINT64
+	 * when there is none until the last month */
+	gint64 next;
+
+	/* bit N is set when there may be instances in the month N months
+	 * after first_month, counted as year * 12 + month - 1 */
+	gint first_month;
+	guint64 months;
+
+	/* there were more than MAX_INSTANCES, nothing is known */
+	guint n_instances;
+	gboolean overflow;
+};
+
+struct _ECalBackendDecsyncInstances {
+	ICalTimezone *default_zone;
+	gchar *zone_id;
+
+	/* the window expanded, no window while start > end */
+	gint64 start;
+	gint64 end;
+	/* there were more than MAX_INSTANCES in it */
+	gboolean overflow;
+
+	/* ECalBackendDecsyncInstance, sorted by start */
+	GArray *instances;
+	gint64 max_duration;
+};
+
+static const gchar *
+zone_id (ICalTimezone *zone)
+{
+	const gchar *id;
+
+	id = i_cal_timezone_get_tzid (zone);
+	if (!id)
+		id = i_cal_timezone_get_location (zone);
+
+	return id ? id : "UTC";
+}
+
+ECalBackendDecsyncInstances *
+e_cal_backend_decsync_instances_new (ICalTimezone *default_zone)
+{
+	ECalBackendDecsyncInstances *instances;
+
+	g_return_val_if_fail (default_zone != NULL, NULL);
+
+	instances = g_slice_new0 (ECalBackendDecsyncInstances);
+	instances->default_zone = g_object_ref (default_zone);
+	instances->zone_id = g_strdup (zone_id (default_zone));
+	instances->start = G_MAXINT64;
+	instances->end = G_MININT64;
+	instances->instances = g_array_new (FALSE, FALSE, sizeof (ECalBackendDecsyncInstance));
+
+	return instances;
+}
+
+void
+e_cal_backend_decsync_instances_free (ECalBackendDecsyncInstances *instances)
+{
+	if (!instances)
+		return;
+
+	g_object_unref (instances->default_zone);
+	g_free (instances->zone_id);
+	g_array_unref (instances->instances);
+	g_slice_free (ECalBackendDecsyncInstances, instances);
+}
+
+/* Whether @instances were expanded for @zone as the default time zone */
+gboolean
+e_cal_backend_decsync_instances_is_for_zone (ECalBackendDecsyncInstances *instances,
+                                             ICalTimezone *zone)
+{
+	g_return_val_if_fail (instances != NULL, FALSE);
+	g_return_val_if_fail (zone != NULL, FALSE);
+
+	return instances->default_zone == zone ||
+		g_strcmp0 (instances->zone_id, zone_id (zone)) == 0;
+}
+
+/* Gets the window the instances were expanded for; FALSE when they were
+ * not expanded yet */
+gboolean
+e_cal_backend_decsync_instances_get_window (ECalBackendDecsyncInstances *instances,
+                                            gint64 *out_start,
+                                            gint64 *out_end)
+{
+	g_return_val_if_fail (instances != NULL, FALSE);
+
+	if (instances->start > instances->end)
+		return FALSE;
+
+	*out_start = instances->start;
+	*out_end = instances->end;
+
+	return TRUE;
+}
+
+static gint64
+instance_time (ICalTime *tt,
+               ICalTimezone *default_zone)
+{
+	ICalTimezone *zone = NULL;
+	gint64 value;
+
+	if (!i_cal_time_is_date (tt))
+		zone = i_cal_time_get_timezone (tt);
+
+	value = i_cal_time_as_timet_with_zone (tt, zone ? zone : default_zone);
+
+	g_clear_object (&zone);
+
+	return value;
+}
+
+static gboolean
+add_instance_cb (ICalComponent *icomp,
+                 ICalTime *instance_start,
+                 ICalTime *instance_end,
+                 gpointer user_data,
+                 GCancellable *cancellable,
+                 GError **error)
+{
+	ECalBackendDecsyncInstances *instances = user_data;
+	ECalBackendDecsyncInstance instance;
+
+	if (instances->instances->len >= MAX_INSTANCES) {
+		instances->overflow = TRUE;
+		return FALSE;
+	}
+
+	instance.start = instance_time (instance_start, instances->default_zone);
+	instance.end = instance_time (instance_end, instances->default_zone);
+	instance.is_date = i_cal_time_is_date (instance_start);
+
+	g_array_append_val (instances->instances, instance);
+
+	return TRUE;
+}
+
+static gint
+compare_instances (gconstpointer a,
+                   gconstpointer b)
+{
+	const ECalBackendDecsyncInstance *instance_a = a;
+	const ECalBackendDecsyncInstance *instance_b = b;
+
+	if (instance_a->start != instance_b->start)
+		return instance_a->start < instance_b->start ? -1 : 1;
+
+	return instance_a->end < instance_b->end ? -1 : instance_a->end > instance_b->end ? 1 : 0;
+}
+
+/* Expands the instances of @icomp between @start and @end, replacing what
+ * was expanded before */
+void
+e_cal_backend_decsync_instances_expand (ECalBackendDecsyncInstances *instances,
+                                        ICalComponent *icomp,
+                                        gint64 start,
+                                        gint64 end,
+                                        ECalRecurResolveTimezoneCb resolve_tzid,
+                                        gpointer resolve_tzid_data)
+{
+	ICalTimezone *utc_zone;
+	ICalTime *starttt, *endtt;
+	guint ii;
+
+	g_return_if_fail (instances != NULL);
+	g_return_if_fail (icomp != NULL);
+	g_return_if_fail (start <= end);
+
+	g_array_set_size (instances->instances, 0);
+	instances->overflow = FALSE;
+	instances->max_duration = 0;
+
+	utc_zone = i_cal_timezone_get_utc_timezone ();
+	starttt = i_cal_time_new_from_timet_with_zone (start - WINDOW_PADDING, FALSE, utc_zone);
+	endtt = i_cal_time_new_from_timet_with_zone (end + WINDOW_PADDING, FALSE, utc_zone);
+
+	e_cal_recur_generate_instances_sync (
+		icomp, starttt, endtt,
+		add_instance_cb, instances,
+		resolve_tzid, resolve_tzid_data,
+		instances->default_zone,
+		NULL, NULL);
+
+	g_object_unref (starttt);
+	g_object_unref (endtt);
+
+	if (instances->overflow)
+		g_array_set_size (instances->instances, 0);
+
+	g_array_sort (instances->instances, compare_instances);
+
+	for (ii = 0; ii < instances->instances->len; ii++) {
+		ECalBackendDecsyncInstance *instance;
+
+		instance = &g_array_index (instances->instances, ECalBackendDecsyncInstance, ii);
+		instances->max_duration = MAX (instances->max_duration, instance->end - instance->start);
+	}
+
+	instances->start = start;
+	instances->end = end;
+}
+
+/* Tells whether the component occurs between @start and @end, in
+ * @out_occurs, and adds the instances which do to @hits, when it is not
+ * NULL.  Returns FALSE when that is not certain from the instances, or the
+ * range is not within the window. */
+gboolean
+e_cal_backend_decsync_instances_lookup (ECalBackendDecsyncInstances *instances,
+                                        gint64 start,
+                                        gint64 end,
+                                        GArray *hits,
+                                        gboolean *out_occurs)
+{
+	guint lo, hi, ii, n_hits;
+	gboolean occurs = FALSE;
+
+	g_return_val_if_fail (instances != NULL, FALSE);
+	g_return_val_if_fail (out_occurs != NULL, FALSE);
+
+	if (instances->overflow || start < instances->start || end > instances->end)
+		return FALSE;
+
+	n_hits = hits ? hits->len : 0;
+
+	/* the first instance which may reach the range */
+	lo = 0;
+	hi = instances->instances->len;
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+
+		if (g_array_index (instances->instances, ECalBackendDecsyncInstance, mid).start < start - instances->max_duration)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (ii = lo; ii < instances->instances->len; ii++) {
+		ECalBackendDecsyncInstance *instance;
+
+		instance = &g_array_index (instances->instances, ECalBackendDecsyncInstance, ii);
+
+		if (instance->start > end)
+			break;
+
+		/* touching the range only */
+		if (instance->start == end || instance->end == start) {
+			if (hits)
+				g_array_set_size (hits, n_hits);
+			return FALSE;
+		}
+
+		if (instance->start < end && instance->end > start) {
+			occurs = TRUE;
+
+			if (hits)
+				g_array_append_val (hits, *instance);
+			else
+				break;
+		}
+	}
+
+	*out_occurs = occurs;
+
+	return TRUE;
+}
+
+static gint
+month_of_time (gint64 value)
+{
+	GDateTime *dt;
+	gint month;
+
+	dt = g_date_time_new_from_unix_utc (value);
+	if (!dt)
+		return value < 0 ? G_MININT : G_MAXINT;
+
+	month = g_date_time_get_year (dt) * 12 + g_date_time_get_month (dt) - 1;
+
+	g_date_time_unref (dt);
+
+	return month;
+}
+
+static gint64
+time_of_month (gint month)
+{
+	GDateTime *dt;
+	gint64 value;
+
+	dt = g_date_time_new_utc (month / 12, month % 12 + 1, 1, 0, 0, 0);
+	value = g_date_time_to_unix (dt);
+
+	g_date_time_unref (dt);
+
+	return value;
+}
+
+static gboolean
+add_occurrence_cb (ICalComponent *icomp,
+                   ICalTime *instance_start,
+                   ICalTime *instance_end,
+                   gpointer user_data,
+                   GCancellable *cancellable,
+                   GError **error)
+{
+	ECalBackendDecsyncOccurrences *occurrences = user_data;
+	ICalTimezone *utc_zone;
+	gint64 start, end;
+	gint first, last, month;
+
+	utc_zone = i_cal_timezone_get_utc_timezone ();
+	start = instance_time (instance_start, utc_zone);
+	end = MAX (instance_time (instance_end, utc_zone), start);
+
+	if (end + WINDOW_PADDING >= occurrences->now)
+		occurrences->next = MIN (occurrences->next, start);
+
+	first = MAX (month_of_time (start - WINDOW_PADDING) - occurrences->first_month, 0);
+	last = MIN (month_of_time (end + WINDOW_PADDING) - occurrences->first_month, N_OCCURRENCE_MONTHS - 1);
+
+	for (month = first; month <= last; month++)
+		occurrences->months |= G_GUINT64_CONSTANT (1) << month;
+
+	if (++occurrences->n_instances >= MAX_INSTANCES) {
+		occurrences->overflow = TRUE;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Summarizes when @icomp occurs, around @now */
+ECalBackendDecsyncOccurrences *
+e_cal_backend_decsync_occurrences_new (ICalComponent *icomp,
+                                       gint64 now,
+                                       ECalRecurResolveTimezoneCb resolve_tzid,
+                                       gpointer resolve_tzid_data)
+{
+	ECalBackendDecsyncOccurrences *occurrences;
+	ICalTimezone *utc_zone;
+	ICalTime *starttt, *endtt;
+
+	g_return_val_if_fail (icomp != NULL, NULL);
+
+	occurrences = g_slice_new0 (ECalBackendDecsyncOccurrences);
+	occurrences->now = now;
+	occurrences->next = G_MAXINT64;
+	occurrences->first_month = month_of_time (now) - OCCURRENCE_MONTHS_PAST;
+
+	utc_zone = i_cal_timezone_get_utc_timezone ();
+	starttt = i_cal_time_new_from_timet_with_zone (time_of_month (occurrences->first_month) - WINDOW_PADDING, FALSE, utc_zone);
+	endtt = i_cal_time_new_from_timet_with_zone (time_of_month (occurrences->first_month + N_OCCURRENCE_MONTHS) + WINDOW_PADDING, FALSE, utc_zone);
+
+	e_cal_recur_generate_instances_sync (
+		icomp, starttt, endtt,
+		add_occurrence_cb, occurrences,
+		resolve_tzid, resolve_tzid_data,
+		utc_zone,
+		NULL, NULL);
+
+	g_object_unref (starttt);
+	g_object_unref (endtt);
+
+	return occurrences;
+}
+
+void
+e_cal_backend_decsync_occurrences_free (ECalBackendDecsyncOccurrences *occurrences)
+{
+	if (occurrences)
+		g_slice_free (ECalBackendDecsyncOccurrences, occurrences);
+}
+
+/* Whether the component may occur between @start and @end, G_MININT64 and
+ * G_MAXINT64 for no bound; FALSE only when it certainly does not */
+gboolean
+e_cal_backend_decsync_occurrences_may_occur (ECalBackendDecsyncOccurrences *occurrences,
+                                             gint64 start,
+                                             gint64 end)
+{
+	gint first, last, month;
+
+	g_return_val_if_fail (occurrences != NULL, TRUE);
+
+	if (occurrences->overflow || start == G_MININT64 || end == G_MAXINT64)
+		return TRUE;
+
+	/* between now and the next instance */
+	if (start >= occurrences->now && occurrences->next != G_MAXINT64 &&
+	    end < occurrences->next - WINDOW_PADDING)
+		return FALSE;
+
+	first = month_of_time (start);
+	last = month_of_time (end);
+
+	if (first < occurrences->first_month ||
+	    last >= occurrences->first_month + N_OCCURRENCE_MONTHS)
+		return TRUE;
+
+	for (month = first; month <= last; month++) {
+		if ((occurrences->months & (G_GUINT64_CONSTANT (1) << (month - occurrences->first_month))) != 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
@@ -0,0 +1,92 @@
+/* Evolution calendar - iCalendar decsync backend.
+ *
+ * Copyright (C) 2018 Aldo Gunsing
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef E_CAL_BACKEND_DECSYNC_INSTANCES_H
+#define E_CAL_BACKEND_DECSYNC_INSTANCES_H
+
+#include <libecal/libecal.h>
+
+G_BEGIN_DECLS
+
+/* The instances of a recurring component within a window of time, as
+ * e_cal_recur_generate_instances_sync() expands them for a default time
+ * zone, kept to answer which of them fall in a range without expanding
+ * them again.  The times are seconds since the epoch; those of floating
+ * and all-day instances are taken in the default time zone.
+ *
+ * An instance which only touches the range, ending where it starts or
+ * starting where it ends, makes the answer uncertain: the caller has to
+ * expand the component itself then.  So does a component with more
+ * instances in the window than are kept. */
+typedef struct _ECalBackendDecsyncInstances ECalBackendDecsyncInstances;
+
+typedef struct {
+	gint64 start;
+	gint64 end;
+	gboolean is_date;
+} ECalBackendDecsyncInstance;
+
+ECalBackendDecsyncInstances *
+		e_cal_backend_decsync_instances_new
+						(ICalTimezone *default_zone);
+void		e_cal_backend_decsync_instances_free
+						(ECalBackendDecsyncInstances *instances);
+gboolean	e_cal_backend_decsync_instances_is_for_zone
+						(ECalBackendDecsyncInstances *instances,
+						 ICalTimezone *zone);
+gboolean	e_cal_backend_decsync_instances_get_window
+						(ECalBackendDecsyncInstances *instances,
+						 gint64 *out_start,
+						 gint64 *out_end);
+void		e_cal_backend_decsync_instances_expand
+						(ECalBackendDecsyncInstances *instances,
+						 ICalComponent *icomp,
+						 gint64 start,
+						 gint64 end,
+						 ECalRecurResolveTimezoneCb resolve_tzid,
+						 gpointer resolve_tzid_data);
+gboolean	e_cal_backend_decsync_instances_lookup
+						(ECalBackendDecsyncInstances *instances,
+						 gint64 start,
+						 gint64 end,
+						 GArray *hits,
+						 gboolean *out_occurs);
+
+/* A summary of when a recurring component occurs, to tell without
+ * expanding it that it does not occur in a range: the months around the
+ * time it was made in which it has instances, and when the first instance
+ * after that time starts.  It is made once, by expanding the component
+ * in UTC; the months are widened by a day on each side, so that it holds
+ * for any default time zone. */
+typedef struct _ECalBackendDecsyncOccurrences ECalBackendDecsyncOccurrences;
+
+ECalBackendDecsyncOccurrences *
+		e_cal_backend_decsync_occurrences_new
+						(ICalComponent *icomp,
+						 gint64 now,
+						 ECalRecurResolveTimezoneCb resolve_tzid,
+						 gpointer resolve_tzid_data);
+void		e_cal_backend_decsync_occurrences_free
+						(ECalBackendDecsyncOccurrences *occurrences);
+gboolean	e_cal_backend_decsync_occurrences_may_occur
+						(ECalBackendDecsyncOccurrences *occurrences,
+						 gint64 start,
+						 gint64 end);
+
+G_END_DECLS
+
+#endif /* E_CAL_BACKEND_DECSYNC_INSTANCES_H */
@@ -0,0 +1,158 @@
+/* Evolution calendar - iCalendar decsync backend.
+ *
+ * Copyright (C) 2018 Aldo Gunsing
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Compares the time index of the backend with EIntervalTree of
+ * libedata-cal, for 10k, 100k and 1M spans: building it from all of them,
+ * then searching it for a week at random places */
+
+#include "evolution-decsync-config.h"
+
+#include <stdlib.h>
+#include <libedata-cal/libedata-cal.h>
+
+#include "e-cal-backend-decsync-intervals.h"
+
+static gint bench_searches = 10000;
+
+static GOptionEntry bench_entries[] =
+{
+  { "searches", 's', 0, G_OPTION_ARG_INT, &bench_searches, "Number of searches for each size", NULL },
+  { NULL }
+};
+
+static gdouble
+bench_seconds_since (gint64 started)
+{
+	return (gdouble) (g_get_monotonic_time () - started) / G_USEC_PER_SEC;
+}
+
+static void
+bench_run (gint n_intervals)
+{
+	ECalBackendDecsyncIntervals *intervals;
+	EIntervalTree *tree;
+	ECalComponent **comps;
+	GPtrArray *hits;
+	GRand *rand;
+	gint64 *starts, *ends, *search_starts, started;
+	gdouble tree_build, tree_search, index_build, index_search;
+	guint64 tree_hits = 0, index_hits = 0;
+	gint ii;
+
+	/* hourly spans from 2020, every 50th lasting a year, every 1000th
+	 * with no end */
+	comps = g_new (ECalComponent *, n_intervals);
+	starts = g_new (gint64, n_intervals);
+	ends = g_new (gint64, n_intervals);
+
+	for (ii = 0; ii < n_intervals; ii++) {
+		gchar *uid;
+
+		comps[ii] = e_cal_component_new_vtype (E_CAL_COMPONENT_EVENT);
+		uid = g_strdup_printf ("bench-%d", ii);
+		e_cal_component_set_uid (comps[ii], uid);
+		g_free (uid);
+
+		starts[ii] = 1577836800 + (gint64) ii * 3600;
+		if (ii % 1000 == 0)
+			ends[ii] = G_MAXINT64;
+		else if (ii % 50 == 0)
+			ends[ii] = starts[ii] + 365 * 24 * 3600;
+		else
+			ends[ii] = starts[ii] + 3600;
+	}
+
+	rand = g_rand_new_with_seed (n_intervals);
+	search_starts = g_new (gint64, bench_searches);
+	for (ii = 0; ii < bench_searches; ii++)
+		search_starts[ii] = 1577836800 + (gint64) g_rand_double_range (rand, 0, (gdouble) n_intervals * 3600);
+	g_rand_free (rand);
+
+	started = g_get_monotonic_time ();
+	tree = e_intervaltree_new ();
+	for (ii = 0; ii < n_intervals; ii++)
+		e_intervaltree_insert (tree, starts[ii], ends[ii] == G_MAXINT64 ? -1 : ends[ii], comps[ii]);
+	tree_build = bench_seconds_since (started);
+
+	started = g_get_monotonic_time ();
+	for (ii = 0; ii < bench_searches; ii++) {
+		GList *list;
+
+		list = e_intervaltree_search (tree, search_starts[ii], search_starts[ii] + 7 * 24 * 3600);
+		tree_hits += g_list_length (list);
+		g_list_free_full (list, g_object_unref);
+	}
+	tree_search = bench_seconds_since (started);
+
+	started = g_get_monotonic_time ();
+	intervals = e_cal_backend_decsync_intervals_new ();
+	e_cal_backend_decsync_intervals_freeze (intervals);
+	for (ii = 0; ii < n_intervals; ii++)
+		e_cal_backend_decsync_intervals_insert (intervals, starts[ii], ends[ii], comps[ii]);
+	e_cal_backend_decsync_intervals_thaw (intervals);
+	index_build = bench_seconds_since (started);
+
+	hits = g_ptr_array_sized_new (1024);
+
+	started = g_get_monotonic_time ();
+	for (ii = 0; ii < bench_searches; ii++) {
+		g_ptr_array_set_size (hits, 0);
+		index_hits += e_cal_backend_decsync_intervals_search (intervals,
+			search_starts[ii], search_starts[ii] + 7 * 24 * 3600, hits);
+	}
+	index_search = bench_seconds_since (started);
+
+	g_print ("%8d spans: build %8.3f s (tree %8.3f s), %d searches %8.3f s (tree %8.3f s), %.1f hits each\n",
+		n_intervals, index_build, tree_build, bench_searches, index_search, tree_search,
+		(gdouble) index_hits / MAX (bench_searches, 1));
+
+	if (index_hits != tree_hits)
+		g_print ("hits differ: %" G_GUINT64_FORMAT " vs %" G_GUINT64_FORMAT " in the tree\n", index_hits, tree_hits);
+
+	g_ptr_array_unref (hits);
+	e_cal_backend_decsync_intervals_free (intervals);
+	e_intervaltree_destroy (tree);
+
+	for (ii = 0; ii < n_intervals; ii++)
+		g_object_unref (comps[ii]);
+
+	g_free (search_starts);
+	g_free (ends);
+	g_free (starts);
+	g_free (comps);
+}
+
+gint
+main (gint argc,
+      gchar **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+
+	context = g_option_context_new ("- time index benchmark for the decsync calendar backend");
+	g_option_context_add_main_entries (context, bench_entries, GETTEXT_PACKAGE);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_print ("option parsing failed: %s\n", error->message);
+		exit (1);
+	}
+
+	bench_run (10000);
+	bench_run (100000);
+	bench_run (1000000);
+
+	return 0;
+}
@@ -0,0 +1,471 @@
+/* Evolution calendar - iCalendar decsync backend.
+ *
+ * Copyright (C) 2018 Aldo Gunsing
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "evolution-decsync-config.h"
+
+#include "e-cal-backend-decsync-intervals.h"
+
+/* Below this many sorted spans, a search looks at each of them */
+#define LINEAR_SEARCH_SIZE 16
+
+/* Subtrees of at most this level are looked at node by node */
+#define SCAN_SUBTREE_LEVEL 3
+
+/* The tail is merged into the sorted spans once it is longer than this,
+ * or than the square root of their number, whichever is more */
+#define MIN_TAIL_LENGTH 64
+
+typedef struct {
+	gint64 start;
+	gint64 end;
+	ECalComponent *comp;
+	gchar *id;
+} Interval;
+
+struct _ECalBackendDecsyncIntervals {
+	/* Sorted by start.  The node at index i of the implicit tree has
+	 * as many trailing 1 bits as its level; max_ends holds the largest
+	 * end in its subtree.  A removed span keeps its place, with no
+	 * component, until the next merge. */
+	gint64 *starts;
+	gint64 *ends;
+	gint64 *max_ends;
+	ECalComponent **comps;
+	gchar **ids;
+	guint n_sorted;
+	guint n_removed;
+	gint root_level; /* -1 when there are no sorted spans */
+
+	/* Interval, added since the last merge, in no order */
+	GArray *tail;
+
+	/* UID and RECURRENCE-ID of a component -> i + 1 for the sorted span
+	 * i, -(i + 1) for the span i of the tail; the keys belong to ids and
+	 * to the tail */
+	GHashTable *positions;
+
+	guint freeze_count;
+};
+
+ECalBackendDecsyncIntervals *
+e_cal_backend_decsync_intervals_new (void)
+{
+	ECalBackendDecsyncIntervals *intervals;
+
+	intervals = g_slice_new0 (ECalBackendDecsyncIntervals);
+	intervals->root_level = -1;
+	intervals->tail = g_array_new (FALSE, FALSE, sizeof (Interval));
+	intervals->positions = g_hash_table_new (g_str_hash, g_str_equal);
+
+	return intervals;
+}
+
+void
+e_cal_backend_decsync_intervals_free (ECalBackendDecsyncIntervals *intervals)
+{
+	guint ii;
+
+	if (!intervals)
+		return;
+
+	for (ii = 0; ii < intervals->n_sorted; ii++) {
+		if (intervals->comps[ii])
+			g_object_unref (intervals->comps[ii]);
+		g_free (intervals->ids[ii]);
+	}
+
+	for (ii = 0; ii < intervals->tail->len; ii++) {
+		Interval *interval = &g_array_index (intervals->tail, Interval, ii);
+
+		g_object_unref (interval->comp);
+		g_free (interval->id);
+	}
+
+	g_free (intervals->starts);
+	g_free (intervals->ends);
+	g_free (intervals->max_ends);
+	g_free (intervals->comps);
+	g_free (intervals->ids);
+	g_array_unref (intervals->tail);
+	g_hash_table_destroy (intervals->positions);
+	g_slice_free (ECalBackendDecsyncIntervals, intervals);
+}
+
+/* Fills max_ends bottom up; the last nodes of a level may lack a right
+ * subtree, or have one whose root is past the end of the arrays */
+static void
+intervals_build_tree (ECalBackendDecsyncIntervals *intervals)
+{
+	gint64 *ends = intervals->ends, *max_ends = intervals->max_ends;
+	gint64 n = intervals->n_sorted, ii, last_ii = 0, last = G_MININT64;
+	gint level;
+
+	if (!n) {
+		intervals->root_level = -1;
+		return;
+	}
+
+	for (ii = 0; ii < n; ii += 2) {
+		last_ii = ii;
+		max_ends[ii] = last = ends[ii];
+	}
+
+	for (level = 1; ((gint64) 1 << level) <= n; level++) {
+		gint64 half = (gint64) 1 << (level - 1);
+
+		for (ii = (half << 1) - 1; ii < n; ii += half << 2) {
+			gint64 max_end = ends[ii];
+
+			max_end = MAX (max_end, max_ends[ii - half]);
+			max_end = MAX (max_end, ii + half < n ? max_ends[ii + half] : last);
+			max_ends[ii] = max_end;
+		}
+
+		/* the parent of the rightmost node */
+		last_ii = (last_ii >> level) & 1 ? last_ii - half : last_ii + half;
+		if (last_ii < n && max_ends[last_ii] > last)
+			last = max_ends[last_ii];
+	}
+
+	intervals->root_level = level - 1;
+}
+
+static gint
+compare_intervals (gconstpointer a,
+                   gconstpointer b)
+{
+	const Interval *interval_a = a, *interval_b = b;
+
+	if (interval_a->start == interval_b->start)
+		return 0;
+
+	return interval_a->start < interval_b->start ? -1 : 1;
+}
+
+/* Merges the tail into the sorted spans, dropping the removed ones */
+static void
+intervals_merge (ECalBackendDecsyncIntervals *intervals)
+{
+	gint64 *starts, *ends;
+	ECalComponent **comps;
+	gchar **ids;
+	guint n, ii = 0, jj = 0, kk = 0;
+
+	n = intervals->n_sorted - intervals->n_removed + intervals->tail->len;
+
+	starts = g_new (gint64, n);
+	ends = g_new (gint64, n);
+	comps = g_new (ECalComponent *, n);
+	ids = g_new (gchar *, n);
+
+	g_array_sort (intervals->tail, compare_intervals);
+
+	while (ii < intervals->n_sorted || jj < intervals->tail->len) {
+		Interval *interval = NULL;
+
+		if (ii < intervals->n_sorted && !intervals->comps[ii]) {
+			ii++;
+			continue;
+		}
+
+		if (jj < intervals->tail->len)
+			interval = &g_array_index (intervals->tail, Interval, jj);
+
+		if (ii < intervals->n_sorted && (!interval || intervals->starts[ii] <= interval->start)) {
+			starts[kk] = intervals->starts[ii];
+			ends[kk] = intervals->ends[ii];
+			comps[kk] = intervals->comps[ii];
+			ids[kk] = intervals->ids[ii];
+			ii++;
+		} else {
+			starts[kk] = interval->start;
+			ends[kk] = interval->end;
+			comps[kk] = interval->comp;
+			ids[kk] = interval->id;
+			jj++;
+		}
+
+		g_hash_table_insert (intervals->positions, ids[kk], GINT_TO_POINTER (kk + 1));
+		kk++;
+	}
+
+	g_free (intervals->starts);
+	g_free (intervals->ends);
+	g_free (intervals->max_ends);
+	g_free (intervals->comps);
+	g_free (intervals->ids);
+
+	intervals->starts = starts;
+	intervals->ends = ends;
+	intervals->max_ends = g_new (gint64, n);
+	intervals->comps = comps;
+	intervals->ids = ids;
+	intervals->n_sorted = n;
+	intervals->n_removed = 0;
+	g_array_set_size (intervals->tail, 0);
+
+	intervals_build_tree (intervals);
+}
+
+static void
+intervals_maybe_merge (ECalBackendDecsyncIntervals *intervals)
+{
+	guint max_tail;
+
+	if (intervals->freeze_count)
+		return;
+
+	/* about the square root, which balances the cost of merging with
+	 * the cost of searching the tail */
+	max_tail = MAX (MIN_TAIL_LENGTH, 1u << (g_bit_storage (intervals->n_sorted) / 2));
+
+	if (intervals->tail->len > max_tail ||
+	    intervals->n_removed > MAX (MIN_TAIL_LENGTH, intervals->n_sorted / 4))
+		intervals_merge (intervals);
+}
+
+static gchar *
+intervals_make_id (const gchar *uid,
+                   const gchar *rid)
+{
+	return g_strconcat (uid ? uid : "", "\n", rid ? rid : "", NULL);
+}
+
+static gboolean
+intervals_remove_id (ECalBackendDecsyncIntervals *intervals,
+                     const gchar *id)
+{
+	gpointer value;
+	gint position;
+
+	if (!g_hash_table_lookup_extended (intervals->positions, id, NULL, &value))
+		return FALSE;
+
+	g_hash_table_remove (intervals->positions, id);
+	position = GPOINTER_TO_INT (value);
+
+	if (position > 0) {
+		g_clear_object (&intervals->comps[position - 1]);
+		g_clear_pointer (&intervals->ids[position - 1], g_free);
+		intervals->n_removed++;
+	} else {
+		guint index = -position - 1, last = intervals->tail->len - 1;
+		Interval *interval = &g_array_index (intervals->tail, Interval, index);
+
+		g_object_unref (interval->comp);
+		g_free (interval->id);
+
+		/* the last one of the tail takes its place */
+		if (index != last) {
+			*interval = g_array_index (intervals->tail, Interval, last);
+			g_hash_table_insert (intervals->positions, interval->id, GINT_TO_POINTER (-(gint) (index + 1)));
+		}
+
+		g_array_set_size (intervals->tail, last);
+	}
+
+	intervals_maybe_merge (intervals);
+
+	return TRUE;
+}
+
+/* Adds @comp, which occurs between @start and @end, in place of any
+ * component with the same UID and RECURRENCE-ID */
+void
+e_cal_backend_decsync_intervals_insert (ECalBackendDecsyncIntervals *intervals,
+                                        gint64 start,
+                                        gint64 end,
+                                        ECalComponent *comp)
+{
+	Interval interval;
+	gchar *rid;
+
+	g_return_if_fail (intervals != NULL);
+	g_return_if_fail (comp != NULL);
+
+	rid = e_cal_component_get_recurid_as_string (comp);
+	interval.id = intervals_make_id (e_cal_component_get_uid (comp), rid);
+	g_free (rid);
+
+	intervals_remove_id (intervals, interval.id);
+
+	interval.start = start;
+	interval.end = end;
+	interval.comp = g_object_ref (comp);
+
+	g_array_append_val (intervals->tail, interval);
+	g_hash_table_insert (intervals->positions, interval.id, GINT_TO_POINTER (-(gint) intervals->tail->len));
+
+	intervals_maybe_merge (intervals);
+}
+
+/* Removes the component with @uid and @rid; returns whether there was one */
+gboolean
+e_cal_backend_decsync_intervals_remove (ECalBackendDecsyncIntervals *intervals,
+                                        const gchar *uid,
+                                        const gchar *rid)
+{
+	gboolean removed;
+	gchar *id;
+
+	g_return_val_if_fail (intervals != NULL, FALSE);
+
+	id = intervals_make_id (uid, rid);
+	removed = intervals_remove_id (intervals, id);
+	g_free (id);
+
+	return removed;
+}
+
+/* Defers merging what is added until the matching thaw, which then sorts
+ * it all at once; meant for adding many components in a row */
+void
+e_cal_backend_decsync_intervals_freeze (ECalBackendDecsyncIntervals *intervals)
+{
+	g_return_if_fail (intervals != NULL);
+
+	intervals->freeze_count++;
+}
+
+void
+e_cal_backend_decsync_intervals_thaw (ECalBackendDecsyncIntervals *intervals)
+{
+	g_return_if_fail (intervals != NULL);
+	g_return_if_fail (intervals->freeze_count > 0);
+
+	intervals->freeze_count--;
+
+	if (!intervals->freeze_count && (intervals->tail->len || intervals->n_removed))
+		intervals_merge (intervals);
+}
+
+typedef struct {
+	gint64 node;
+	gint level;
+	gboolean left_done;
+} SearchFrame;
+
+static guint
+intervals_search_sorted (ECalBackendDecsyncIntervals *intervals,
+                         gint64 start,
+                         gint64 end,
+                         GPtrArray *hits)
+{
+	const gint64 *starts = intervals->starts, *ends = intervals->ends;
+	const gint64 *max_ends = intervals->max_ends;
+	ECalComponent **comps = intervals->comps;
+	gint64 n = intervals->n_sorted, ii;
+	SearchFrame stack[64];
+	guint depth = 0, n_hits = 0;
+
+	if (n < LINEAR_SEARCH_SIZE) {
+		for (ii = 0; ii < n && starts[ii] <= end; ii++) {
+			if (comps[ii] && ends[ii] >= start) {
+				g_ptr_array_add (hits, comps[ii]);
+				n_hits++;
+			}
+		}
+
+		return n_hits;
+	}
+
+	stack[depth].node = ((gint64) 1 << intervals->root_level) - 1;
+	stack[depth].level = intervals->root_level;
+	stack[depth++].left_done = FALSE;
+
+	while (depth) {
+		SearchFrame frame = stack[--depth];
+
+		if (frame.level <= SCAN_SUBTREE_LEVEL) {
+			gint64 first, last;
+
+			first = frame.node >> frame.level << frame.level;
+			last = MIN (first + ((gint64) 1 << (frame.level + 1)) - 1, n);
+
+			for (ii = first; ii < last && starts[ii] <= end; ii++) {
+				if (comps[ii] && ends[ii] >= start) {
+					g_ptr_array_add (hits, comps[ii]);
+					n_hits++;
+				}
+			}
+		} else if (!frame.left_done) {
+			gint64 left = frame.node - ((gint64) 1 << (frame.level - 1));
+
+			/* back to this node once the left subtree is done */
+			frame.left_done = TRUE;
+			stack[depth++] = frame;
+
+			/* a left child past the end may still have nodes
+			 * within it in its own subtree */
+			if (left >= n || max_ends[left] >= start) {
+				stack[depth].node = left;
+				stack[depth].level = frame.level - 1;
+				stack[depth++].left_done = FALSE;
+			}
+		} else if (frame.node < n && starts[frame.node] <= end) {
+			if (comps[frame.node] && ends[frame.node] >= start) {
+				g_ptr_array_add (hits, comps[frame.node]);
+				n_hits++;
+			}
+
+			stack[depth].node = frame.node + ((gint64) 1 << (frame.level - 1));
+			stack[depth].level = frame.level - 1;
+			stack[depth++].left_done = FALSE;
+		}
+	}
+
+	return n_hits;
+}
+
+/* Appends the components which occur between @start and @end to @hits,
+ * which the caller can reuse between searches; returns how many there
+ * were.  The sorted ones come first, in the order of their start. */
+guint
+e_cal_backend_decsync_intervals_search (ECalBackendDecsyncIntervals *intervals,
+                                        gint64 start,
+                                        gint64 end,
+                                        GPtrArray *hits)
+{
+	guint n_hits = 0, ii;
+
+	g_return_val_if_fail (intervals != NULL, 0);
+	g_return_val_if_fail (hits != NULL, 0);
+
+	if (intervals->n_sorted)
+		n_hits = intervals_search_sorted (intervals, start, end, hits);
+
+	for (ii = 0; ii < intervals->tail->len; ii++) {
+		Interval *interval = &g_array_index (intervals->tail, Interval, ii);
+
+		if (interval->start <= end && interval->end >= start) {
+			g_ptr_array_add (hits, interval->comp);
+			n_hits++;
+		}
+	}
+
+	return n_hits;
+}
+
+/* The number of components in @intervals, which may be NULL */
+guint
+e_cal_backend_decsync_intervals_get_length (ECalBackendDecsyncIntervals *intervals)
+{
+	if (!intervals)
+		return 0;
+
+	return intervals->n_sorted - intervals->n_removed + intervals->tail->len;
+}
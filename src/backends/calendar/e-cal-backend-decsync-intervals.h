@@ -0,0 +1,65 @@
+/* Evolution calendar - iCalendar decsync backend.
+ *
+ * Copyright (C) 2018 Aldo Gunsing
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef E_CAL_BACKEND_DECSYNC_INTERVALS_H
+#define E_CAL_BACKEND_DECSYNC_INTERVALS_H
+
+#include <libecal/libecal.h>
+
+G_BEGIN_DECLS
+
+/* An index of the time spans of components, answering which of them
+ * overlap a time range.  The spans are kept sorted by their start in flat
+ * arrays, laid out as an implicit binary tree; what is added later goes
+ * to a small unsorted tail first, which is merged in now and then.  Both
+ * ends are inclusive, G_MININT64 and G_MAXINT64 stand for no bound.  As
+ * with EIntervalTree, the components are known by their UID and
+ * RECURRENCE-ID, and referenced while they are in the index.
+ *
+ * The index has no locks of its own: searching only reads it, thus it
+ * can be done from several threads at once as long as no one changes it. */
+typedef struct _ECalBackendDecsyncIntervals ECalBackendDecsyncIntervals;
+
+ECalBackendDecsyncIntervals *
+		e_cal_backend_decsync_intervals_new
+						(void);
+void		e_cal_backend_decsync_intervals_free
+						(ECalBackendDecsyncIntervals *intervals);
+void		e_cal_backend_decsync_intervals_insert
+						(ECalBackendDecsyncIntervals *intervals,
+						 gint64 start,
+						 gint64 end,
+						 ECalComponent *comp);
+gboolean	e_cal_backend_decsync_intervals_remove
+						(ECalBackendDecsyncIntervals *intervals,
+						 const gchar *uid,
+						 const gchar *rid);
+void		e_cal_backend_decsync_intervals_freeze
+						(ECalBackendDecsyncIntervals *intervals);
+void		e_cal_backend_decsync_intervals_thaw
+						(ECalBackendDecsyncIntervals *intervals);
+guint		e_cal_backend_decsync_intervals_search
+						(ECalBackendDecsyncIntervals *intervals,
+						 gint64 start,
+						 gint64 end,
+						 GPtrArray *hits);
+guint		e_cal_backend_decsync_intervals_get_length
+						(ECalBackendDecsyncIntervals *intervals);
+
+G_END_DECLS
+
+#endif /* E_CAL_BACKEND_DECSYNC_INTERVALS_H */
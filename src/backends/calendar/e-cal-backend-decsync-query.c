@@ -0,0 +1,964 @@
+/* Evolution calendar - iCalendar decsync backend.
+ *
+ * Copyright (C) 2018 Aldo Gunsing
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "evolution-decsync-config.h"
+
+#include <string.h>
+
+#include "e-cal-backend-decsync-query.h"
+
+/* What a component was indexed by, to take it out again */
+typedef struct {
+	guint text_id; /* its index in texts */
+	gchar *uid;
+	gchar **categories; /* case folded */
+	gboolean completed;
+	gboolean has_alarms;
+	gboolean recurs;
+} IndexedComponent;
+
+struct _ECalBackendDecsyncQueryIndex {
+	/* ECalComponent * -> IndexedComponent * */
+	GHashTable *components;
+
+	/* gchar * -> set of ECalComponent * */
+	GHashTable *by_uid;
+	GHashTable *by_category;
+
+	/* sets of ECalComponent * */
+	GHashTable *uncategorized;
+	GHashTable *completed;
+	GHashTable *with_alarms;
+	GHashTable *recurring;
+
+	/* The text of the components, see index_text(): guint32 trigram ->
+	 * GArray of text ids, which only grow and thus stay sorted.  Texts
+	 * which are removed stay in the lists until there are enough of them
+	 * to compact the lists. */
+	GHashTable *trigrams;
+	GPtrArray *texts; /* text id -> ECalComponent *, or NULL when removed */
+	guint n_removed_texts;
+};
+
+/* Compact the trigram lists once this many texts were removed, and more
+ * than are left */
+#define MIN_REMOVED_TEXTS 1024
+
+static void
+free_indexed_component (gpointer data)
+{
+	IndexedComponent *indexed = data;
+
+	g_free (indexed->uid);
+	g_strfreev (indexed->categories);
+	g_slice_free (IndexedComponent, indexed);
+}
+
+static GHashTable *
+new_component_set (void)
+{
+	return g_hash_table_new (g_direct_hash, g_direct_equal);
+}
+
+ECalBackendDecsyncQueryIndex *
+e_cal_backend_decsync_query_index_new (void)
+{
+	ECalBackendDecsyncQueryIndex *index;
+
+	index = g_slice_new0 (ECalBackendDecsyncQueryIndex);
+	index->components = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, free_indexed_component);
+	index->by_uid = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_hash_table_destroy);
+	index->by_category = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_hash_table_destroy);
+	index->uncategorized = new_component_set ();
+	index->completed = new_component_set ();
+	index->with_alarms = new_component_set ();
+	index->recurring = new_component_set ();
+	index->trigrams = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) g_array_unref);
+	index->texts = g_ptr_array_new ();
+
+	return index;
+}
+
+void
+e_cal_backend_decsync_query_index_free (ECalBackendDecsyncQueryIndex *index)
+{
+	if (!index)
+		return;
+
+	g_hash_table_destroy (index->components);
+	g_hash_table_destroy (index->by_uid);
+	g_hash_table_destroy (index->by_category);
+	g_hash_table_destroy (index->uncategorized);
+	g_hash_table_destroy (index->completed);
+	g_hash_table_destroy (index->with_alarms);
+	g_hash_table_destroy (index->recurring);
+	g_hash_table_destroy (index->trigrams);
+	g_ptr_array_unref (index->texts);
+	g_slice_free (ECalBackendDecsyncQueryIndex, index);
+}
+
+static void
+keyed_set_add (GHashTable *sets,
+               const gchar *key,
+               ECalComponent *comp)
+{
+	GHashTable *set;
+
+	set = g_hash_table_lookup (sets, key);
+	if (!set) {
+		set = new_component_set ();
+		g_hash_table_insert (sets, g_strdup (key), set);
+	}
+
+	g_hash_table_add (set, comp);
+}
+
+static void
+keyed_set_remove (GHashTable *sets,
+                  const gchar *key,
+                  ECalComponent *comp)
+{
+	GHashTable *set;
+
+	set = g_hash_table_lookup (sets, key);
+	if (set && g_hash_table_remove (set, comp) && !g_hash_table_size (set))
+		g_hash_table_remove (sets, key);
+}
+
+static guint32
+trigram_at (const gchar *text)
+{
+	return ((guint32) (guchar) text[0] << 16) |
+		((guint32) (guchar) text[1] << 8) |
+		(guint32) (guchar) text[2];
+}
+
+static gint
+compare_trigrams (gconstpointer a,
+                  gconstpointer b)
+{
+	guint32 trigram_a = *((const guint32 *) a);
+	guint32 trigram_b = *((const guint32 *) b);
+
+	return trigram_a < trigram_b ? -1 : trigram_a > trigram_b ? 1 : 0;
+}
+
+/* Adds the trigrams of @text to @trigrams.  The text is decomposed and
+ * lowercased as contains? does when comparing, so any text it finds
+ * has all the trigrams of what is looked for. */
+static void
+add_text_trigrams (GArray *trigrams,
+                   const gchar *text)
+{
+	gchar *decomposed;
+	gsize ii, len;
+
+	if (!text || !*text)
+		return;
+
+	decomposed = e_util_utf8_decompose (text);
+	if (!decomposed)
+		return;
+
+	len = strlen (decomposed);
+	for (ii = 0; ii + 3 <= len; ii++) {
+		guint32 trigram = trigram_at (decomposed + ii);
+
+		g_array_append_val (trigrams, trigram);
+	}
+
+	g_free (decomposed);
+}
+
+static void
+add_property_cn_trigrams (GArray *trigrams,
+                          ICalProperty *prop)
+{
+	gchar *cn;
+
+	cn = i_cal_property_get_parameter_as_string (prop, "CN");
+	add_text_trigrams (trigrams, cn);
+	g_free (cn);
+}
+
+/* Puts the text of @comp which contains? looks at in the trigram lists:
+ * the summary, descriptions, location, comments, attendees and organizer */
+static guint
+index_text (ECalBackendDecsyncQueryIndex *index,
+            ECalComponent *comp)
+{
+	ICalComponent *icomp;
+	ICalProperty *prop;
+	GArray *trigrams;
+	guint text_id, ii;
+
+	text_id = index->texts->len;
+	g_ptr_array_add (index->texts, comp);
+
+	icomp = e_cal_component_get_icalcomponent (comp);
+	trigrams = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+	for (prop = i_cal_component_get_first_property (icomp, I_CAL_ANY_PROPERTY);
+	     prop;
+	     g_object_unref (prop), prop = i_cal_component_get_next_property (icomp, I_CAL_ANY_PROPERTY)) {
+		switch (i_cal_property_isa (prop)) {
+		case I_CAL_SUMMARY_PROPERTY:
+			add_text_trigrams (trigrams, i_cal_property_get_summary (prop));
+			break;
+		case I_CAL_DESCRIPTION_PROPERTY:
+			add_text_trigrams (trigrams, i_cal_property_get_description (prop));
+			break;
+		case I_CAL_LOCATION_PROPERTY:
+			add_text_trigrams (trigrams, i_cal_property_get_location (prop));
+			break;
+		case I_CAL_COMMENT_PROPERTY:
+			add_text_trigrams (trigrams, i_cal_property_get_comment (prop));
+			break;
+		case I_CAL_ATTENDEE_PROPERTY:
+			add_text_trigrams (trigrams, i_cal_property_get_attendee (prop));
+			add_property_cn_trigrams (trigrams, prop);
+			break;
+		case I_CAL_ORGANIZER_PROPERTY:
+			add_text_trigrams (trigrams, i_cal_property_get_organizer (prop));
+			add_property_cn_trigrams (trigrams, prop);
+			break;
+		default:
+			break;
+		}
+	}
+
+	g_array_sort (trigrams, compare_trigrams);
+
+	for (ii = 0; ii < trigrams->len; ii++) {
+		guint32 trigram = g_array_index (trigrams, guint32, ii);
+		GArray *text_ids;
+
+		if (ii > 0 && trigram == g_array_index (trigrams, guint32, ii - 1))
+			continue;
+
+		text_ids = g_hash_table_lookup (index->trigrams, GUINT_TO_POINTER (trigram));
+		if (!text_ids) {
+			text_ids = g_array_new (FALSE, FALSE, sizeof (guint));
+			g_hash_table_insert (index->trigrams, GUINT_TO_POINTER (trigram), text_ids);
+		}
+
+		g_array_append_val (text_ids, text_id);
+	}
+
+	g_array_unref (trigrams);
+
+	return text_id;
+}
+
+/* Drops the removed texts from the trigram lists and numbers the others
+ * anew, keeping their order */
+static void
+compact_texts (ECalBackendDecsyncQueryIndex *index)
+{
+	GHashTableIter iter;
+	gpointer value;
+	guint *new_ids;
+	guint ii, n_texts = 0;
+
+	new_ids = g_new (guint, index->texts->len);
+
+	for (ii = 0; ii < index->texts->len; ii++) {
+		ECalComponent *comp = g_ptr_array_index (index->texts, ii);
+		IndexedComponent *indexed;
+
+		if (!comp) {
+			new_ids[ii] = G_MAXUINT;
+			continue;
+		}
+
+		indexed = g_hash_table_lookup (index->components, comp);
+		indexed->text_id = n_texts;
+		new_ids[ii] = n_texts;
+		index->texts->pdata[n_texts++] = comp;
+	}
+
+	g_ptr_array_set_size (index->texts, n_texts);
+	index->n_removed_texts = 0;
+
+	g_hash_table_iter_init (&iter, index->trigrams);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		GArray *text_ids = value;
+		guint jj, len = 0;
+
+		for (jj = 0; jj < text_ids->len; jj++) {
+			guint new_id = new_ids[g_array_index (text_ids, guint, jj)];
+
+			if (new_id != G_MAXUINT)
+				g_array_index (text_ids, guint, len++) = new_id;
+		}
+
+		if (len)
+			g_array_set_size (text_ids, len);
+		else
+			g_hash_table_iter_remove (&iter);
+	}
+
+	g_free (new_ids);
+}
+
+/* Indexes @comp, or indexes it again when it was changed */
+void
+e_cal_backend_decsync_query_index_add (ECalBackendDecsyncQueryIndex *index,
+                                       ECalComponent *comp)
+{
+	IndexedComponent *indexed;
+	ICalTime *completed;
+	GSList *categories, *link;
+	guint ii;
+
+	g_return_if_fail (index != NULL);
+	g_return_if_fail (comp != NULL);
+
+	e_cal_backend_decsync_query_index_remove (index, comp);
+
+	indexed = g_slice_new0 (IndexedComponent);
+	indexed->uid = g_strdup (e_cal_component_get_uid (comp));
+
+	categories = e_cal_component_get_categories_list (comp);
+	indexed->categories = g_new0 (gchar *, g_slist_length (categories) + 1);
+	for (link = categories, ii = 0; link; link = g_slist_next (link)) {
+		if (link->data && *((const gchar *) link->data))
+			indexed->categories[ii++] = g_utf8_casefold (link->data, -1);
+	}
+	g_slist_free_full (categories, g_free);
+
+	completed = e_cal_component_get_completed (comp);
+	indexed->completed = completed != NULL;
+	g_clear_object (&completed);
+
+	indexed->has_alarms = e_cal_component_has_alarms (comp);
+	indexed->recurs = e_cal_component_has_recurrences (comp) ||
+		e_cal_component_has_exceptions (comp) ||
+		e_cal_component_is_instance (comp);
+
+	if (indexed->uid)
+		keyed_set_add (index->by_uid, indexed->uid, comp);
+
+	for (ii = 0; indexed->categories[ii]; ii++)
+		keyed_set_add (index->by_category, indexed->categories[ii], comp);
+	if (!indexed->categories[0])
+		g_hash_table_add (index->uncategorized, comp);
+
+	if (indexed->completed)
+		g_hash_table_add (index->completed, comp);
+	if (indexed->has_alarms)
+		g_hash_table_add (index->with_alarms, comp);
+	if (indexed->recurs)
+		g_hash_table_add (index->recurring, comp);
+
+	indexed->text_id = index_text (index, comp);
+
+	g_hash_table_insert (index->components, comp, indexed);
+}
+
+void
+e_cal_backend_decsync_query_index_remove (ECalBackendDecsyncQueryIndex *index,
+                                          ECalComponent *comp)
+{
+	IndexedComponent *indexed;
+	guint ii;
+
+	g_return_if_fail (index != NULL);
+
+	indexed = g_hash_table_lookup (index->components, comp);
+	if (!indexed)
+		return;
+
+	if (indexed->uid)
+		keyed_set_remove (index->by_uid, indexed->uid, comp);
+
+	for (ii = 0; indexed->categories[ii]; ii++)
+		keyed_set_remove (index->by_category, indexed->categories[ii], comp);
+
+	g_hash_table_remove (index->uncategorized, comp);
+	g_hash_table_remove (index->completed, comp);
+	g_hash_table_remove (index->with_alarms, comp);
+	g_hash_table_remove (index->recurring, comp);
+
+	index->texts->pdata[indexed->text_id] = NULL;
+	index->n_removed_texts++;
+
+	g_hash_table_remove (index->components, comp);
+
+	if (index->n_removed_texts >= MIN_REMOVED_TEXTS &&
+	    index->n_removed_texts > g_hash_table_size (index->components))
+		compact_texts (index);
+}
+
+void
+e_cal_backend_decsync_query_index_remove_all (ECalBackendDecsyncQueryIndex *index)
+{
+	g_return_if_fail (index != NULL);
+
+	g_hash_table_remove_all (index->components);
+	g_hash_table_remove_all (index->by_uid);
+	g_hash_table_remove_all (index->by_category);
+	g_hash_table_remove_all (index->uncategorized);
+	g_hash_table_remove_all (index->completed);
+	g_hash_table_remove_all (index->with_alarms);
+	g_hash_table_remove_all (index->recurring);
+	g_hash_table_remove_all (index->trigrams);
+	g_ptr_array_set_size (index->texts, 0);
+	index->n_removed_texts = 0;
+}
+
+/* A query, as far as the plan needs to understand it: a function call,
+ * a string, a boolean or anything else */
+typedef enum {
+	TERM_FUNCTION,
+	TERM_STRING,
+	TERM_BOOLEAN,
+	TERM_OTHER
+} TermType;
+
+typedef struct {
+	TermType type;
+	gchar *value; /* function name or string */
+	gboolean boolean;
+	GPtrArray *args; /* QueryTerm * */
+} QueryTerm;
+
+static void
+free_query_term (gpointer data)
+{
+	QueryTerm *term = data;
+
+	if (!term)
+		return;
+
+	g_free (term->value);
+	if (term->args)
+		g_ptr_array_unref (term->args);
+	g_slice_free (QueryTerm, term);
+}
+
+static void
+skip_spaces (const gchar **pos)
+{
+	while (g_ascii_isspace (**pos))
+		(*pos)++;
+}
+
+static gboolean
+is_delimiter (gchar chr)
+{
+	return !chr || chr == '(' || chr == ')' || chr == '"' || g_ascii_isspace (chr);
+}
+
+/* Reads one term at @pos and moves past it; NULL when the query is not
+ * well formed */
+static QueryTerm *
+parse_query_term (const gchar **pos)
+{
+	QueryTerm *term;
+	const gchar *start;
+
+	skip_spaces (pos);
+
+	term = g_slice_new0 (QueryTerm);
+
+	if (**pos == '(') {
+		(*pos)++;
+		skip_spaces (pos);
+
+		start = *pos;
+		while (!is_delimiter (**pos))
+			(*pos)++;
+
+		term->type = TERM_FUNCTION;
+		term->value = g_strndup (start, *pos - start);
+		term->args = g_ptr_array_new_with_free_func (free_query_term);
+
+		for (;;) {
+			QueryTerm *arg;
+
+			skip_spaces (pos);
+			if (**pos == ')') {
+				(*pos)++;
+				break;
+			}
+
+			arg = parse_query_term (pos);
+			if (!arg) {
+				free_query_term (term);
+				return NULL;
+			}
+
+			g_ptr_array_add (term->args, arg);
+		}
+	} else if (**pos == '"') {
+		GString *value = g_string_new (NULL);
+
+		for ((*pos)++; **pos && **pos != '"'; (*pos)++) {
+			if (**pos == '\\' && (*pos)[1])
+				(*pos)++;
+			g_string_append_c (value, **pos);
+		}
+
+		if (**pos != '"') {
+			g_string_free (value, TRUE);
+			free_query_term (term);
+			return NULL;
+		}
+
+		(*pos)++;
+
+		term->type = TERM_STRING;
+		term->value = g_string_free (value, FALSE);
+	} else if (**pos && **pos != ')') {
+		start = *pos;
+		while (!is_delimiter (**pos))
+			(*pos)++;
+
+		if (*pos - start == 2 && start[0] == '#' && (start[1] == 't' || start[1] == 'f')) {
+			term->type = TERM_BOOLEAN;
+			term->boolean = start[1] == 't';
+		} else {
+			term->type = TERM_OTHER;
+		}
+	} else {
+		free_query_term (term);
+		return NULL;
+	}
+
+	return term;
+}
+
+static GHashTable *
+copy_component_set (GHashTable *set)
+{
+	GHashTable *copy;
+	GHashTableIter iter;
+	gpointer comp;
+
+	copy = new_component_set ();
+
+	if (set) {
+		g_hash_table_iter_init (&iter, set);
+		while (g_hash_table_iter_next (&iter, &comp, NULL))
+			g_hash_table_add (copy, comp);
+	}
+
+	return copy;
+}
+
+/* Keeps in @set only what is in @other as well; frees @other */
+static GHashTable *
+intersect_component_sets (GHashTable *set,
+                          GHashTable *other)
+{
+	GHashTableIter iter;
+	gpointer comp;
+
+	if (g_hash_table_size (other) < g_hash_table_size (set)) {
+		GHashTable *tmp = set;
+
+		set = other;
+		other = tmp;
+	}
+
+	g_hash_table_iter_init (&iter, set);
+	while (g_hash_table_iter_next (&iter, &comp, NULL)) {
+		if (!g_hash_table_contains (other, comp))
+			g_hash_table_iter_remove (&iter);
+	}
+
+	g_hash_table_destroy (other);
+
+	return set;
+}
+
+/* Adds what is in @other to @set; frees @other */
+static GHashTable *
+unite_component_sets (GHashTable *set,
+                      GHashTable *other)
+{
+	GHashTableIter iter;
+	gpointer comp;
+
+	if (g_hash_table_size (other) > g_hash_table_size (set)) {
+		GHashTable *tmp = set;
+
+		set = other;
+		other = tmp;
+	}
+
+	g_hash_table_iter_init (&iter, other);
+	while (g_hash_table_iter_next (&iter, &comp, NULL))
+		g_hash_table_add (set, comp);
+
+	g_hash_table_destroy (other);
+
+	return set;
+}
+
+static gint
+compare_text_id_lists (gconstpointer a,
+                       gconstpointer b)
+{
+	const GArray *list_a = *((const GArray * const *) a);
+	const GArray *list_b = *((const GArray * const *) b);
+
+	return list_a->len < list_b->len ? -1 : list_a->len > list_b->len ? 1 : 0;
+}
+
+/* Whether @text_id is in @text_ids at or after *@from, which is moved
+ * past the ids smaller than it */
+static gboolean
+text_ids_contain (GArray *text_ids,
+                  guint *from,
+                  guint text_id)
+{
+	guint lo = *from, hi = text_ids->len;
+
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+
+		if (g_array_index (text_ids, guint, mid) < text_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*from = lo;
+
+	return lo < text_ids->len && g_array_index (text_ids, guint, lo) == text_id;
+}
+
+/* Returns the components whose text has all the trigrams of @needle, or
+ * NULL when it is too short to have any */
+static GHashTable *
+plan_text_search (ECalBackendDecsyncQueryIndex *index,
+                  const gchar *needle)
+{
+	GHashTable *set;
+	GPtrArray *lists;
+	GArray *trigrams, *shortest;
+	guint *positions;
+	guint ii, jj;
+
+	trigrams = g_array_new (FALSE, FALSE, sizeof (guint32));
+	add_text_trigrams (trigrams, needle);
+
+	if (!trigrams->len) {
+		g_array_unref (trigrams);
+		return NULL;
+	}
+
+	set = new_component_set ();
+	lists = g_ptr_array_sized_new (trigrams->len);
+
+	for (ii = 0; ii < trigrams->len; ii++) {
+		GArray *text_ids;
+
+		text_ids = g_hash_table_lookup (index->trigrams, GUINT_TO_POINTER (g_array_index (trigrams, guint32, ii)));
+		if (!text_ids) {
+			/* no text has this one, thus nothing matches */
+			g_array_unref (trigrams);
+			g_ptr_array_unref (lists);
+			return set;
+		}
+
+		g_ptr_array_add (lists, text_ids);
+	}
+
+	g_array_unref (trigrams);
+
+	/* walk the shortest list and look for its ids in the others */
+	g_ptr_array_sort (lists, compare_text_id_lists);
+	shortest = g_ptr_array_index (lists, 0);
+	positions = g_new0 (guint, lists->len);
+
+	for (ii = 0; ii < shortest->len; ii++) {
+		guint text_id = g_array_index (shortest, guint, ii);
+		ECalComponent *comp;
+
+		for (jj = 1; jj < lists->len; jj++) {
+			if (!text_ids_contain (g_ptr_array_index (lists, jj), &positions[jj], text_id))
+				break;
+		}
+
+		comp = jj == lists->len ? g_ptr_array_index (index->texts, text_id) : NULL;
+		if (comp)
+			g_hash_table_add (set, comp);
+	}
+
+	g_free (positions);
+	g_ptr_array_unref (lists);
+
+	return set;
+}
+
+/* Returns the components which may match @term, possibly more, or NULL
+ * when the indexes cannot tell */
+static GHashTable *
+plan_query_term (ECalBackendDecsyncQueryIndex *index,
+                 QueryTerm *term)
+{
+	GHashTable *set = NULL;
+	guint ii;
+
+	if (term->type != TERM_FUNCTION)
+		return NULL;
+
+	if (g_str_equal (term->value, "and")) {
+		/* any of the arguments narrows it down */
+		for (ii = 0; ii < term->args->len; ii++) {
+			GHashTable *arg_set;
+
+			arg_set = plan_query_term (index, g_ptr_array_index (term->args, ii));
+			if (arg_set)
+				set = set ? intersect_component_sets (set, arg_set) : arg_set;
+		}
+	} else if (g_str_equal (term->value, "or")) {
+		/* each of the arguments has to */
+		for (ii = 0; ii < term->args->len; ii++) {
+			GHashTable *arg_set;
+
+			arg_set = plan_query_term (index, g_ptr_array_index (term->args, ii));
+			if (!arg_set) {
+				g_clear_pointer (&set, g_hash_table_destroy);
+				break;
+			}
+
+			set = set ? unite_component_sets (set, arg_set) : arg_set;
+		}
+	} else if (g_str_equal (term->value, "uid?")) {
+		QueryTerm *arg = term->args->len == 1 ? g_ptr_array_index (term->args, 0) : NULL;
+
+		if (arg && arg->type == TERM_STRING)
+			set = copy_component_set (g_hash_table_lookup (index->by_uid, arg->value));
+	} else if (g_str_equal (term->value, "has-categories?")) {
+		QueryTerm *arg = term->args->len ? g_ptr_array_index (term->args, 0) : NULL;
+
+		if (arg && arg->type == TERM_BOOLEAN && !arg->boolean) {
+			set = copy_component_set (index->uncategorized);
+		} else {
+			for (ii = 0; ii < term->args->len; ii++) {
+				GHashTable *category_set;
+				gchar *category;
+
+				arg = g_ptr_array_index (term->args, ii);
+				if (arg->type != TERM_STRING) {
+					g_clear_pointer (&set, g_hash_table_destroy);
+					break;
+				}
+
+				category = g_utf8_casefold (arg->value, -1);
+				category_set = copy_component_set (g_hash_table_lookup (index->by_category, category));
+				g_free (category);
+
+				set = set ? intersect_component_sets (set, category_set) : category_set;
+			}
+		}
+	} else if (g_str_equal (term->value, "contains?")) {
+		QueryTerm *field = term->args->len == 2 ? g_ptr_array_index (term->args, 0) : NULL;
+		QueryTerm *arg = term->args->len == 2 ? g_ptr_array_index (term->args, 1) : NULL;
+
+		/* only the fields whose text is indexed */
+		if (field && field->type == TERM_STRING &&
+		    arg && arg->type == TERM_STRING &&
+		    (g_str_equal (field->value, "any") ||
+		     g_str_equal (field->value, "summary") ||
+		     g_str_equal (field->value, "description") ||
+		     g_str_equal (field->value, "location") ||
+		     g_str_equal (field->value, "comment") ||
+		     g_str_equal (field->value, "attendee") ||
+		     g_str_equal (field->value, "organizer")))
+			set = plan_text_search (index, arg->value);
+	} else if (g_str_equal (term->value, "is-completed?")) {
+		set = copy_component_set (index->completed);
+	} else if (g_str_equal (term->value, "has-alarms?")) {
+		set = copy_component_set (index->with_alarms);
+	} else if (g_str_equal (term->value, "has-recurrences?")) {
+		set = copy_component_set (index->recurring);
+	}
+
+	return set;
+}
+
+static QueryTerm *
+parse_whole_query (const gchar *sexp)
+{
+	QueryTerm *term;
+	const gchar *pos = sexp;
+
+	if (!sexp)
+		return NULL;
+
+	term = parse_query_term (&pos);
+	skip_spaces (&pos);
+
+	/* not understood, or more than one expression */
+	if (!term || *pos) {
+		free_query_term (term);
+		return NULL;
+	}
+
+	return term;
+}
+
+/* Returns the components which match @term, when it is a predicate the
+ * indexes know the answer of exactly, or NULL */
+static GHashTable *
+plan_exact_term (ECalBackendDecsyncQueryIndex *index,
+                 QueryTerm *term)
+{
+	if (term->type != TERM_FUNCTION)
+		return NULL;
+
+	if (g_str_equal (term->value, "uid?")) {
+		QueryTerm *arg = term->args->len == 1 ? g_ptr_array_index (term->args, 0) : NULL;
+
+		if (arg && arg->type == TERM_STRING)
+			return copy_component_set (g_hash_table_lookup (index->by_uid, arg->value));
+	} else if (g_str_equal (term->value, "is-completed?")) {
+		if (!term->args->len)
+			return copy_component_set (index->completed);
+	} else if (g_str_equal (term->value, "has-alarms?")) {
+		if (!term->args->len)
+			return copy_component_set (index->with_alarms);
+	}
+
+	return NULL;
+}
+
+/* Whether @term is an occur-in-time-range? the caller can check itself;
+ * sets @out_zone to its time zone, if it has one */
+static gboolean
+is_time_range_term (QueryTerm *term,
+                    gchar **out_zone)
+{
+	QueryTerm *zone;
+
+	if (term->type != TERM_FUNCTION ||
+	    !g_str_equal (term->value, "occur-in-time-range?") ||
+	    term->args->len < 2 || term->args->len > 3)
+		return FALSE;
+
+	zone = term->args->len == 3 ? g_ptr_array_index (term->args, 2) : NULL;
+	if (zone && zone->type != TERM_STRING)
+		return FALSE;
+
+	*out_zone = zone ? g_strdup (zone->value) : NULL;
+
+	return TRUE;
+}
+
+/* Tells whether @sexp is only an occur-in-time-range?, possibly in an and
+ * with predicates the indexes know the answer of exactly, thus the caller
+ * can match the components by their occurrences alone, without evaluating
+ * it.  Then @out_zone is set to the time zone of the range, or NULL, and
+ * @out_filter to the components matching the other predicates, or NULL
+ * when there are none. */
+gboolean
+e_cal_backend_decsync_query_index_plan_time_range (ECalBackendDecsyncQueryIndex *index,
+                                                   const gchar *sexp,
+                                                   gchar **out_zone,
+                                                   GHashTable **out_filter)
+{
+	QueryTerm *term;
+	GHashTable *filter = NULL;
+	gchar *zone = NULL;
+	gboolean has_range = FALSE;
+	guint ii;
+
+	g_return_val_if_fail (index != NULL, FALSE);
+	g_return_val_if_fail (out_zone != NULL, FALSE);
+	g_return_val_if_fail (out_filter != NULL, FALSE);
+
+	term = parse_whole_query (sexp);
+	if (!term)
+		return FALSE;
+
+	if (term->type == TERM_FUNCTION && g_str_equal (term->value, "and")) {
+		for (ii = 0; ii < term->args->len; ii++) {
+			QueryTerm *arg = g_ptr_array_index (term->args, ii);
+			GHashTable *arg_set;
+
+			if (!has_range && is_time_range_term (arg, &zone)) {
+				has_range = TRUE;
+				continue;
+			}
+
+			arg_set = plan_exact_term (index, arg);
+			if (!arg_set) {
+				has_range = FALSE;
+				break;
+			}
+
+			filter = filter ? intersect_component_sets (filter, arg_set) : arg_set;
+		}
+	} else {
+		has_range = is_time_range_term (term, &zone);
+	}
+
+	free_query_term (term);
+
+	if (!has_range) {
+		g_free (zone);
+		if (filter)
+			g_hash_table_destroy (filter);
+		return FALSE;
+	}
+
+	*out_zone = zone;
+	*out_filter = filter;
+
+	return TRUE;
+}
+
+/* Returns the components which may match @sexp, in no order, or NULL
+ * when all of them may; the query itself is still to be evaluated on
+ * each of them */
+GPtrArray *
+e_cal_backend_decsync_query_index_plan (ECalBackendDecsyncQueryIndex *index,
+                                        const gchar *sexp)
+{
+	QueryTerm *term;
+	GHashTable *set;
+	GHashTableIter iter;
+	GPtrArray *candidates;
+	gpointer comp;
+
+	g_return_val_if_fail (index != NULL, NULL);
+
+	term = parse_whole_query (sexp);
+	if (!term)
+		return NULL;
+
+	set = plan_query_term (index, term);
+	free_query_term (term);
+
+	if (!set)
+		return NULL;
+
+	candidates = g_ptr_array_sized_new (g_hash_table_size (set));
+
+	g_hash_table_iter_init (&iter, set);
+	while (g_hash_table_iter_next (&iter, &comp, NULL))
+		g_ptr_array_add (candidates, comp);
+
+	g_hash_table_destroy (set);
+
+	return candidates;
+}
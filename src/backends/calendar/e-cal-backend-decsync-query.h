@@ -0,0 +1,59 @@
+/* Evolution calendar - iCalendar decsync backend.
+ *
+ * Copyright (C) 2018 Aldo Gunsing
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef E_CAL_BACKEND_DECSYNC_QUERY_H
+#define E_CAL_BACKEND_DECSYNC_QUERY_H
+
+#include <libecal/libecal.h>
+
+G_BEGIN_DECLS
+
+/* Indexes of components by what the queries of Evolution ask for besides
+ * time: the UID, the categories, whether they are completed, have alarms
+ * or recur, and the trigrams of the text contains? searches.  A query plan
+ * uses them to find the components which may match a query, so that only
+ * those have the whole query evaluated.
+ *
+ * A component is indexed as it is when added; one changed in place is
+ * added again.  The indexes do not hold references on the components. */
+typedef struct _ECalBackendDecsyncQueryIndex ECalBackendDecsyncQueryIndex;
+
+ECalBackendDecsyncQueryIndex *
+		e_cal_backend_decsync_query_index_new
+						(void);
+void		e_cal_backend_decsync_query_index_free
+						(ECalBackendDecsyncQueryIndex *index);
+void		e_cal_backend_decsync_query_index_add
+						(ECalBackendDecsyncQueryIndex *index,
+						 ECalComponent *comp);
+void		e_cal_backend_decsync_query_index_remove
+						(ECalBackendDecsyncQueryIndex *index,
+						 ECalComponent *comp);
+void		e_cal_backend_decsync_query_index_remove_all
+						(ECalBackendDecsyncQueryIndex *index);
+GPtrArray *	e_cal_backend_decsync_query_index_plan
+						(ECalBackendDecsyncQueryIndex *index,
+						 const gchar *sexp);
+gboolean	e_cal_backend_decsync_query_index_plan_time_range
+						(ECalBackendDecsyncQueryIndex *index,
+						 const gchar *sexp,
+						 gchar **out_zone,
+						 GHashTable **out_filter);
+
+G_END_DECLS
+
+#endif /* E_CAL_BACKEND_DECSYNC_QUERY_H */
@@ -0,0 +1,154 @@
+/* Evolution calendar - iCalendar decsync backend.
+ *
+ * Copyright (C) 2018 Aldo Gunsing
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "evolution-decsync-config.h"
+
+#include "e-cal-backend-decsync-registry.h"
+
+struct _ECalBackendDecsyncRegistry {
+	/* the components, in order */
+	GQueue queue;
+	/* ECalComponent * -> its GList link in queue */
+	GHashTable *links;
+};
+
+ECalBackendDecsyncRegistry *
+e_cal_backend_decsync_registry_new (void)
+{
+	ECalBackendDecsyncRegistry *registry;
+
+	registry = g_slice_new0 (ECalBackendDecsyncRegistry);
+	g_queue_init (&registry->queue);
+	registry->links = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	return registry;
+}
+
+void
+e_cal_backend_decsync_registry_free (ECalBackendDecsyncRegistry *registry)
+{
+	if (!registry)
+		return;
+
+	g_queue_clear (&registry->queue);
+	g_hash_table_destroy (registry->links);
+	g_slice_free (ECalBackendDecsyncRegistry, registry);
+}
+
+/* Adds @comp before all others; returns its link, or the existing one
+ * when @comp was added already */
+GList *
+e_cal_backend_decsync_registry_prepend (ECalBackendDecsyncRegistry *registry,
+                                        ECalComponent *comp)
+{
+	GList *link;
+
+	g_return_val_if_fail (registry != NULL, NULL);
+	g_return_val_if_fail (comp != NULL, NULL);
+
+	link = g_hash_table_lookup (registry->links, comp);
+	if (link)
+		return link;
+
+	g_queue_push_head (&registry->queue, comp);
+	link = g_queue_peek_head_link (&registry->queue);
+	g_hash_table_insert (registry->links, comp, link);
+
+	return link;
+}
+
+/* Adds @comp after all others; returns its link, or the existing one
+ * when @comp was added already */
+GList *
+e_cal_backend_decsync_registry_append (ECalBackendDecsyncRegistry *registry,
+                                       ECalComponent *comp)
+{
+	GList *link;
+
+	g_return_val_if_fail (registry != NULL, NULL);
+	g_return_val_if_fail (comp != NULL, NULL);
+
+	link = g_hash_table_lookup (registry->links, comp);
+	if (link)
+		return link;
+
+	g_queue_push_tail (&registry->queue, comp);
+	link = g_queue_peek_tail_link (&registry->queue);
+	g_hash_table_insert (registry->links, comp, link);
+
+	return link;
+}
+
+/* Returns whether @comp was in @registry, which may be NULL */
+gboolean
+e_cal_backend_decsync_registry_remove (ECalBackendDecsyncRegistry *registry,
+                                       ECalComponent *comp)
+{
+	GList *link;
+
+	if (!registry || !comp)
+		return FALSE;
+
+	link = g_hash_table_lookup (registry->links, comp);
+	if (!link)
+		return FALSE;
+
+	g_hash_table_remove (registry->links, comp);
+	g_queue_delete_link (&registry->queue, link);
+
+	return TRUE;
+}
+
+void
+e_cal_backend_decsync_registry_remove_all (ECalBackendDecsyncRegistry *registry)
+{
+	g_return_if_fail (registry != NULL);
+
+	g_queue_clear (&registry->queue);
+	g_hash_table_remove_all (registry->links);
+}
+
+GList *
+e_cal_backend_decsync_registry_lookup (ECalBackendDecsyncRegistry *registry,
+                                       ECalComponent *comp)
+{
+	if (!registry || !comp)
+		return NULL;
+
+	return g_hash_table_lookup (registry->links, comp);
+}
+
+/* Returns the first link, to iterate over the components in order; the
+ * registry may be NULL */
+GList *
+e_cal_backend_decsync_registry_peek_head (ECalBackendDecsyncRegistry *registry)
+{
+	if (!registry)
+		return NULL;
+
+	return g_queue_peek_head_link (&registry->queue);
+}
+
+/* The registry may be NULL */
+guint
+e_cal_backend_decsync_registry_get_length (ECalBackendDecsyncRegistry *registry)
+{
+	if (!registry)
+		return 0;
+
+	return g_queue_get_length (&registry->queue);
+}
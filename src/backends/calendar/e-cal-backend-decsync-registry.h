@@ -0,0 +1,57 @@
+/* Evolution calendar - iCalendar decsync backend.
+ *
+ * Copyright (C) 2018 Aldo Gunsing
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef E_CAL_BACKEND_DECSYNC_REGISTRY_H
+#define E_CAL_BACKEND_DECSYNC_REGISTRY_H
+
+#include <libecal/libecal.h>
+
+G_BEGIN_DECLS
+
+/* An ordered set of components: adding and removing one is O(1), and
+ * iterating over them follows the order in which they were added.  The
+ * list links are stable handles; a component keeps its link until it
+ * is removed.  The registry does not hold references on the components. */
+typedef struct _ECalBackendDecsyncRegistry ECalBackendDecsyncRegistry;
+
+ECalBackendDecsyncRegistry *
+		e_cal_backend_decsync_registry_new
+						(void);
+void		e_cal_backend_decsync_registry_free
+						(ECalBackendDecsyncRegistry *registry);
+GList *		e_cal_backend_decsync_registry_prepend
+						(ECalBackendDecsyncRegistry *registry,
+						 ECalComponent *comp);
+GList *		e_cal_backend_decsync_registry_append
+						(ECalBackendDecsyncRegistry *registry,
+						 ECalComponent *comp);
+gboolean	e_cal_backend_decsync_registry_remove
+						(ECalBackendDecsyncRegistry *registry,
+						 ECalComponent *comp);
+void		e_cal_backend_decsync_registry_remove_all
+						(ECalBackendDecsyncRegistry *registry);
+GList *		e_cal_backend_decsync_registry_lookup
+						(ECalBackendDecsyncRegistry *registry,
+						 ECalComponent *comp);
+GList *		e_cal_backend_decsync_registry_peek_head
+						(ECalBackendDecsyncRegistry *registry);
+guint		e_cal_backend_decsync_registry_get_length
+						(ECalBackendDecsyncRegistry *registry);
+
+G_END_DECLS
+
+#endif /* E_CAL_BACKEND_DECSYNC_REGISTRY_H */
@@ -0,0 +1,278 @@
+/* Evolution calendar - iCalendar decsync backend.
+ *
+ * Copyright (C) 2018 Aldo Gunsing
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "evolution-decsync-config.h"
+
+#include <string.h>
+
+#include "e-cal-backend-decsync-results.h"
+
+typedef struct {
+	gchar *sexp; /* normalized */
+	gchar *revision;
+	GPtrArray *comps; /* ECalComponent *, referenced */
+	GList *link; /* in lru */
+} ResultsEntry;
+
+struct _ECalBackendDecsyncResults {
+	GMutex lock;
+
+	/* normalized query -> ResultsEntry * */
+	GHashTable *entries;
+	/* the entries, the most recently used first */
+	GQueue lru;
+	guint max_entries;
+
+	guint hits;
+	guint misses;
+};
+
+static void
+free_results_entry (gpointer data)
+{
+	ResultsEntry *entry = data;
+
+	g_free (entry->sexp);
+	g_free (entry->revision);
+	g_ptr_array_unref (entry->comps);
+	g_slice_free (ResultsEntry, entry);
+}
+
+ECalBackendDecsyncResults *
+e_cal_backend_decsync_results_new (guint max_entries)
+{
+	ECalBackendDecsyncResults *results;
+
+	g_return_val_if_fail (max_entries > 0, NULL);
+
+	results = g_slice_new0 (ECalBackendDecsyncResults);
+	g_mutex_init (&results->lock);
+	results->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, free_results_entry);
+	g_queue_init (&results->lru);
+	results->max_entries = max_entries;
+
+	return results;
+}
+
+void
+e_cal_backend_decsync_results_free (ECalBackendDecsyncResults *results)
+{
+	if (!results)
+		return;
+
+	g_queue_clear (&results->lru);
+	g_hash_table_destroy (results->entries);
+	g_mutex_clear (&results->lock);
+	g_slice_free (ECalBackendDecsyncResults, results);
+}
+
+/* Returns @sexp with the spaces outside of strings collapsed, and
+ * dropped next to parentheses, thus the same query written a bit
+ * differently gets the same entry */
+static gchar *
+normalize_sexp (const gchar *sexp)
+{
+	GString *normalized;
+	gboolean in_string = FALSE, space = FALSE;
+	const gchar *pos;
+
+	normalized = g_string_sized_new (strlen (sexp));
+
+	for (pos = sexp; *pos; pos++) {
+		if (in_string) {
+			g_string_append_c (normalized, *pos);
+			if (*pos == '\\' && pos[1])
+				g_string_append_c (normalized, *++pos);
+			else if (*pos == '"')
+				in_string = FALSE;
+		} else if (g_ascii_isspace (*pos)) {
+			space = TRUE;
+		} else {
+			if (space && normalized->len > 0 && *pos != ')' &&
+			    normalized->str[normalized->len - 1] != '(')
+				g_string_append_c (normalized, ' ');
+			space = FALSE;
+
+			g_string_append_c (normalized, *pos);
+			in_string = *pos == '"';
+		}
+	}
+
+	return g_string_free (normalized, FALSE);
+}
+
+/* Whether the result of the @normalized query depends on when it is
+ * asked, not only on the calendar, as with (time-now) */
+static gboolean
+depends_on_now (const gchar *normalized)
+{
+	return strstr (normalized, "(time-now") != NULL;
+}
+
+static void
+remove_entry (ECalBackendDecsyncResults *results,
+              ResultsEntry *entry)
+{
+	g_queue_delete_link (&results->lru, entry->link);
+	g_hash_table_remove (results->entries, entry->sexp);
+}
+
+/* Returns the components which matched @sexp at @revision, in the order
+ * they did, or NULL when they are not known.  Free the array with
+ * g_ptr_array_unref(); it holds references on the components. */
+GPtrArray *
+e_cal_backend_decsync_results_lookup (ECalBackendDecsyncResults *results,
+                                      const gchar *sexp,
+                                      const gchar *revision)
+{
+	ResultsEntry *entry;
+	GPtrArray *comps = NULL;
+	gchar *normalized;
+	guint ii;
+
+	g_return_val_if_fail (results != NULL, NULL);
+
+	if (!sexp || !revision)
+		return NULL;
+
+	normalized = normalize_sexp (sexp);
+
+	if (depends_on_now (normalized)) {
+		g_free (normalized);
+		return NULL;
+	}
+
+	g_mutex_lock (&results->lock);
+
+	entry = g_hash_table_lookup (results->entries, normalized);
+	if (entry && g_strcmp0 (entry->revision, revision) != 0) {
+		remove_entry (results, entry);
+		entry = NULL;
+	}
+
+	if (entry) {
+		g_queue_unlink (&results->lru, entry->link);
+		g_queue_push_head_link (&results->lru, entry->link);
+
+		comps = g_ptr_array_new_full (entry->comps->len, g_object_unref);
+		for (ii = 0; ii < entry->comps->len; ii++)
+			g_ptr_array_add (comps, g_object_ref (g_ptr_array_index (entry->comps, ii)));
+
+		results->hits++;
+	} else {
+		results->misses++;
+	}
+
+	g_mutex_unlock (&results->lock);
+
+	g_free (normalized);
+
+	return comps;
+}
+
+/* Remembers that @comps matched @sexp at @revision, which has to be the
+ * current revision of the calendar.  Entries for other revisions are left
+ * to e_cal_backend_decsync_results_remove_all(), lookups and the least
+ * recently used order, as a reader which finished late may insert for a
+ * revision which is older than theirs.  Queries which depend on the time
+ * they are asked at are not remembered. */
+void
+e_cal_backend_decsync_results_insert (ECalBackendDecsyncResults *results,
+                                      const gchar *sexp,
+                                      const gchar *revision,
+                                      GPtrArray *comps)
+{
+	ResultsEntry *entry, *old;
+	gchar *normalized;
+	guint ii;
+
+	g_return_if_fail (results != NULL);
+	g_return_if_fail (comps != NULL);
+
+	if (!sexp || !revision)
+		return;
+
+	normalized = normalize_sexp (sexp);
+
+	if (depends_on_now (normalized)) {
+		g_free (normalized);
+		return;
+	}
+
+	entry = g_slice_new0 (ResultsEntry);
+	entry->sexp = normalized;
+	entry->revision = g_strdup (revision);
+	entry->comps = g_ptr_array_new_full (comps->len, g_object_unref);
+	for (ii = 0; ii < comps->len; ii++)
+		g_ptr_array_add (entry->comps, g_object_ref (g_ptr_array_index (comps, ii)));
+
+	g_mutex_lock (&results->lock);
+
+	old = g_hash_table_lookup (results->entries, entry->sexp);
+	if (old)
+		remove_entry (results, old);
+
+	while (results->lru.length >= results->max_entries)
+		remove_entry (results, g_queue_peek_tail (&results->lru));
+
+	g_queue_push_head (&results->lru, entry);
+	entry->link = results->lru.head;
+	g_hash_table_insert (results->entries, entry->sexp, entry);
+
+	g_mutex_unlock (&results->lock);
+}
+
+void
+e_cal_backend_decsync_results_remove_all (ECalBackendDecsyncResults *results)
+{
+	g_return_if_fail (results != NULL);
+
+	g_mutex_lock (&results->lock);
+
+	g_queue_clear (&results->lru);
+	g_hash_table_remove_all (results->entries);
+
+	g_mutex_unlock (&results->lock);
+}
+
+guint
+e_cal_backend_decsync_results_get_hits (ECalBackendDecsyncResults *results)
+{
+	guint hits;
+
+	g_return_val_if_fail (results != NULL, 0);
+
+	g_mutex_lock (&results->lock);
+	hits = results->hits;
+	g_mutex_unlock (&results->lock);
+
+	return hits;
+}
+
+guint
+e_cal_backend_decsync_results_get_misses (ECalBackendDecsyncResults *results)
+{
+	guint misses;
+
+	g_return_val_if_fail (results != NULL, 0);
+
+	g_mutex_lock (&results->lock);
+	misses = results->misses;
+	g_mutex_unlock (&results->lock);
+
+	return misses;
+}
@@ -0,0 +1,60 @@
+/* Evolution calendar - iCalendar decsync backend.
+ *
+ * Copyright (C) 2018 Aldo Gunsing
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef E_CAL_BACKEND_DECSYNC_RESULTS_H
+#define E_CAL_BACKEND_DECSYNC_RESULTS_H
+
+#include <libecal/libecal.h>
+
+G_BEGIN_DECLS
+
+/* A cache of the components which matched a query, for the queries which
+ * are asked again and again.  An entry is for a query, told apart by its
+ * text with the spaces normalized, and for the revision of the calendar
+ * it was matched at; it is of no use at any other revision.  The least
+ * recently used entries are dropped when there are too many of them.
+ * Queries using (time-now) match differently as time goes by, thus are
+ * never cached.
+ *
+ * Readers of the calendar data use it concurrently, thus it has a lock of
+ * its own.  It counts how many lookups hit and missed. */
+typedef struct _ECalBackendDecsyncResults ECalBackendDecsyncResults;
+
+ECalBackendDecsyncResults *
+		e_cal_backend_decsync_results_new
+						(guint max_entries);
+void		e_cal_backend_decsync_results_free
+						(ECalBackendDecsyncResults *results);
+GPtrArray *	e_cal_backend_decsync_results_lookup
+						(ECalBackendDecsyncResults *results,
+						 const gchar *sexp,
+						 const gchar *revision);
+void		e_cal_backend_decsync_results_insert
+						(ECalBackendDecsyncResults *results,
+						 const gchar *sexp,
+						 const gchar *revision,
+						 GPtrArray *comps);
+void		e_cal_backend_decsync_results_remove_all
+						(ECalBackendDecsyncResults *results);
+guint		e_cal_backend_decsync_results_get_hits
+						(ECalBackendDecsyncResults *results);
+guint		e_cal_backend_decsync_results_get_misses
+						(ECalBackendDecsyncResults *results);
+
+G_END_DECLS
+
+#endif /* E_CAL_BACKEND_DECSYNC_RESULTS_H */
@@ -24,6 +24,7 @@
 
 #include "evolution-decsync-config.h"
 
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -34,10 +35,16 @@
 
 #include <libedataserver/libedataserver.h>
 #include <e-source/e-source-decsync.h>
+#include <backends/utils/decsync-monitor.h>
 #include <json.h>
 #include <libdecsync.h>
 
 #include "e-cal-backend-decsync-events.h"
+#include "e-cal-backend-decsync-instances.h"
+#include "e-cal-backend-decsync-intervals.h"
+#include "e-cal-backend-decsync-query.h"
+#include "e-cal-backend-decsync-registry.h"
+#include "e-cal-backend-decsync-results.h"
 
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -50,13 +57,284 @@
 
 #define ECAL_REVISION_X_PROP  "X-EVOLUTION-DATA-REVISION"
 
+/* Objects changed since the calendar file was last written as a whole are
+ * stored as one "<SHA-1 of the UID>.ics" shard each, in the "<file_name>.shards"
+ * directory and listed in its manifest, together with the revision of the
+ * calendar file they apply to.  The shards are folded back into the
+ * calendar file once there are more than SHARDS_COMPACT_THRESHOLD of them.
+ * A save thus writes the changed objects only, as the append-only journal
+ * this replaces did, and replays nothing but the shards on open. */
+#define SHARDS_SUFFIX ".shards"
+#define SHARDS_MANIFEST "manifest"
+#define SHARDS_LAYOUT_VERSION 1
+#define SHARDS_COMPACT_THRESHOLD 512
+
+/* A save which failed is retried after this many seconds, doubled with
+ * every further failure up to the maximum */
+#define SAVE_RETRY_MIN_SECONDS 5
+#define SAVE_RETRY_MAX_SECONDS 300
+
+#define MANIFEST_GROUP_CALENDAR "Calendar"
+#define MANIFEST_GROUP_SHARDS "Shards"
+#define MANIFEST_GROUP_DIGESTS "Digests"
+
+/* Calendar files of at least this size are opened lazily: the file is
+ * mapped and only the position, UID and approximate time span of each
+ * object is recorded; the objects are parsed when first needed */
+#define LAZY_OPEN_THRESHOLD (1024 * 1024)
+
+/* Each full write of the calendar file also writes "<file_name>.index",
+ * with the position, UID and occurrence bounds of every object, which
+ * lets the next open skip both parsing and the scan of the file */
+#define INDEX_SUFFIX ".index"
+#define INDEX_MAGIC "DSCALIDX"
+#define INDEX_VERSION 1
+
+/* Number of mutexes components are spread over, see component_lock() */
+#define N_COMPONENT_LOCKS 64
+
+/* The writer thread serializes a snapshot in chunks of this many objects,
+ * releasing the lock in between */
+#define SNAPSHOT_CHUNK_SIZE 256
+
+/* Number of queries whose results are cached, see query_results */
+#define N_CACHED_RESULTS 32
+
+/* The instances of recurring components are kept expanded from this long
+ * before now until this long after it, and for wider ranges when asked
+ * for them, up to the limit; see component_get_instances() */
+#define INSTANCES_WINDOW_PAST (92 * 24 * 60 * 60)
+#define INSTANCES_WINDOW_FUTURE (366 * 24 * 60 * 60)
+#define INSTANCES_MAX_WINDOW (731 * 24 * 60 * 60)
+
 /* Placeholder for each component and its recurrences */
 typedef struct {
 	ECalComponent *full_object;
 	GHashTable *recurrences;
-	GList *recurrences_list;
+	/* the detached recurrences in the order they were added, created
+	 * with the first of them */
+	ECalBackendDecsyncRegistry *recurrence_registry;
+	/* the object as a VCALENDAR, until any of its components changes;
+	 * see get_object_as_string() */
+	gchar *ical_string;
 } ECalBackendDecsyncObject;
 
+/* An object of a lazily opened calendar file, not parsed yet */
+typedef struct {
+	gchar *uid;
+	gchar *rid;
+
+	/* bounds of all its occurrences, possibly wider than the real ones;
+	 * G_MININT64 and G_MAXINT64 when unbounded */
+	gint64 start;
+	gint64 end;
+
+	/* the BEGIN...END lines in the mapped file */
+	gsize offset;
+	gsize length;
+
+	/* in the StubIndex */
+	guint index_pos;
+} ECalBackendDecsyncStub;
+
+/* An index of the time spans of the stubs, for needs_materialize() and
+ * materialize_time_range(): the stubs sorted by their start, with a tree
+ * of the greatest end below each node over them.  A stub is removed by
+ * setting its end to G_MININT64, thus the stubs which overlap a time
+ * range are found without looking at the others. */
+typedef struct {
+	GPtrArray *by_start; /* ECalBackendDecsyncStub *, not owned; NULL once removed */
+	gint64 *starts; /* of by_start */
+	gint64 *max_ends; /* the leaves are at size + index_pos */
+	guint size;
+} StubIndex;
+
+static gint
+compare_stub_starts (gconstpointer a,
+                     gconstpointer b)
+{
+	const ECalBackendDecsyncStub *stub_a = *((ECalBackendDecsyncStub **) a);
+	const ECalBackendDecsyncStub *stub_b = *((ECalBackendDecsyncStub **) b);
+
+	if (stub_a->start == stub_b->start)
+		return 0;
+
+	return stub_a->start < stub_b->start ? -1 : 1;
+}
+
+static StubIndex *
+stub_index_new (GHashTable *stubs)
+{
+	StubIndex *index;
+	GHashTableIter iter;
+	gpointer value;
+	guint ii;
+
+	index = g_slice_new0 (StubIndex);
+	index->by_start = g_ptr_array_new ();
+
+	g_hash_table_iter_init (&iter, stubs);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		GPtrArray *uid_stubs = value;
+
+		for (ii = 0; ii < uid_stubs->len; ii++)
+			g_ptr_array_add (index->by_start, g_ptr_array_index (uid_stubs, ii));
+	}
+
+	g_ptr_array_sort (index->by_start, compare_stub_starts);
+
+	for (index->size = 1; index->size < index->by_start->len; index->size *= 2)
+		;
+
+	index->starts = g_new (gint64, index->by_start->len);
+	index->max_ends = g_new (gint64, 2 * index->size);
+	for (ii = 0; ii < index->size; ii++) {
+		if (ii < index->by_start->len) {
+			ECalBackendDecsyncStub *stub = g_ptr_array_index (index->by_start, ii);
+
+			stub->index_pos = ii;
+			index->starts[ii] = stub->start;
+			index->max_ends[index->size + ii] = stub->end;
+		} else {
+			index->max_ends[index->size + ii] = G_MININT64;
+		}
+	}
+
+	for (ii = index->size - 1; ii > 0; ii--)
+		index->max_ends[ii] = MAX (index->max_ends[2 * ii], index->max_ends[2 * ii + 1]);
+
+	return index;
+}
+
+static void
+stub_index_free (StubIndex *index)
+{
+	g_ptr_array_unref (index->by_start);
+	g_free (index->starts);
+	g_free (index->max_ends);
+	g_slice_free (StubIndex, index);
+}
+
+static void
+stub_index_remove (StubIndex *index,
+                   ECalBackendDecsyncStub *stub)
+{
+	guint node;
+
+	index->by_start->pdata[stub->index_pos] = NULL;
+
+	node = index->size + stub->index_pos;
+	index->max_ends[node] = G_MININT64;
+
+	for (node /= 2; node > 0; node /= 2)
+		index->max_ends[node] = MAX (index->max_ends[2 * node], index->max_ends[2 * node + 1]);
+}
+
+/* Returns how many stubs start at @end or before */
+static guint
+stub_index_count_starting (StubIndex *index,
+                           gint64 end)
+{
+	guint low = 0, high = index->by_start->len;
+
+	while (low < high) {
+		guint middle = low + (high - low) / 2;
+
+		if (index->starts[middle] <= end)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+/* Adds to @out the stubs below @node, which covers the stubs from @from
+ * on, of the first @count ones which end at @start or after; with no
+ * @out, only tells whether there is any */
+static gboolean
+stub_index_collect_node (StubIndex *index,
+                         guint node,
+                         guint from,
+                         guint width,
+                         guint count,
+                         gint64 start,
+                         GPtrArray *out)
+{
+	gboolean found;
+
+	if (from >= count || index->max_ends[node] < start || index->max_ends[node] == G_MININT64)
+		return FALSE;
+
+	if (node >= index->size) {
+		if (out)
+			g_ptr_array_add (out, g_ptr_array_index (index->by_start, from));
+		return TRUE;
+	}
+
+	width /= 2;
+	found = stub_index_collect_node (index, 2 * node, from, width, count, start, out);
+	if (found && !out)
+		return TRUE;
+
+	return stub_index_collect_node (index, 2 * node + 1, from + width, width, count, start, out) || found;
+}
+
+/* Adds to @out the stubs which overlap @start to @end; with no @out, only
+ * tells whether there is any */
+static gboolean
+stub_index_collect (StubIndex *index,
+                    gint64 start,
+                    gint64 end,
+                    GPtrArray *out)
+{
+	return stub_index_collect_node (index, 1, 0, index->size,
+		stub_index_count_starting (index, end), start, out);
+}
+
+/* Bounds computed for the interval tree, kept on the component */
+typedef struct {
+	gint64 start;
+	gint64 end;
+	gboolean recurs;
+} OccurTimes;
+
+/* A time the calendar is busy, with the summary and location of the
+ * instance which makes it so */
+typedef struct {
+	gint64 start;
+	gint64 end;
+	gboolean is_date;
+	gchar *summary;
+	gchar *location;
+} BusyPeriod;
+
+/* The busy periods of the instances which occur between start and end,
+ * sorted by their start, for a revision of the calendar; none of them is
+ * longer than max_length */
+typedef struct {
+	gchar *revision;
+	gint64 start;
+	gint64 end;
+	GArray *periods; /* BusyPeriod */
+	gint64 max_length;
+} BusyPeriods;
+
+G_DEFINE_QUARK (e-cal-backend-decsync-occur-times, occur_times)
+
+/* The component as a string, kept on it until it changes; see
+ * component_dup_string() */
+G_DEFINE_QUARK (e-cal-backend-decsync-ical-string, ical_string)
+
+/* The expanded instances of a recurring component, one
+ * ECalBackendDecsyncInstances for each default time zone asked for, kept
+ * on it until it changes; see component_get_instances() */
+G_DEFINE_QUARK (e-cal-backend-decsync-instances, instances)
+
+/* When a recurring component occurs, an ECalBackendDecsyncOccurrences
+ * kept on it until it changes; see search_intervaltree() */
+G_DEFINE_QUARK (e-cal-backend-decsync-occurrences, occurrences)
+
 /* Private part of the ECalBackendDecsync structure */
 struct _ECalBackendDecsyncPrivate {
 	/* path where the calendar data is stored */
@@ -67,12 +345,40 @@ struct _ECalBackendDecsyncPrivate {
 	gboolean is_dirty;
 	guint dirty_idle_id;
 
-	/* locked in high-level functions to ensure data is consistent
-	 * in idle and CORBA thread(s?); because high-level functions
-	 * may call other high-level functions the mutex must allow
-	 * recursive locking
-	 */
-	GRecMutex idle_save_rmutex;
+	/* UIDs changed since the last save, hashed by UID */
+	GHashTable *dirty_uids;
+	/* the calendar file has to be rewritten as a whole on the next save */
+	gboolean needs_snapshot;
+	/* directory with the per-UID shards */
+	gchar *shards_path;
+	/* maps shard file names to UIDs, stored in the shards directory */
+	GKeyFile *manifest;
+	guint compact_idle_id;
+
+	/* writes prepared saves to the disk, one at a time */
+	GThreadPool *writer;
+	/* saves failed in a row, see save_job_thread(); accessed atomically */
+	gint save_failures;
+	/* helps the readers with matching many components, see
+	 * match_components() */
+	GThreadPool *matcher;
+	/* snapshots still reading objects of the VCALENDAR; accessed atomically */
+	gint snapshot_pins;
+
+	/* Taken for reading by the methods which only look at the calendar
+	 * data, thus several of them can run at once, and for writing by
+	 * everything changing it, which includes parsing the objects of a
+	 * lazily opened file.  It is not recursive: the helpers called
+	 * with it held never take it again. */
+	GRWLock lock;
+
+	/* Guards cached_timezones and the time zones of the VCALENDAR,
+	 * which get_cached_timezone() looks up with and without the lock
+	 * above being held */
+	GMutex tz_lock;
+
+	/* see component_lock() */
+	GMutex component_locks[N_COMPONENT_LOCKS];
 
 	/* Toplevel VCALENDAR component */
 	ICalComponent *vcalendar;
@@ -84,13 +390,59 @@ struct _ECalBackendDecsyncPrivate {
 	 */
 	GHashTable *comp_uid_hash;
 
-	EIntervalTree *interval_tree;
+	/* Time spans of the components, see insert_into_intervaltree() */
+	ECalBackendDecsyncIntervals *intervals;
+
+	/* All the components, masters and detached recurrences */
+	ECalBackendDecsyncRegistry *components;
 
-	GList *comp;
+	/* The components by what queries ask for, see register_component() */
+	ECalBackendDecsyncQueryIndex *query_index;
+
+	/* The components which matched the recent queries, by revision */
+	ECalBackendDecsyncResults *query_results;
+
+	/* The busy periods of the calendar over a window of time, for its
+	 * revision; see create_free_busy() */
+	GMutex free_busy_lock;
+	BusyPeriods *busy_periods;
+
+	/* Objects not parsed yet, hashed by UID; each item is a GPtrArray
+	 * of ECalBackendDecsyncStub, pointing into mapped_file */
+	GHashTable *stubs;
+	StubIndex *stub_index;
+	GMappedFile *mapped_file;
 
 	/* increased when backend saves the file */
 	guint refresh_skip;
 
+	/* SHA-1 of a UID -> SHA-1 of the resource last applied from or
+	 * written to DecSync for it, none when it was removed, see
+	 * resource_is_unchanged(); stored in the manifest.  digests_changed
+	 * is set when the manifest is not up to date, resource_skips counts
+	 * the entries dropped as unchanged. */
+	GMutex digests_lock;
+	GHashTable *digests;
+	gboolean digests_changed;
+	gint resource_skips;
+
+	/* runs the refreshes, see queue_refresh(); refreshing is set while
+	 * one is queued or running, refresh_pending when another one was
+	 * asked for meanwhile, both accessed atomically.  refresh_lock guards
+	 * the serials of the last refresh started and the last one applied,
+	 * refresh_cond is signalled when one was applied. */
+	GThreadPool *refresher;
+	gint refreshing;
+	gint refresh_pending;
+	GMutex refresh_lock;
+	GCond refresh_cond;
+	guint refresh_started;
+	guint refresh_applied;
+	guint refresh_timeout_id;
+	/* refreshes soon after other apps wrote new entries; the timer
+	 * above is only a fallback then */
+	DecsyncMonitor *monitor;
+
 	/* Just an incremental number to ensure uniqueness across revisions */
 	guint revision_counter;
 
@@ -103,6 +455,11 @@ struct _ECalBackendDecsyncPrivate {
 #define d(x)
 
 static void bump_revision (ECalBackendDecsync *cbfile);
+static ICalProperty *ensure_revision (ECalBackendDecsync *cbfile);
+static ECalBackendDecsyncObject *lookup_object (ECalBackendDecsync *cbfile, const gchar *uid);
+static void materialize_all (ECalBackendDecsync *cbfile);
+static void busy_periods_free (BusyPeriods *busy);
+static gboolean save_file_when_idle (gpointer user_data);
 
 static void	e_cal_backend_decsync_timezone_cache_init
 					(ETimezoneCacheInterface *iface);
@@ -110,6 +467,7 @@ static void	e_cal_backend_decsync_timezone_cache_init
 static ETimezoneCacheInterface *parent_timezone_cache_interface;
 
 static gboolean	ecal_backend_decsync_refresh_start (ECalBackendDecsync *cbfile);
+static void	queue_refresh (ECalBackendDecsync *cbfile);
 static void	e_cal_backend_decsync_initable_init
 						(GInitableIface *iface);
 
@@ -134,833 +492,3253 @@ free_object_data (gpointer data)
 	if (obj_data->full_object)
 		g_object_unref (obj_data->full_object);
 	g_hash_table_destroy (obj_data->recurrences);
-	g_list_free (obj_data->recurrences_list);
+	e_cal_backend_decsync_registry_free (obj_data->recurrence_registry);
+	g_free (obj_data->ical_string);
 
 	g_free (obj_data);
 }
 
-/* Saves the calendar data */
-static gboolean
-save_file_when_idle (gpointer user_data)
+/* libical keeps iteration state in the components themselves, thus even
+ * readers may not use one component from several threads at once.  This
+ * returns the mutex serializing the use of @icomp by the threads holding
+ * the lock for reading; a writer has the calendar data to itself. */
+static GMutex *
+component_lock (ECalBackendDecsync *cbfile,
+                gpointer icomp)
 {
-	ECalBackendDecsyncPrivate *priv;
-	GError *e = NULL;
-	GFile *file, *backup_file;
-	GFileOutputStream *stream;
-	gboolean succeeded;
-	gchar *tmp, *backup_uristr;
-	gchar *buf;
-	ECalBackendDecsync *cbfile = user_data;
-	gboolean writable;
-
-	priv = cbfile->priv;
-	g_return_val_if_fail (priv->path != NULL, FALSE);
-	g_return_val_if_fail (priv->vcalendar != NULL, FALSE);
+	return &cbfile->priv->component_locks[(GPOINTER_TO_SIZE (icomp) >> 4) % N_COMPONENT_LOCKS];
+}
 
-	writable = e_cal_backend_get_writable (E_CAL_BACKEND (cbfile));
+/* Called with tz_lock held after the time zones of the VCALENDAR were
+ * changed: libical sorts them on the first lookup afterwards, which must
+ * not happen in the readers, which look them up concurrently */
+static void
+vcalendar_timezones_changed (ECalBackendDecsync *cbfile)
+{
+	ICalTimezone *zone;
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
-	if (!priv->is_dirty || !writable) {
-		priv->dirty_idle_id = 0;
-		priv->is_dirty = FALSE;
-		g_rec_mutex_unlock (&priv->idle_save_rmutex);
-		return FALSE;
-	}
+	zone = i_cal_component_get_timezone (cbfile->priv->vcalendar, "");
+	g_clear_object (&zone);
+}
 
-	file = g_file_new_for_path (priv->path);
-	if (!file)
-		goto error_malformed_uri;
+static gchar *
+get_shard_file_name (const gchar *uid)
+{
+	gchar *checksum, *file_name;
 
-	/* save calendar to backup file */
-	tmp = g_file_get_uri (file);
-	if (!tmp) {
-		g_object_unref (file);
-		goto error_malformed_uri;
-	}
+	checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, uid, -1);
+	file_name = g_strconcat (checksum, ".ics", NULL);
+	g_free (checksum);
 
-	backup_uristr = g_strconcat (tmp, "~", NULL);
-	backup_file = g_file_new_for_uri (backup_uristr);
+	return file_name;
+}
 
-	g_free (tmp);
-	g_free (backup_uristr);
+static guint
+count_shards (ECalBackendDecsync *cbfile)
+{
+	gchar **keys;
+	gsize n_keys = 0;
 
-	if (!backup_file) {
-		g_object_unref (file);
-		goto error_malformed_uri;
-	}
+	keys = g_key_file_get_keys (cbfile->priv->manifest, MANIFEST_GROUP_SHARDS, &n_keys, NULL);
+	g_strfreev (keys);
 
-	priv->refresh_skip++;
-	stream = g_file_replace (backup_file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, &e);
-	if (!stream || e) {
-		if (stream)
-			g_object_unref (stream);
-
-		g_object_unref (file);
-		g_object_unref (backup_file);
-		priv->refresh_skip--;
-		goto error;
-	}
+	return n_keys;
+}
 
-	buf = i_cal_component_as_ical_string (priv->vcalendar);
-	succeeded = g_output_stream_write_all (G_OUTPUT_STREAM (stream), buf, strlen (buf) * sizeof (gchar), NULL, NULL, &e);
-	g_free (buf);
+/* Returns the manifest to store, together with the current revision,
+ * which the calendar file does not have when the shards are newer */
+static gchar *
+get_manifest_data (ECalBackendDecsync *cbfile)
+{
+	ECalBackendDecsyncPrivate *priv;
+	ICalProperty *prop;
 
-	if (!succeeded || e) {
-		g_object_unref (stream);
-		g_object_unref (file);
-		g_object_unref (backup_file);
-		goto error;
-	}
+	priv = cbfile->priv;
 
-	succeeded = g_output_stream_close (G_OUTPUT_STREAM (stream), NULL, &e);
-	g_object_unref (stream);
+	g_key_file_set_integer (priv->manifest, MANIFEST_GROUP_CALENDAR, "Version", SHARDS_LAYOUT_VERSION);
 
-	if (!succeeded || e) {
-		g_object_unref (file);
-		g_object_unref (backup_file);
-		goto error;
+	prop = ensure_revision (cbfile);
+	if (prop) {
+		g_key_file_set_string (priv->manifest, MANIFEST_GROUP_CALENDAR, "Revision", i_cal_property_get_x (prop));
+		g_object_unref (prop);
 	}
 
-	/* now copy the temporary file to the real file */
-	g_file_move (backup_file, file, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, &e);
-
-	g_object_unref (file);
-	g_object_unref (backup_file);
-	if (e)
-		goto error;
+	g_mutex_lock (&priv->digests_lock);
+	if (priv->digests_changed) {
+		GHashTableIter iter;
+		gpointer key, value;
 
-	priv->is_dirty = FALSE;
-	priv->dirty_idle_id = 0;
+		g_key_file_remove_group (priv->manifest, MANIFEST_GROUP_DIGESTS, NULL);
 
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+		g_hash_table_iter_init (&iter, priv->digests);
+		while (g_hash_table_iter_next (&iter, &key, &value))
+			g_key_file_set_string (priv->manifest, MANIFEST_GROUP_DIGESTS, key, value);
 
-	return FALSE;
+		priv->digests_changed = FALSE;
+	}
+	g_mutex_unlock (&priv->digests_lock);
 
- error_malformed_uri:
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
-	e_cal_backend_notify_error (E_CAL_BACKEND (cbfile),
-				  _("Cannot save calendar data: Malformed URI."));
-	return FALSE;
+	return g_key_file_to_data (priv->manifest, NULL, NULL);
+}
 
- error:
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+/* Returns the digest of a resource as DecSync has it, @payload being
+ * NULL for a removed one */
+static gchar *
+compute_resource_digest (const gchar *payload)
+{
+	return g_compute_checksum_for_string (G_CHECKSUM_SHA1, payload ? payload : "", -1);
+}
 
-	if (e) {
-		gchar *msg = g_strdup_printf ("%s: %s", _("Cannot save calendar data"), e->message);
+/* Remembers @digest as the one of the resource @uid last applied from or
+ * written to DecSync; a removed resource keeps the digest of no payload,
+ * so that its removal is skipped when it is published again */
+static void
+set_resource_digest (ECalBackendDecsync *cbfile,
+                     const gchar *uid,
+                     const gchar *digest)
+{
+	ECalBackendDecsyncPrivate *priv = cbfile->priv;
+	gchar *uid_digest;
 
-		e_cal_backend_notify_error (E_CAL_BACKEND (cbfile), msg);
-		g_free (msg);
-		g_error_free (e);
-	} else
-		e_cal_backend_notify_error (E_CAL_BACKEND (cbfile), _("Cannot save calendar data"));
+	uid_digest = g_compute_checksum_for_string (G_CHECKSUM_SHA1, uid, -1);
 
-	return FALSE;
+	g_mutex_lock (&priv->digests_lock);
+	g_hash_table_insert (priv->digests, uid_digest, g_strdup (digest));
+	priv->digests_changed = TRUE;
+	g_mutex_unlock (&priv->digests_lock);
 }
 
+/* Remembers @payload as the resource @uid written to DecSync, NULL
+ * when it was removed */
 static void
-save (ECalBackendDecsync *cbfile,
-      gboolean do_bump_revision)
+set_resource_payload (ECalBackendDecsync *cbfile,
+                      const gchar *uid,
+                      const gchar *payload)
 {
-	ECalBackendDecsyncPrivate *priv;
+	gchar *digest;
 
-	if (do_bump_revision)
-		bump_revision (cbfile);
-
-	priv = cbfile->priv;
+	digest = compute_resource_digest (payload);
+	set_resource_digest (cbfile, uid, digest);
+	g_free (digest);
+}
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
-	priv->is_dirty = TRUE;
+/* Whether @digest is the one of the resource @uid last applied from or
+ * written to DecSync; takes no lock but digests_lock */
+static gboolean
+resource_is_unchanged (ECalBackendDecsync *cbfile,
+                       const gchar *uid,
+                       const gchar *digest)
+{
+	ECalBackendDecsyncPrivate *priv = cbfile->priv;
+	gchar *uid_digest;
+	gboolean unchanged;
 
-	if (!priv->dirty_idle_id)
-		priv->dirty_idle_id = g_idle_add ((GSourceFunc) save_file_when_idle, cbfile);
+	uid_digest = g_compute_checksum_for_string (G_CHECKSUM_SHA1, uid, -1);
 
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
-}
+	g_mutex_lock (&priv->digests_lock);
+	unchanged = g_strcmp0 (g_hash_table_lookup (priv->digests, uid_digest), digest) == 0;
+	g_mutex_unlock (&priv->digests_lock);
 
-static void
-free_calendar_components (GHashTable *comp_uid_hash,
-                          ICalComponent *top_icomp)
-{
-	if (comp_uid_hash)
-		g_hash_table_destroy (comp_uid_hash);
+	g_free (uid_digest);
 
-	if (top_icomp)
-		g_object_unref (top_icomp);
+	return unchanged;
 }
 
+/* Reads the digests of the resources from the manifest just loaded */
 static void
-free_calendar_data (ECalBackendDecsync *cbfile)
+load_resource_digests (ECalBackendDecsync *cbfile)
 {
-	ECalBackendDecsyncPrivate *priv;
+	ECalBackendDecsyncPrivate *priv = cbfile->priv;
+	gchar **keys;
+	gsize n_keys = 0, ii;
 
-	priv = cbfile->priv;
+	keys = g_key_file_get_keys (priv->manifest, MANIFEST_GROUP_DIGESTS, &n_keys, NULL);
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
+	g_mutex_lock (&priv->digests_lock);
+	g_hash_table_remove_all (priv->digests);
+	for (ii = 0; ii < n_keys; ii++) {
+		gchar *digest;
 
-	if (priv->interval_tree)
-		e_intervaltree_destroy (priv->interval_tree);
-	priv->interval_tree = NULL;
+		digest = g_key_file_get_string (priv->manifest, MANIFEST_GROUP_DIGESTS, keys[ii], NULL);
+		if (digest)
+			g_hash_table_insert (priv->digests, g_strdup (keys[ii]), digest);
+	}
+	priv->digests_changed = FALSE;
+	g_mutex_unlock (&priv->digests_lock);
 
-	free_calendar_components (priv->comp_uid_hash, priv->vcalendar);
-	priv->comp_uid_hash = NULL;
-	priv->vcalendar = NULL;
+	g_strfreev (keys);
+}
 
-	g_list_free (priv->comp);
-	priv->comp = NULL;
+/* Output kept in memory before it is written to a DurableFile */
+#define DURABLE_FILE_BUFFER_SIZE 65536
 
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
-}
+/* A file written to a temporary file next to its path, which is flushed to
+ * the disk and only then renamed over the path by durable_file_commit() */
+typedef struct {
+	gchar *path;
+	gchar *tmp_path;
+	gint fd;
+	GString *buffer;
+	gint64 offset;
+} DurableFile;
 
-/* Dispose handler for the decsync backend */
 static void
-e_cal_backend_decsync_dispose (GObject *object)
+durable_file_set_error (DurableFile *file,
+                        gint errsv,
+                        GError **error)
 {
-	ECalBackendDecsync *cbfile;
-	ECalBackendDecsyncPrivate *priv;
-	ESource *source;
+	g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+		_("Cannot write file “%s”: %s"), file->path, g_strerror (errsv));
+}
 
-	cbfile = E_CAL_BACKEND_DECSYNC (object);
-	priv = cbfile->priv;
+/* Closes @file without touching its path */
+static void
+durable_file_abort (DurableFile *file)
+{
+	if (file->fd != -1)
+		close (file->fd);
+	g_unlink (file->tmp_path);
+	g_string_free (file->buffer, TRUE);
+	g_free (file->tmp_path);
+	g_free (file->path);
+	g_slice_free (DurableFile, file);
+}
 
-	/* Save if necessary */
-	if (priv->is_dirty)
-		save_file_when_idle (cbfile);
+static DurableFile *
+durable_file_open (const gchar *path,
+                   GError **error)
+{
+	DurableFile *file;
 
-	free_calendar_data (cbfile);
+	file = g_slice_new0 (DurableFile);
+	file->path = g_strdup (path);
+	file->tmp_path = g_strconcat (path, "~", NULL);
+	file->buffer = g_string_sized_new (DURABLE_FILE_BUFFER_SIZE);
 
-	source = e_backend_get_source (E_BACKEND (cbfile));
-	if (source)
-		g_signal_handlers_disconnect_matched (source, G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, cbfile);
+	file->fd = g_open (file->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+	if (file->fd == -1) {
+		durable_file_set_error (file, errno, error);
+		durable_file_abort (file);
+		return NULL;
+	}
 
-	/* Chain up to parent's dispose() method. */
-	G_OBJECT_CLASS (e_cal_backend_decsync_parent_class)->dispose (object);
+	return file;
 }
 
-/* Finalize handler for the decsync backend */
-static void
-e_cal_backend_decsync_finalize (GObject *object)
+static gboolean
+durable_file_write_all (DurableFile *file,
+                        const gchar *data,
+                        gsize len,
+                        GError **error)
 {
-	ECalBackendDecsyncPrivate *priv;
-
-	priv = E_CAL_BACKEND_DECSYNC (object)->priv;
+	gsize pos = 0;
 
-	/* Clean up */
+	while (pos < len) {
+		gssize written;
 
-	if (priv->dirty_idle_id)
-		g_source_remove (priv->dirty_idle_id);
+		written = write (file->fd, data + pos, len - pos);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
 
-	g_rec_mutex_clear (&priv->idle_save_rmutex);
-	g_hash_table_destroy (priv->cached_timezones);
+			durable_file_set_error (file, errno, error);
+			return FALSE;
+		}
 
-	g_free (priv->path);
-	g_free (priv->file_name);
+		pos += written;
+	}
 
-	/* Chain up to parent's finalize() method. */
-	G_OBJECT_CLASS (e_cal_backend_decsync_parent_class)->finalize (object);
+	return TRUE;
 }
 
-/* Looks up a component by its UID on the backend's component hash table
- * and returns TRUE if any event (regardless whether it is the master or a child)
- * with that UID exists */
 static gboolean
-uid_in_use (ECalBackendDecsync *cbfile,
-            const gchar *uid)
+durable_file_flush (DurableFile *file,
+                    GError **error)
 {
-	ECalBackendDecsyncPrivate *priv;
-	ECalBackendDecsyncObject *obj_data;
+	if (!durable_file_write_all (file, file->buffer->str, file->buffer->len, error))
+		return FALSE;
 
-	priv = cbfile->priv;
+	g_string_truncate (file->buffer, 0);
 
-	obj_data = g_hash_table_lookup (priv->comp_uid_hash, uid);
-	return obj_data != NULL;
+	return TRUE;
 }
 
-static ICalProperty *
-get_revision_property (ECalBackendDecsync *cbfile)
+/* Appends @data to @file; only a small part of the output is held in
+ * memory, the rest goes to the disk as it comes */
+static gboolean
+durable_file_write (DurableFile *file,
+                    const gchar *data,
+                    gsize len,
+                    GError **error)
 {
-	if (!cbfile->priv->vcalendar)
-		return NULL;
-
-	return e_cal_util_component_find_x_property (cbfile->priv->vcalendar, ECAL_REVISION_X_PROP);
-}
+	file->offset += len;
 
-static gchar *
-make_revision_string (ECalBackendDecsync *cbfile)
-{
-	GTimeVal timeval;
-	gchar   *datestr;
-	gchar   *revision;
+	if (file->buffer->len + len > DURABLE_FILE_BUFFER_SIZE) {
+		if (!durable_file_flush (file, error))
+			return FALSE;
 
-	g_get_current_time (&timeval);
+		/* no point in copying what fills the buffer anyway */
+		if (len >= DURABLE_FILE_BUFFER_SIZE)
+			return durable_file_write_all (file, data, len, error);
+	}
 
-	datestr = g_time_val_to_iso8601 (&timeval);
-	revision = g_strdup_printf ("%s(%d)", datestr, cbfile->priv->revision_counter++);
+	g_string_append_len (file->buffer, data, len);
 
-	g_free (datestr);
-	return revision;
+	return TRUE;
 }
 
-static ICalProperty *
-ensure_revision (ECalBackendDecsync *cbfile)
+/* Flushes the directory of @file to the disk, so that its rename survives
+ * a power loss too */
+static gboolean
+durable_file_sync_dir (DurableFile *file,
+                       GError **error)
 {
-	ICalProperty *prop;
+#ifdef O_DIRECTORY
+	gchar *dir_path;
+	gint fd, errsv = 0;
 
-	if (cbfile->priv->vcalendar == NULL)
-		return NULL;
+	dir_path = g_path_get_dirname (file->path);
+
+	fd = g_open (dir_path, O_RDONLY | O_DIRECTORY, 0);
+	if (fd == -1 || fsync (fd) != 0)
+		errsv = errno;
+	if (fd != -1)
+		close (fd);
+
+	g_free (dir_path);
+
+	if (errsv) {
+		durable_file_set_error (file, errsv, error);
+		return FALSE;
+	}
+#endif
+
+	return TRUE;
+}
+
+/* Writes out what is left of @file, flushes it to the disk and renames it
+ * over its path, then flushes the directory; @file is freed in any case */
+static gboolean
+durable_file_commit (DurableFile *file,
+                     GError **error)
+{
+	gint fd;
+
+	if (!durable_file_flush (file, error)) {
+		durable_file_abort (file);
+		return FALSE;
+	}
+
+	if (fsync (file->fd) != 0) {
+		durable_file_set_error (file, errno, error);
+		durable_file_abort (file);
+		return FALSE;
+	}
+
+	fd = file->fd;
+	file->fd = -1;
+
+	if (close (fd) != 0 || g_rename (file->tmp_path, file->path) != 0) {
+		durable_file_set_error (file, errno, error);
+		durable_file_abort (file);
+		return FALSE;
+	}
+
+	if (!durable_file_sync_dir (file, error)) {
+		durable_file_abort (file);
+		return FALSE;
+	}
+
+	g_string_free (file->buffer, TRUE);
+	g_free (file->tmp_path);
+	g_free (file->path);
+	g_slice_free (DurableFile, file);
+
+	return TRUE;
+}
+
+/* Writes @data to a temporary file next to @path, flushes it to the disk
+ * and only then renames it over @path */
+static gboolean
+write_file_durably (const gchar *path,
+                    const gchar *data,
+                    gsize len,
+                    GError **error)
+{
+	DurableFile *file;
+
+	file = durable_file_open (path, error);
+	if (!file)
+		return FALSE;
+
+	if (!durable_file_write (file, data, len, error)) {
+		durable_file_abort (file);
+		return FALSE;
+	}
+
+	return durable_file_commit (file, error);
+}
+
+static void
+free_stub (gpointer data)
+{
+	ECalBackendDecsyncStub *stub = data;
+
+	g_free (stub->uid);
+	g_free (stub->rid);
+	g_slice_free (ECalBackendDecsyncStub, stub);
+}
+
+static ECalComponent *
+find_component (ECalBackendDecsync *cbfile,
+                ICalComponent *icomp)
+{
+	ECalBackendDecsyncObject *obj_data;
+	ECalComponent *comp = NULL;
+	const gchar *uid;
+	gchar *rid;
+
+	uid = i_cal_component_get_uid (icomp);
+	obj_data = uid ? g_hash_table_lookup (cbfile->priv->comp_uid_hash, uid) : NULL;
+	if (!obj_data)
+		return NULL;
+
+	rid = e_cal_util_component_get_recurid_as_string (icomp);
+	if (rid && *rid)
+		comp = g_hash_table_lookup (obj_data->recurrences, rid);
+	else
+		comp = obj_data->full_object;
+	g_free (rid);
+
+	return comp;
+}
+
+/* A save prepared under the lock, to be carried out by the writer thread */
+typedef struct {
+	ECalBackendDecsync *cbfile;
+
+	gchar *path;
+	gchar *shards_path;
+
+	/* Full write of the calendar file.  The objects are pinned, not
+	 * copied: they are changed in place only after unshare_component(),
+	 * while a snapshot is being written. */
+	gboolean snapshot;
+	gchar *header;
+	gchar *footer;
+	GPtrArray *objects; /* ICalComponent * */
+	GPtrArray *entries; /* ECalBackendDecsyncStub *, for the index */
+	gchar *revision;
+	gchar **obsolete_shards;
+
+	/* Shards to write, as pairs of file name and content */
+	GPtrArray *shards;
+
+	gchar *manifest;
+} SaveJob;
+
+static void
+save_job_free (SaveJob *job)
+{
+	g_free (job->path);
+	g_free (job->shards_path);
+	g_free (job->header);
+	g_free (job->footer);
+	if (job->objects)
+		g_ptr_array_unref (job->objects);
+	if (job->entries)
+		g_ptr_array_unref (job->entries);
+	g_free (job->revision);
+	g_strfreev (job->obsolete_shards);
+	if (job->shards)
+		g_ptr_array_unref (job->shards);
+	g_free (job->manifest);
+	g_slice_free (SaveJob, job);
+}
+
+static SaveJob *
+save_job_new (ECalBackendDecsync *cbfile)
+{
+	SaveJob *job;
+
+	job = g_slice_new0 (SaveJob);
+	job->cbfile = cbfile;
+	job->path = g_strdup (cbfile->priv->path);
+	job->shards_path = g_strdup (cbfile->priv->shards_path);
+
+	return job;
+}
+
+/* Takes what a full write of the calendar file needs from the current
+ * state: the serialized properties and time zones, and references to the
+ * objects, which go after them */
+static SaveJob *
+prepare_snapshot (ECalBackendDecsync *cbfile)
+{
+	ECalBackendDecsyncPrivate *priv;
+	ICalComponent *header, *icomp;
+	ICalProperty *prop;
+	ICalCompIter *iter;
+	SaveJob *job;
+	gchar *header_str, *footer;
+
+	priv = cbfile->priv;
+
+	/* objects not parsed yet are not part of the VCALENDAR */
+	materialize_all (cbfile);
+
+	job = save_job_new (cbfile);
+	job->snapshot = TRUE;
+	job->objects = g_ptr_array_new_with_free_func (g_object_unref);
+	job->entries = g_ptr_array_new_with_free_func (free_stub);
+
+	header = i_cal_component_new_vcalendar ();
+
+	for (prop = i_cal_component_get_first_property (priv->vcalendar, I_CAL_ANY_PROPERTY);
+	     prop;
+	     g_object_unref (prop), prop = i_cal_component_get_next_property (priv->vcalendar, I_CAL_ANY_PROPERTY)) {
+		i_cal_component_take_property (header, i_cal_property_clone (prop));
+	}
+
+	iter = i_cal_component_begin_component (priv->vcalendar, I_CAL_ANY_COMPONENT);
+	icomp = iter ? i_cal_comp_iter_deref (iter) : NULL;
+	while (icomp) {
+		ICalComponentKind kind = i_cal_component_isa (icomp);
+
+		if (kind == I_CAL_VEVENT_COMPONENT ||
+		    kind == I_CAL_VTODO_COMPONENT ||
+		    kind == I_CAL_VJOURNAL_COMPONENT) {
+			ECalBackendDecsyncStub *entry;
+			ECalComponent *comp;
+			OccurTimes *times;
+
+			entry = g_slice_new0 (ECalBackendDecsyncStub);
+			entry->uid = g_strdup (i_cal_component_get_uid (icomp));
+			entry->rid = e_cal_util_component_get_recurid_as_string (icomp);
+
+			comp = find_component (cbfile, icomp);
+			times = comp ? g_object_get_qdata (G_OBJECT (comp), occur_times_quark ()) : NULL;
+			entry->start = times ? times->start : G_MININT64;
+			entry->end = times ? times->end : G_MAXINT64;
+
+			/* the component owned by the ECalComponent stays valid when
+			 * the object is removed meanwhile; others are copied */
+			if (comp)
+				g_ptr_array_add (job->objects, g_object_ref (e_cal_component_get_icalcomponent (comp)));
+			else
+				g_ptr_array_add (job->objects, i_cal_component_clone (icomp));
+			g_ptr_array_add (job->entries, entry);
+		} else {
+			i_cal_component_take_component (header, i_cal_component_clone (icomp));
+		}
+
+		g_object_unref (icomp);
+		icomp = i_cal_comp_iter_next (iter);
+	}
+
+	g_clear_object (&iter);
+
+	header_str = i_cal_component_as_ical_string (header);
+	g_object_unref (header);
+
+	footer = g_strrstr (header_str, "END:VCALENDAR");
+	if (footer) {
+		job->footer = g_strdup (footer);
+		*footer = '\0';
+	}
+	job->header = header_str;
+
+	prop = ensure_revision (cbfile);
+	if (prop) {
+		job->revision = g_strdup (i_cal_property_get_x (prop));
+		g_object_unref (prop);
+	}
+
+	/* everything the shards held is part of the calendar file now */
+	job->obsolete_shards = g_key_file_get_keys (priv->manifest, MANIFEST_GROUP_SHARDS, NULL, NULL);
+	g_key_file_remove_group (priv->manifest, MANIFEST_GROUP_SHARDS, NULL);
+	if (job->revision)
+		g_key_file_set_string (priv->manifest, MANIFEST_GROUP_CALENDAR, "BaseRevision", job->revision);
+	job->manifest = get_manifest_data (cbfile);
+
+	g_atomic_int_inc (&priv->snapshot_pins);
+	priv->refresh_skip++;
+
+	priv->needs_snapshot = FALSE;
+	priv->is_dirty = FALSE;
+	g_hash_table_remove_all (priv->dirty_uids);
+
+	return job;
+}
+
+/* Streams a snapshot to @file: the header with the time zones, then the
+ * objects, one at a time, filling the position of each of them in the
+ * index entries, and the footer.  Only one object is serialized at a time,
+ * so that the save needs little memory beyond the calendar itself.  The
+ * objects are shared with the readers, thus this holds the lock for
+ * reading, a chunk at a time, so that writers are not held off for the
+ * whole snapshot. */
+static gboolean
+stream_snapshot (SaveJob *job,
+                 DurableFile *file,
+                 GError **error)
+{
+	ECalBackendDecsyncPrivate *priv;
+	gboolean succeeded;
+	guint ii;
+
+	priv = job->cbfile->priv;
+
+	succeeded = durable_file_write (file, job->header, strlen (job->header), error);
+
+	for (ii = 0; succeeded && ii < job->objects->len; ii++) {
+		ECalBackendDecsyncStub *entry = g_ptr_array_index (job->entries, ii);
+		ICalComponent *icomp = g_ptr_array_index (job->objects, ii);
+		GMutex *mutex;
+		gchar *str;
+
+		if (ii % SNAPSHOT_CHUNK_SIZE == 0) {
+			if (ii)
+				g_rw_lock_reader_unlock (&priv->lock);
+			g_rw_lock_reader_lock (&priv->lock);
+		}
+
+		mutex = component_lock (job->cbfile, icomp);
+		g_mutex_lock (mutex);
+		str = i_cal_component_as_ical_string (icomp);
+		g_mutex_unlock (mutex);
+
+		entry->offset = file->offset;
+		entry->length = strlen (str);
+
+		succeeded = durable_file_write (file, str, entry->length, error);
+		g_free (str);
+	}
+
+	if (ii)
+		g_rw_lock_reader_unlock (&priv->lock);
+
+	if (succeeded && job->footer)
+		succeeded = durable_file_write (file, job->footer, strlen (job->footer), error);
+
+	return succeeded;
+}
+
+static void
+index_put_string (GByteArray *data,
+                  const gchar *str)
+{
+	guint32 len = str ? strlen (str) : 0;
+
+	g_byte_array_append (data, (const guint8 *) &len, sizeof (len));
+	if (len)
+		g_byte_array_append (data, (const guint8 *) str, len);
+}
+
+static void
+index_put_int64 (GByteArray *data,
+                 gint64 value)
+{
+	g_byte_array_append (data, (const guint8 *) &value, sizeof (value));
+}
+
+/* Gives @comp a component of its own when a snapshot may still be reading
+ * the current one; called before changing it in place, after it was
+ * removed from the VCALENDAR */
+static void
+unshare_component (ECalBackendDecsync *cbfile,
+                   ECalComponent *comp)
+{
+	if (g_atomic_int_get (&cbfile->priv->snapshot_pins) > 0)
+		e_cal_component_set_icalcomponent (comp, i_cal_component_clone (e_cal_component_get_icalcomponent (comp)));
+}
+
+/* Writes the index for the calendar file just written; it is only valid
+ * for a file of the same size, modification time and revision */
+static void
+write_index (SaveJob *job)
+{
+	GByteArray *data;
+	GStatBuf st;
+	GError *error = NULL;
+	gchar *index_path;
+	guint32 value;
+	guint ii;
+
+	index_path = g_strconcat (job->path, INDEX_SUFFIX, NULL);
+
+	if (g_stat (job->path, &st) != 0) {
+		g_unlink (index_path);
+		g_free (index_path);
+		return;
+	}
+
+	data = g_byte_array_new ();
+
+	g_byte_array_append (data, (const guint8 *) INDEX_MAGIC, strlen (INDEX_MAGIC));
+	value = INDEX_VERSION;
+	g_byte_array_append (data, (const guint8 *) &value, sizeof (value));
+	index_put_int64 (data, st.st_size);
+	index_put_int64 (data, st.st_mtime);
+	index_put_string (data, job->revision);
+	value = job->entries->len;
+	g_byte_array_append (data, (const guint8 *) &value, sizeof (value));
+
+	for (ii = 0; ii < job->entries->len; ii++) {
+		ECalBackendDecsyncStub *entry = g_ptr_array_index (job->entries, ii);
+
+		index_put_string (data, entry->uid);
+		index_put_string (data, entry->rid);
+		index_put_int64 (data, entry->start);
+		index_put_int64 (data, entry->end);
+		index_put_int64 (data, entry->offset);
+		index_put_int64 (data, entry->length);
+	}
+
+	if (!write_file_durably (index_path, (const gchar *) data->data, data->len, &error)) {
+		g_warning (G_STRLOC ": Cannot write index '%s': %s", index_path, error->message);
+		g_clear_error (&error);
+		g_unlink (index_path);
+	}
+
+	g_byte_array_unref (data);
+	g_free (index_path);
+}
+
+/* Writes the whole VCALENDAR to the calendar file, then its index and the
+ * manifest, which lists no shards anymore, and drops the shard files, all
+ * contained in the calendar file afterwards.  When this stops before the
+ * manifest is written, the previous one names another base revision than
+ * the calendar file has, thus load_shards() ignores its shards; leftover
+ * shard files are harmless. */
+static gboolean
+write_snapshot (SaveJob *job,
+                GError **error)
+{
+	ECalBackendDecsyncPrivate *priv;
+	DurableFile *file;
+	gchar *manifest_path;
+	gboolean succeeded;
+	gint ii;
+
+	priv = job->cbfile->priv;
+
+	file = durable_file_open (job->path, error);
+	succeeded = file && stream_snapshot (job, file, error);
+
+	/* the objects may be changed in place again */
+	g_clear_pointer (&job->objects, g_ptr_array_unref);
+	g_atomic_int_dec_and_test (&priv->snapshot_pins);
+
+	if (!succeeded) {
+		if (file)
+			durable_file_abort (file);
+		return FALSE;
+	}
+
+	if (!durable_file_commit (file, error))
+		return FALSE;
+
+	write_index (job);
+
+	if (g_mkdir_with_parents (job->shards_path, 0700) != 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			_("Cannot create directory “%s”: %s"), job->shards_path, g_strerror (errno));
+		return FALSE;
+	}
+
+	manifest_path = g_build_filename (job->shards_path, SHARDS_MANIFEST, NULL);
+	succeeded = write_file_durably (manifest_path, job->manifest, strlen (job->manifest), error);
+	g_free (manifest_path);
+
+	if (!succeeded)
+		return FALSE;
+
+	for (ii = 0; job->obsolete_shards && job->obsolete_shards[ii]; ii++) {
+		gchar *shard_path;
+
+		shard_path = g_build_filename (job->shards_path, job->obsolete_shards[ii], NULL);
+		if (g_unlink (shard_path) != 0 && errno != ENOENT)
+			g_warning (G_STRLOC ": Failed to remove shard '%s': %s", shard_path, g_strerror (errno));
+		g_free (shard_path);
+	}
+
+	return TRUE;
+}
+
+static void
+add_referenced_timezone_cb (ICalParameter *param,
+                            gpointer user_data)
+{
+	GHashTable *tzids = user_data;
+	const gchar *tzid;
+
+	tzid = i_cal_parameter_get_tzid (param);
+	if (tzid && *tzid && !g_hash_table_contains (tzids, tzid))
+		g_hash_table_add (tzids, g_strdup (tzid));
+}
+
+/* Returns the VCALENDAR stored in the shard for @uid, containing the
+ * master object, its detached instances and all the time zones they use;
+ * it has no objects when the UID does not exist anymore */
+static gchar *
+get_shard_payload (ECalBackendDecsync *cbfile,
+                   const gchar *uid)
+{
+	ECalBackendDecsyncPrivate *priv;
+	ECalBackendDecsyncObject *obj_data;
+	ICalComponent *icomp;
+	GHashTable *tzids;
+	GHashTableIter iter;
+	gpointer key, value;
+	gchar *payload;
+
+	priv = cbfile->priv;
+
+	icomp = e_cal_util_new_top_level ();
+
+	obj_data = g_hash_table_lookup (priv->comp_uid_hash, uid);
+	if (!obj_data) {
+		payload = i_cal_component_as_ical_string (icomp);
+		g_object_unref (icomp);
+
+		return payload;
+	}
+
+	tzids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+	if (obj_data->full_object) {
+		ICalComponent *subcomp = e_cal_component_get_icalcomponent (obj_data->full_object);
+
+		i_cal_component_foreach_tzid (subcomp, add_referenced_timezone_cb, tzids);
+		i_cal_component_take_component (icomp, i_cal_component_clone (subcomp));
+	}
+
+	g_hash_table_iter_init (&iter, obj_data->recurrences);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		ICalComponent *subcomp = e_cal_component_get_icalcomponent (value);
+
+		i_cal_component_foreach_tzid (subcomp, add_referenced_timezone_cb, tzids);
+		i_cal_component_take_component (icomp, i_cal_component_clone (subcomp));
+	}
+
+	g_hash_table_iter_init (&iter, tzids);
+	while (g_hash_table_iter_next (&iter, &key, NULL)) {
+		ICalTimezone *zone;
+
+		zone = i_cal_component_get_timezone (priv->vcalendar, key);
+		if (zone) {
+			ICalComponent *tz_comp = i_cal_timezone_get_component (zone);
+
+			if (tz_comp)
+				i_cal_component_take_component (icomp, i_cal_component_clone (tz_comp));
+
+			g_clear_object (&tz_comp);
+			g_object_unref (zone);
+		}
+	}
+
+	payload = i_cal_component_as_ical_string (icomp);
+
+	g_hash_table_destroy (tzids);
+	g_object_unref (icomp);
+
+	return payload;
+}
+
+/* Serializes a shard for every changed UID */
+static SaveJob *
+prepare_shards (ECalBackendDecsync *cbfile)
+{
+	ECalBackendDecsyncPrivate *priv;
+	GHashTableIter iter;
+	gpointer key;
+	SaveJob *job;
+
+	priv = cbfile->priv;
+
+	job = save_job_new (cbfile);
+	job->shards = g_ptr_array_new_with_free_func (g_free);
+
+	g_hash_table_iter_init (&iter, priv->dirty_uids);
+	while (g_hash_table_iter_next (&iter, &key, NULL)) {
+		gchar *shard_name;
+
+		shard_name = get_shard_file_name (key);
+		g_key_file_set_string (priv->manifest, MANIFEST_GROUP_SHARDS, shard_name, key);
+
+		g_ptr_array_add (job->shards, shard_name);
+		g_ptr_array_add (job->shards, get_shard_payload (cbfile, key));
+	}
+
+	job->manifest = get_manifest_data (cbfile);
+
+	priv->is_dirty = FALSE;
+	g_hash_table_remove_all (priv->dirty_uids);
+
+	return job;
+}
+
+/* Writes the shards, then the manifest listing them */
+static gboolean
+write_shards (SaveJob *job,
+              GError **error)
+{
+	gchar *manifest_path;
+	gboolean succeeded;
+	guint ii;
+
+	if (g_mkdir_with_parents (job->shards_path, 0700) != 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			_("Cannot create directory “%s”: %s"), job->shards_path, g_strerror (errno));
+		return FALSE;
+	}
+
+	for (ii = 0; ii + 1 < job->shards->len; ii += 2) {
+		const gchar *payload = g_ptr_array_index (job->shards, ii + 1);
+		gchar *shard_path;
+
+		shard_path = g_build_filename (job->shards_path, g_ptr_array_index (job->shards, ii), NULL);
+		succeeded = write_file_durably (shard_path, payload, strlen (payload), error);
+		g_free (shard_path);
+
+		if (!succeeded)
+			return FALSE;
+	}
+
+	manifest_path = g_build_filename (job->shards_path, SHARDS_MANIFEST, NULL);
+	succeeded = write_file_durably (manifest_path, job->manifest, strlen (job->manifest), error);
+	g_free (manifest_path);
+
+	return succeeded;
+}
+
+static void
+notify_save_error (ECalBackendDecsync *cbfile,
+                   GError *error)
+{
+	if (error) {
+		gchar *msg = g_strdup_printf ("%s: %s", _("Cannot save calendar data"), error->message);
+
+		e_cal_backend_notify_error (E_CAL_BACKEND (cbfile), msg);
+		g_free (msg);
+	} else
+		e_cal_backend_notify_error (E_CAL_BACKEND (cbfile), _("Cannot save calendar data"));
+}
+
+/* Runs in the writer thread, without holding the lock; a failed save is
+ * retried from the main loop */
+static void
+save_job_thread (gpointer data,
+                 gpointer user_data)
+{
+	SaveJob *job = data;
+	ECalBackendDecsyncPrivate *priv;
+	GError *e = NULL;
+	gboolean succeeded;
+
+	priv = job->cbfile->priv;
+
+	if (job->snapshot)
+		succeeded = write_snapshot (job, &e);
+	else
+		succeeded = write_shards (job, &e);
+
+	if (!succeeded) {
+		guint delay;
+
+		/* a failure in a row waits twice as long as the one before */
+		delay = SAVE_RETRY_MIN_SECONDS << MIN (g_atomic_int_add (&priv->save_failures, 1), 6);
+
+		/* what is on the disk is consistent, but old; write it all again,
+		 * also when nothing else changes */
+		g_rw_lock_writer_lock (&priv->lock);
+		priv->needs_snapshot = TRUE;
+		priv->is_dirty = TRUE;
+		if (!priv->dirty_idle_id)
+			priv->dirty_idle_id = e_named_timeout_add_seconds (
+				MIN (delay, SAVE_RETRY_MAX_SECONDS), save_file_when_idle, job->cbfile);
+		g_rw_lock_writer_unlock (&priv->lock);
+
+		notify_save_error (job->cbfile, e);
+		g_clear_error (&e);
+	} else {
+		g_atomic_int_set (&priv->save_failures, 0);
+	}
+
+	save_job_free (job);
+}
+
+/* Hands a prepared save over to the writer thread, which carries the saves
+ * out one after another, in the order they were prepared in */
+static void
+queue_save_job (ECalBackendDecsync *cbfile,
+                SaveJob *job)
+{
+	ECalBackendDecsyncPrivate *priv;
+
+	priv = cbfile->priv;
+
+	if (!priv->writer)
+		priv->writer = g_thread_pool_new (save_job_thread, NULL, 1, TRUE, NULL);
+
+	g_thread_pool_push (priv->writer, job, NULL);
+}
+
+/* Folds the shards into the calendar file, or rewrites it when that was
+ * requested; runs at low priority, so that it does not compete with
+ * requests being served */
+static gboolean
+compact_shards_when_idle (gpointer user_data)
+{
+	ECalBackendDecsync *cbfile = user_data;
+	ECalBackendDecsyncPrivate *priv;
+
+	priv = cbfile->priv;
+
+	g_rw_lock_writer_lock (&priv->lock);
+
+	priv->compact_idle_id = 0;
+
+	if (priv->vcalendar && (priv->needs_snapshot || count_shards (cbfile) > SHARDS_COMPACT_THRESHOLD) &&
+	    e_cal_backend_get_writable (E_CAL_BACKEND (cbfile)))
+		queue_save_job (cbfile, prepare_snapshot (cbfile));
+
+	g_rw_lock_writer_unlock (&priv->lock);
+
+	return FALSE;
+}
+
+/* Saves the calendar data; only a snapshot of what changed is taken under
+ * the lock, the writer thread serializes and writes it */
+static gboolean
+save_file_when_idle (gpointer user_data)
+{
+	ECalBackendDecsyncPrivate *priv;
+	ECalBackendDecsync *cbfile = user_data;
+	gboolean writable;
+
+	priv = cbfile->priv;
+	g_return_val_if_fail (priv->path != NULL, FALSE);
+	g_return_val_if_fail (priv->vcalendar != NULL, FALSE);
+
+	writable = e_cal_backend_get_writable (E_CAL_BACKEND (cbfile));
+
+	g_rw_lock_writer_lock (&priv->lock);
+	priv->dirty_idle_id = 0;
+
+	if (!priv->is_dirty || !writable) {
+		priv->is_dirty = FALSE;
+		g_rw_lock_writer_unlock (&priv->lock);
+		return FALSE;
+	}
+
+	/* Only the shards of the changed objects are written; the whole
+	 * file is rewritten when there is no usable one yet */
+	if (priv->needs_snapshot)
+		queue_save_job (cbfile, prepare_snapshot (cbfile));
+	else
+		queue_save_job (cbfile, prepare_shards (cbfile));
+
+	if (!priv->compact_idle_id && count_shards (cbfile) > SHARDS_COMPACT_THRESHOLD)
+		priv->compact_idle_id = g_idle_add_full (G_PRIORITY_LOW, compact_shards_when_idle, cbfile, NULL);
+
+	g_rw_lock_writer_unlock (&priv->lock);
+
+	return FALSE;
+}
+
+/* Called with the lock held for writing */
+static void
+save (ECalBackendDecsync *cbfile,
+      gboolean do_bump_revision)
+{
+	ECalBackendDecsyncPrivate *priv;
+
+	if (do_bump_revision)
+		bump_revision (cbfile);
+
+	priv = cbfile->priv;
+
+	priv->is_dirty = TRUE;
+
+	if (!priv->dirty_idle_id)
+		priv->dirty_idle_id = g_idle_add ((GSourceFunc) save_file_when_idle, cbfile);
+}
+
+/* Remembers that the shard of the object with @uid has to be written
+ * on the next save */
+static void
+mark_uid_dirty (ECalBackendDecsync *cbfile,
+                const gchar *uid)
+{
+	if (uid && !g_hash_table_contains (cbfile->priv->dirty_uids, uid))
+		g_hash_table_add (cbfile->priv->dirty_uids, g_strdup (uid));
+}
+
+static void
+free_calendar_components (GHashTable *comp_uid_hash,
+                          ICalComponent *top_icomp)
+{
+	if (comp_uid_hash)
+		g_hash_table_destroy (comp_uid_hash);
+
+	if (top_icomp)
+		g_object_unref (top_icomp);
+}
+
+static void
+free_calendar_data (ECalBackendDecsync *cbfile)
+{
+	ECalBackendDecsyncPrivate *priv;
+
+	priv = cbfile->priv;
+
+	g_rw_lock_writer_lock (&priv->lock);
+
+	g_clear_pointer (&priv->intervals, e_cal_backend_decsync_intervals_free);
+
+	g_mutex_lock (&priv->tz_lock);
+	free_calendar_components (priv->comp_uid_hash, priv->vcalendar);
+	priv->comp_uid_hash = NULL;
+	priv->vcalendar = NULL;
+	g_mutex_unlock (&priv->tz_lock);
+
+	e_cal_backend_decsync_registry_remove_all (priv->components);
+	e_cal_backend_decsync_query_index_remove_all (priv->query_index);
+	e_cal_backend_decsync_results_remove_all (priv->query_results);
+
+	g_mutex_lock (&priv->free_busy_lock);
+	g_clear_pointer (&priv->busy_periods, busy_periods_free);
+	g_mutex_unlock (&priv->free_busy_lock);
+
+	g_clear_pointer (&priv->stub_index, stub_index_free);
+	g_clear_pointer (&priv->stubs, g_hash_table_destroy);
+	g_clear_pointer (&priv->mapped_file, g_mapped_file_unref);
+
+	g_rw_lock_writer_unlock (&priv->lock);
+}
+
+/* Dispose handler for the decsync backend */
+static void
+e_cal_backend_decsync_dispose (GObject *object)
+{
+	ECalBackendDecsync *cbfile;
+	ECalBackendDecsyncPrivate *priv;
+	ESource *source;
+
+	cbfile = E_CAL_BACKEND_DECSYNC (object);
+	priv = cbfile->priv;
+
+	if (priv->dirty_idle_id) {
+		g_source_remove (priv->dirty_idle_id);
+		priv->dirty_idle_id = 0;
+	}
+
+	if (priv->compact_idle_id) {
+		g_source_remove (priv->compact_idle_id);
+		priv->compact_idle_id = 0;
+	}
+
+	/* Save if necessary */
+	if (priv->is_dirty)
+		save_file_when_idle (cbfile);
+
+	if (priv->refresh_timeout_id) {
+		g_source_remove (priv->refresh_timeout_id);
+		priv->refresh_timeout_id = 0;
+	}
+
+	g_clear_pointer (&priv->monitor, decsync_monitor_free);
+
+	/* a refresh still running gets its changes applied from an idle
+	 * callback, which holds a reference on the backend */
+	if (priv->refresher) {
+		g_thread_pool_free (priv->refresher, FALSE, TRUE);
+		priv->refresher = NULL;
+	}
+
+	/* wait for the writer thread to finish what was queued */
+	if (priv->writer) {
+		g_thread_pool_free (priv->writer, FALSE, TRUE);
+		priv->writer = NULL;
+	}
+
+	if (priv->matcher) {
+		g_thread_pool_free (priv->matcher, FALSE, TRUE);
+		priv->matcher = NULL;
+	}
+
+	/* a retry of a save which failed meanwhile */
+	if (priv->dirty_idle_id) {
+		g_source_remove (priv->dirty_idle_id);
+		priv->dirty_idle_id = 0;
+	}
+
+	free_calendar_data (cbfile);
+
+	source = e_backend_get_source (E_BACKEND (cbfile));
+	if (source)
+		g_signal_handlers_disconnect_matched (source, G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, cbfile);
+
+	/* Chain up to parent's dispose() method. */
+	G_OBJECT_CLASS (e_cal_backend_decsync_parent_class)->dispose (object);
+}
+
+/* Finalize handler for the decsync backend */
+static void
+e_cal_backend_decsync_finalize (GObject *object)
+{
+	ECalBackendDecsyncPrivate *priv;
+	gint ii;
+
+	priv = E_CAL_BACKEND_DECSYNC (object)->priv;
+
+	/* Clean up */
+
+	if (priv->dirty_idle_id)
+		g_source_remove (priv->dirty_idle_id);
+
+	g_rw_lock_clear (&priv->lock);
+	g_mutex_clear (&priv->tz_lock);
+	g_mutex_clear (&priv->free_busy_lock);
+	g_mutex_clear (&priv->digests_lock);
+	g_mutex_clear (&priv->refresh_lock);
+	g_cond_clear (&priv->refresh_cond);
+	g_hash_table_destroy (priv->digests);
+	g_clear_pointer (&priv->busy_periods, busy_periods_free);
+	for (ii = 0; ii < N_COMPONENT_LOCKS; ii++)
+		g_mutex_clear (&priv->component_locks[ii]);
+	g_hash_table_destroy (priv->cached_timezones);
+	g_hash_table_destroy (priv->dirty_uids);
+	g_key_file_unref (priv->manifest);
+	e_cal_backend_decsync_registry_free (priv->components);
+	e_cal_backend_decsync_query_index_free (priv->query_index);
+	e_cal_backend_decsync_results_free (priv->query_results);
+
+	g_free (priv->path);
+	g_free (priv->shards_path);
+	g_free (priv->file_name);
+
+	/* Chain up to parent's finalize() method. */
+	G_OBJECT_CLASS (e_cal_backend_decsync_parent_class)->finalize (object);
+}
+
+/* Looks up a component by its UID on the backend's component hash table
+ * and returns TRUE if any event (regardless whether it is the master or a child)
+ * with that UID exists */
+static gboolean
+uid_in_use (ECalBackendDecsync *cbfile,
+            const gchar *uid)
+{
+	return lookup_object (cbfile, uid) != NULL;
+}
+
+static ICalProperty *
+get_revision_property (ECalBackendDecsync *cbfile)
+{
+	if (!cbfile->priv->vcalendar)
+		return NULL;
+
+	return e_cal_util_component_find_x_property (cbfile->priv->vcalendar, ECAL_REVISION_X_PROP);
+}
+
+static gchar *
+make_revision_string (ECalBackendDecsync *cbfile)
+{
+	GTimeVal timeval;
+	gchar   *datestr;
+	gchar   *revision;
+
+	g_get_current_time (&timeval);
+
+	datestr = g_time_val_to_iso8601 (&timeval);
+	revision = g_strdup_printf ("%s(%d)", datestr, cbfile->priv->revision_counter++);
+
+	g_free (datestr);
+	return revision;
+}
+
+static ICalProperty *
+ensure_revision (ECalBackendDecsync *cbfile)
+{
+	ICalProperty *prop;
+
+	if (cbfile->priv->vcalendar == NULL)
+		return NULL;
 
 	prop = get_revision_property (cbfile);
 
-	if (!prop) {
-		gchar *revision = make_revision_string (cbfile);
+	if (!prop) {
+		gchar *revision = make_revision_string (cbfile);
+
+		e_cal_util_component_set_x_property (cbfile->priv->vcalendar, ECAL_REVISION_X_PROP, revision);
+
+		g_free (revision);
+
+		prop = get_revision_property (cbfile);
+		g_warn_if_fail (prop != NULL);
+	}
+
+	return prop;
+}
+
+/* Returns the revision, or NULL if backend lacks a vcalendar; called
+ * with the lock held for reading.  The revision is set on load, thus
+ * this only looks it up. */
+static gchar *
+dup_revision (ECalBackendDecsync *cbfile)
+{
+	ICalProperty *prop;
+	gchar *revision = NULL;
+	GMutex *mutex;
+
+	mutex = component_lock (cbfile, cbfile->priv->vcalendar);
+	g_mutex_lock (mutex);
+	prop = ensure_revision (cbfile);
+	if (prop) {
+		revision = g_strdup (i_cal_property_get_x (prop));
+		g_object_unref (prop);
+	}
+	g_mutex_unlock (mutex);
+
+	return revision;
+}
+
+static void
+bump_revision (ECalBackendDecsync *cbfile)
+{
+	/* Update the revision string */
+	ICalProperty *prop = ensure_revision (cbfile);
+	gchar *revision = make_revision_string (cbfile);
+
+	i_cal_property_set_x (prop, revision);
+
+	/* what matched before is of no use anymore */
+	e_cal_backend_decsync_results_remove_all (cbfile->priv->query_results);
+
+	e_cal_backend_notify_property_changed (E_CAL_BACKEND (cbfile),
+					      E_CAL_BACKEND_PROPERTY_REVISION,
+					      revision);
+
+	g_object_unref (prop);
+	g_free (revision);
+}
+
+/* Calendar backend methods */
+
+/* Get_email_address handler for the decsync backend */
+static gchar *
+e_cal_backend_decsync_get_backend_property (ECalBackend *backend,
+                                         const gchar *prop_name)
+{
+	g_return_val_if_fail (prop_name != NULL, FALSE);
+
+	if (g_str_equal (prop_name, CLIENT_BACKEND_PROPERTY_CAPABILITIES)) {
+		return g_strjoin (
+			",",
+			E_CAL_STATIC_CAPABILITY_NO_EMAIL_ALARMS,
+			E_CAL_STATIC_CAPABILITY_NO_THISANDPRIOR,
+			E_CAL_STATIC_CAPABILITY_DELEGATE_SUPPORTED,
+			E_CAL_STATIC_CAPABILITY_REMOVE_ONLY_THIS,
+			E_CAL_STATIC_CAPABILITY_BULK_ADDS,
+			E_CAL_STATIC_CAPABILITY_BULK_MODIFIES,
+			E_CAL_STATIC_CAPABILITY_BULK_REMOVES,
+			E_CAL_STATIC_CAPABILITY_ALARM_DESCRIPTION,
+			E_CAL_STATIC_CAPABILITY_TASK_CAN_RECUR,
+			E_CAL_STATIC_CAPABILITY_COMPONENT_COLOR,
+			E_CAL_STATIC_CAPABILITY_REFRESH_SUPPORTED,
+			NULL);
+
+	} else if (g_str_equal (prop_name, E_CAL_BACKEND_PROPERTY_CAL_EMAIL_ADDRESS) ||
+		   g_str_equal (prop_name, E_CAL_BACKEND_PROPERTY_ALARM_EMAIL_ADDRESS)) {
+		ESourceLocal *local_extension;
+
+		local_extension = e_source_get_extension (e_backend_get_source (E_BACKEND (backend)), E_SOURCE_EXTENSION_LOCAL_BACKEND);
+
+		return e_source_local_dup_email_address (local_extension);
+
+	} else if (g_str_equal (prop_name, E_CAL_BACKEND_PROPERTY_DEFAULT_OBJECT)) {
+		ECalComponent *comp;
+		gchar *prop_value;
+
+		comp = e_cal_component_new ();
+
+		switch (e_cal_backend_get_kind (E_CAL_BACKEND (backend))) {
+		case I_CAL_VEVENT_COMPONENT:
+			e_cal_component_set_new_vtype (comp, E_CAL_COMPONENT_EVENT);
+			break;
+		case I_CAL_VTODO_COMPONENT:
+			e_cal_component_set_new_vtype (comp, E_CAL_COMPONENT_TODO);
+			break;
+		case I_CAL_VJOURNAL_COMPONENT:
+			e_cal_component_set_new_vtype (comp, E_CAL_COMPONENT_JOURNAL);
+			break;
+		default:
+			g_object_unref (comp);
+			return NULL;
+		}
+
+		prop_value = e_cal_component_get_as_string (comp);
+
+		g_object_unref (comp);
+
+		return prop_value;
+
+	} else if (g_str_equal (prop_name, E_CAL_BACKEND_PROPERTY_REVISION)) {
+		gchar *revision;
+
+		ECalBackendDecsync *cbfile = E_CAL_BACKEND_DECSYNC (backend);
+
+		g_rw_lock_reader_lock (&cbfile->priv->lock);
+		revision = dup_revision (cbfile);
+		g_rw_lock_reader_unlock (&cbfile->priv->lock);
+
+		return revision;
+	}
+
+	/* Chain up to parent's method. */
+	return E_CAL_BACKEND_CLASS (e_cal_backend_decsync_parent_class)->
+		impl_get_backend_property (backend, prop_name);
+}
+
+typedef struct _ResolveTzidData {
+	ICalComponent *vcalendar;
+	GHashTable *zones; /* gchar *tzid -> ICalTimezone * */
+} ResolveTzidData;
+
+static void
+resolve_tzid_data_init (ResolveTzidData *rtd,
+                        ICalComponent *vcalendar)
+{
+	if (rtd) {
+		rtd->vcalendar = vcalendar;
+		rtd->zones = NULL;
+	}
+}
+
+/* Clears the content, not the structure */
+static void
+resolve_tzid_data_clear (ResolveTzidData *rtd)
+{
+	if (rtd && rtd->zones)
+		g_hash_table_destroy (rtd->zones);
+}
+
+/* Resolves time zones the way the query evaluator does */
+static ICalTimezone *
+resolve_query_tzid_cb (const gchar *tzid,
+                       gpointer user_data,
+                       GCancellable *cancellable,
+                       GError **error)
+{
+	if (!tzid || !tzid[0])
+		return NULL;
+	else if (!strcmp (tzid, "UTC"))
+		return i_cal_timezone_get_utc_timezone ();
+
+	return e_timezone_cache_get_timezone (E_TIMEZONE_CACHE (user_data), tzid);
+}
+
+/* function to resolve timezones */
+static ICalTimezone *
+resolve_tzid_cb (const gchar *tzid,
+                 gpointer user_data,
+                 GCancellable *cancellable,
+                 GError **error)
+{
+	ResolveTzidData *rtd = user_data;
+	ICalTimezone *zone;
+
+	if (!tzid || !tzid[0])
+		return NULL;
+	else if (!strcmp (tzid, "UTC"))
+		return i_cal_timezone_get_utc_timezone ();
+
+	if (rtd->zones) {
+		zone = g_hash_table_lookup (rtd->zones, tzid);
+		if (zone)
+			return zone;
+	}
+
+	zone = i_cal_timezone_get_builtin_timezone_from_tzid (tzid);
+	if (zone)
+		g_object_ref (zone);
+	else if (rtd->vcalendar)
+		zone = i_cal_component_get_timezone (rtd->vcalendar, tzid);
+
+	if (zone) {
+		if (!rtd->zones)
+			rtd->zones = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+
+		g_hash_table_insert (rtd->zones, g_strdup (tzid), zone);
+	}
+
+	return zone;
+}
+
+/* Checks if the specified component has a duplicated UID and if so changes it.
+ * UIDs may be shared between components if there is at most one component
+ * without RECURRENCE-ID (master) and all others have different RECURRENCE-ID
+ * values.
+ */
+static void
+check_dup_uid (ECalBackendDecsync *cbfile,
+               ECalComponent *comp)
+{
+	ECalBackendDecsyncPrivate *priv;
+	ECalBackendDecsyncObject *obj_data;
+	const gchar *uid;
+	gchar *new_uid = NULL;
+	gchar *rid = NULL;
+
+	priv = cbfile->priv;
+
+	uid = e_cal_component_get_uid (comp);
+
+	if (!uid) {
+		g_warning ("Checking for duplicate uid, the component does not have a valid UID skipping it\n");
+		return;
+	}
+
+	obj_data = g_hash_table_lookup (priv->comp_uid_hash, uid);
+	if (!obj_data)
+		return; /* Everything is fine */
+
+	rid = e_cal_component_get_recurid_as_string (comp);
+	if (rid && *rid) {
+		/* new component has rid, must not be the same as in other detached recurrence */
+		if (!g_hash_table_lookup (obj_data->recurrences, rid))
+			goto done;
+	} else {
+		/* new component has no rid, must not clash with existing master */
+		if (!obj_data->full_object)
+			goto done;
+	}
+
+	d (
+		g_message (G_STRLOC ": Got object with duplicated UID `%s' and rid `%s', changing it...",
+		uid,
+		rid ? rid : ""));
+
+	new_uid = e_util_generate_uid ();
+	e_cal_component_set_uid (comp, new_uid);
+
+	/* FIXME: I think we need to reset the SEQUENCE property and reset the
+	 * CREATED/DTSTAMP/LAST-MODIFIED.
+	 */
+
+	/* the calendar file holds both objects under the old UID, which
+	 * the shards cannot describe */
+	priv->needs_snapshot = TRUE;
+	save (cbfile, FALSE);
+
+ done:
+	g_free (rid);
+	g_free (new_uid);
+}
+
+static time_t
+get_rid_as_time_t (ECalComponent *comp)
+{
+	ECalComponentRange *range;
+	ECalComponentDateTime *dt;
+	time_t tmt = (time_t) -1;
+
+	range = e_cal_component_get_recurid (comp);
+	if (!range)
+		return tmt;
+
+	dt = e_cal_component_range_get_datetime (range);
+	if (!dt) {
+		e_cal_component_range_free (range);
+		return tmt;
+	}
+
+	tmt = i_cal_time_as_timet (e_cal_component_datetime_get_value (dt));
+
+	e_cal_component_range_free (range);
+
+	return tmt;
+}
+
+static void
+free_occur_times (gpointer data)
+{
+	g_slice_free (OccurTimes, data);
+}
+
+/* Computes the bounds of the occurrences of @comp; FALSE for a bogus
+ * component, which ends before it starts.  It only reads the VCALENDAR,
+ * thus it can run on several threads at once while no one changes it. */
+static gboolean
+get_occur_times (ECalBackendDecsync *cbfile,
+                 ECalComponent *comp,
+                 time_t *out_start,
+                 time_t *out_end)
+{
+	time_t time_start = -1, time_end = -1;
+	ResolveTzidData rtd;
+
+	resolve_tzid_data_init (&rtd, cbfile->priv->vcalendar);
+
+	e_cal_util_get_component_occur_times (
+		comp, &time_start, &time_end,
+		resolve_tzid_cb, &rtd, i_cal_timezone_get_utc_timezone (),
+		e_cal_backend_get_kind (E_CAL_BACKEND (cbfile)));
+
+	resolve_tzid_data_clear (&rtd);
+
+	if (time_end != -1 && time_start > time_end) {
+		gchar *str = e_cal_component_get_as_string (comp);
+		g_print ("Bogus component %s\n", str);
+		g_free (str);
+
+		return FALSE;
+	}
+
+	*out_start = time_start;
+	*out_end = time_end;
+
+	return TRUE;
+}
+
+static void
+insert_into_intervaltree (ECalBackendDecsync *cbfile,
+                          ECalComponent *comp,
+                          time_t time_start,
+                          time_t time_end)
+{
+	OccurTimes *times;
+
+	times = g_slice_new (OccurTimes);
+	times->start = time_start == -1 ? G_MININT64 : time_start;
+	times->end = time_end == -1 ? G_MAXINT64 : time_end;
+	times->recurs = e_cal_component_has_recurrences (comp);
+	g_object_set_qdata_full (G_OBJECT (comp), occur_times_quark (), times, free_occur_times);
+
+	e_cal_backend_decsync_intervals_insert (cbfile->priv->intervals, times->start, times->end, comp);
+}
+
+/* Adds component to the interval tree
+ */
+static void
+add_component_to_intervaltree (ECalBackendDecsync *cbfile,
+                               ECalComponent *comp)
+{
+	time_t time_start, time_end;
+
+	g_return_if_fail (cbfile != NULL);
+	g_return_if_fail (comp != NULL);
+
+	if (get_occur_times (cbfile, comp, &time_start, &time_end))
+		insert_into_intervaltree (cbfile, comp, time_start, time_end);
+}
+
+static gboolean
+remove_component_from_intervaltree (ECalBackendDecsync *cbfile,
+                                    ECalComponent *comp)
+{
+	const gchar *uid;
+	gchar *rid;
+	gboolean res;
+	ECalBackendDecsyncPrivate *priv;
+
+	g_return_val_if_fail (cbfile != NULL, FALSE);
+	g_return_val_if_fail (comp != NULL, FALSE);
+
+	priv = cbfile->priv;
+
+	uid = e_cal_component_get_uid (comp);
+	rid = e_cal_component_get_recurid_as_string (comp);
+
+	res = e_cal_backend_decsync_intervals_remove (priv->intervals, uid, rid);
+
+	g_free (rid);
+
+	return res;
+}
+
+/* Whether the recurring @comp may occur between @start and @end, as its
+ * summary of occurrences tells; the summary is made on the first call */
+static gboolean
+component_may_occur (ECalBackendDecsync *cbfile,
+                     ECalComponent *comp,
+                     gint64 start,
+                     gint64 end)
+{
+	ECalBackendDecsyncOccurrences *occurrences;
+	GMutex *lock;
+	gboolean may_occur;
+
+	lock = component_lock (cbfile, e_cal_component_get_icalcomponent (comp));
+	g_mutex_lock (lock);
+
+	occurrences = g_object_get_qdata (G_OBJECT (comp), occurrences_quark ());
+	if (!occurrences) {
+		occurrences = e_cal_backend_decsync_occurrences_new (
+			e_cal_component_get_icalcomponent (comp), time (NULL),
+			resolve_query_tzid_cb, cbfile);
+		g_object_set_qdata_full (G_OBJECT (comp), occurrences_quark (), occurrences,
+			(GDestroyNotify) e_cal_backend_decsync_occurrences_free);
+	}
+
+	may_occur = e_cal_backend_decsync_occurrences_may_occur (occurrences, start, end);
+
+	g_mutex_unlock (lock);
+
+	return may_occur;
+}
+
+/* Returns the components which may occur between @start and @end, -1 for
+ * no bound; they are valid while the lock is held.  The span of an
+ * open-ended recurrence overlaps every range after its start, such
+ * components are left out when their summary tells they do not occur. */
+static GPtrArray *
+search_intervaltree (ECalBackendDecsync *cbfile,
+                     time_t start,
+                     time_t end)
+{
+	GPtrArray *hits;
+	gint64 range_start, range_end;
+	guint ii, jj;
+
+	hits = g_ptr_array_sized_new (64);
+
+	range_start = start == -1 ? G_MININT64 : start;
+	range_end = end == -1 ? G_MAXINT64 : end;
+
+	e_cal_backend_decsync_intervals_search (cbfile->priv->intervals, range_start, range_end, hits);
+
+	if (range_start == G_MININT64 || range_end == G_MAXINT64)
+		return hits;
+
+	for (ii = 0, jj = 0; ii < hits->len; ii++) {
+		ECalComponent *comp = g_ptr_array_index (hits, ii);
+		OccurTimes *times;
+
+		times = g_object_get_qdata (G_OBJECT (comp), occur_times_quark ());
+		if (times && times->recurs &&
+		    !component_may_occur (cbfile, comp, range_start, range_end))
+			continue;
+
+		hits->pdata[jj++] = comp;
+	}
+
+	g_ptr_array_set_size (hits, jj);
+
+	return hits;
+}
+
+static void
+add_recurrence_to_registry (ECalBackendDecsyncObject *obj_data,
+                            ECalComponent *comp)
+{
+	if (!obj_data->recurrence_registry)
+		obj_data->recurrence_registry = e_cal_backend_decsync_registry_new ();
+
+	e_cal_backend_decsync_registry_append (obj_data->recurrence_registry, comp);
+}
+
+/* Drops what was kept for @comp and for the object it belongs to, its
+ * strings and expanded instances, as it is being changed */
+static void
+forget_cached_data (ECalBackendDecsync *cbfile,
+                    ECalComponent *comp)
+{
+	ECalBackendDecsyncObject *obj_data = NULL;
+	const gchar *uid;
+
+	g_object_set_qdata (G_OBJECT (comp), ical_string_quark (), NULL);
+	g_object_set_qdata (G_OBJECT (comp), instances_quark (), NULL);
+	g_object_set_qdata (G_OBJECT (comp), occurrences_quark (), NULL);
+
+	uid = e_cal_component_get_uid (comp);
+	if (uid && cbfile->priv->comp_uid_hash)
+		obj_data = g_hash_table_lookup (cbfile->priv->comp_uid_hash, uid);
+	if (obj_data)
+		g_clear_pointer (&obj_data->ical_string, g_free);
+}
+
+/* Whether a property of @icomp has @tzid as its TZID parameter */
+static gboolean
+component_uses_tzid (ICalComponent *icomp,
+                     const gchar *tzid)
+{
+	ICalProperty *prop;
+	gboolean uses = FALSE;
+
+	for (prop = i_cal_component_get_first_property (icomp, I_CAL_ANY_PROPERTY);
+	     prop && !uses;
+	     g_object_unref (prop), prop = i_cal_component_get_next_property (icomp, I_CAL_ANY_PROPERTY)) {
+		ICalParameter *param;
+
+		param = i_cal_property_get_first_parameter (prop, I_CAL_TZID_PARAMETER);
+		uses = param && g_strcmp0 (i_cal_parameter_get_tzid (param), tzid) == 0;
+		g_clear_object (&param);
+	}
+	g_clear_object (&prop);
+
+	return uses;
+}
+
+/* Drops the expanded instances and summaries of occurrences of the
+ * components which use the time zone @tzid, as they were made before
+ * the VCALENDAR had it; called with the lock held for writing, after
+ * the time zone was added */
+static void
+forget_instances_in_zone (ECalBackendDecsync *cbfile,
+                          const gchar *tzid)
+{
+	GList *link;
+
+	if (!tzid)
+		return;
+
+	for (link = e_cal_backend_decsync_registry_peek_head (cbfile->priv->components); link; link = link->next) {
+		GObject *comp = link->data;
+
+		if ((g_object_get_qdata (comp, instances_quark ()) ||
+		     g_object_get_qdata (comp, occurrences_quark ())) &&
+		    component_uses_tzid (e_cal_component_get_icalcomponent (link->data), tzid)) {
+			g_object_set_qdata (comp, instances_quark (), NULL);
+			g_object_set_qdata (comp, occurrences_quark (), NULL);
+		}
+	}
+}
+
+/* Adds @comp to the components of the calendar, before or after all
+ * others, and indexes it for queries; a component which was changed in
+ * place is added again */
+static void
+register_component (ECalBackendDecsync *cbfile,
+                    ECalComponent *comp,
+                    gboolean prepend)
+{
+	ECalBackendDecsyncPrivate *priv = cbfile->priv;
+
+	forget_cached_data (cbfile, comp);
+
+	if (prepend)
+		e_cal_backend_decsync_registry_prepend (priv->components, comp);
+	else
+		e_cal_backend_decsync_registry_append (priv->components, comp);
+
+	e_cal_backend_decsync_query_index_add (priv->query_index, comp);
+}
+
+static gboolean
+unregister_component (ECalBackendDecsync *cbfile,
+                      ECalComponent *comp)
+{
+	ECalBackendDecsyncPrivate *priv = cbfile->priv;
+
+	forget_cached_data (cbfile, comp);
+	e_cal_backend_decsync_query_index_remove (priv->query_index, comp);
+
+	return e_cal_backend_decsync_registry_remove (priv->components, comp);
+}
+
+/* An object parsed by parse_objects(), with the bounds of its occurrences */
+typedef struct {
+	ECalComponent *comp;
+	gboolean has_times;
+	time_t start;
+	time_t end;
+} ParsedObject;
+
+/* Tries to add an ICalComponent to the decsync backend.  We only store the objects
+ * of the types we support; all others just remain in the toplevel component so
+ * that we don't lose them.
+ *
+ * The caller is responsible for ensuring that the component has a UID and that
+ * the UID is not in use already.  The occur times are taken from @parsed,
+ * when given, instead of computing them here.
+ */
+static void
+add_component_full (ECalBackendDecsync *cbfile,
+                    ECalComponent *comp,
+                    gboolean add_to_toplevel,
+                    const ParsedObject *parsed)
+{
+	ECalBackendDecsyncPrivate *priv;
+	ECalBackendDecsyncObject *obj_data;
+	const gchar *uid;
+
+	priv = cbfile->priv;
+
+	uid = e_cal_component_get_uid (comp);
+
+	if (!uid) {
+		g_warning ("The component does not have a valid UID skipping it\n");
+		return;
+	}
+
+	mark_uid_dirty (cbfile, uid);
+
+	obj_data = g_hash_table_lookup (priv->comp_uid_hash, uid);
+	if (e_cal_component_is_instance (comp)) {
+		gchar *rid;
+
+		rid = e_cal_component_get_recurid_as_string (comp);
+		if (obj_data) {
+			if (g_hash_table_lookup (obj_data->recurrences, rid)) {
+				g_warning (G_STRLOC ": Tried to add an already existing recurrence");
+				g_free (rid);
+				return;
+			}
+		} else {
+			obj_data = g_new0 (ECalBackendDecsyncObject, 1);
+			obj_data->full_object = NULL;
+			obj_data->recurrences = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+			g_hash_table_insert (priv->comp_uid_hash, g_strdup (uid), obj_data);
+		}
+
+		g_hash_table_insert (obj_data->recurrences, rid, comp);
+		add_recurrence_to_registry (obj_data, comp);
+	} else {
+		if (obj_data) {
+			if (obj_data->full_object) {
+				g_warning (G_STRLOC ": Tried to add an already existing object");
+				return;
+			}
+
+			obj_data->full_object = comp;
+		} else {
+			obj_data = g_new0 (ECalBackendDecsyncObject, 1);
+			obj_data->full_object = comp;
+			obj_data->recurrences = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+
+			g_hash_table_insert (priv->comp_uid_hash, g_strdup (uid), obj_data);
+		}
+	}
+
+	if (!parsed)
+		add_component_to_intervaltree (cbfile, comp);
+	else if (parsed->has_times)
+		insert_into_intervaltree (cbfile, comp, parsed->start, parsed->end);
+
+	register_component (cbfile, comp, TRUE);
+
+	/* Put the object in the toplevel component if required */
+
+	if (add_to_toplevel) {
+		ICalComponent *icomp;
+
+		icomp = e_cal_component_get_icalcomponent (comp);
+		g_return_if_fail (icomp != NULL);
+
+		i_cal_component_add_component (priv->vcalendar, icomp);
+	}
+}
+
+static void
+add_component (ECalBackendDecsync *cbfile,
+               ECalComponent *comp,
+               gboolean add_to_toplevel)
+{
+	add_component_full (cbfile, comp, add_to_toplevel, NULL);
+}
+
+/* g_hash_table_foreach_remove() callback to remove recurrences from the calendar */
+static gboolean
+remove_recurrence_cb (gpointer key,
+                      gpointer value,
+                      gpointer data)
+{
+	ICalComponent *icomp;
+	ECalBackendDecsyncPrivate *priv;
+	ECalComponent *comp = value;
+	ECalBackendDecsync *cbfile = data;
+
+	priv = cbfile->priv;
+
+	/* remove the recurrence from the top-level calendar */
+	icomp = e_cal_component_get_icalcomponent (comp);
+	g_return_val_if_fail (icomp != NULL, FALSE);
+
+	icomp = g_object_ref (icomp);
+
+	if (!remove_component_from_intervaltree (cbfile, comp)) {
+		g_message (G_STRLOC " Could not remove component from interval tree!");
+	}
+	i_cal_component_remove_component (priv->vcalendar, icomp);
+
+	g_object_unref (icomp);
+
+	/* remove it from our mapping */
+	unregister_component (cbfile, comp);
+
+	return TRUE;
+}
+
+/* Removes a component from the backend's hash and lists.  Does not perform
+ * notification on the clients.  Also removes the component from the toplevel
+ * ICalComponent.  The caller is responsible for saving the calendar.
+ */
+static void
+remove_component (ECalBackendDecsync *cbfile,
+                  const gchar *uid,
+                  ECalBackendDecsyncObject *obj_data)
+{
+	ECalBackendDecsyncPrivate *priv;
+	ICalComponent *icomp;
+
+	priv = cbfile->priv;
+
+	mark_uid_dirty (cbfile, uid);
+
+	/* Remove the ICalComponent from the toplevel */
+	if (obj_data->full_object) {
+		icomp = e_cal_component_get_icalcomponent (obj_data->full_object);
+		g_return_if_fail (icomp != NULL);
+
+		i_cal_component_remove_component (priv->vcalendar, icomp);
+
+		/* Remove it from our mapping */
+		if (!unregister_component (cbfile, obj_data->full_object))
+			g_return_if_reached ();
+
+		if (!remove_component_from_intervaltree (cbfile, obj_data->full_object)) {
+			g_message (G_STRLOC " Could not remove component from interval tree!");
+		}
+	}
+
+	/* remove the recurrences also */
+	g_hash_table_foreach_remove (obj_data->recurrences, (GHRFunc) remove_recurrence_cb, cbfile);
+
+	g_hash_table_remove (priv->comp_uid_hash, uid);
+}
+
+/* Objects parsed by a worker of parse_objects() at a time */
+#define PARSE_CHUNK_SIZE 256
+
+typedef struct {
+	ECalBackendDecsync *cbfile;
+	const gchar *data;
+	GPtrArray *stubs;
+	ParsedObject *parsed;
+	guint from;
+	guint to;
+} ParseChunk;
+
+static void
+parse_chunk_thread (gpointer data,
+                    gpointer user_data)
+{
+	ParseChunk *chunk = data;
+	guint ii;
+
+	for (ii = chunk->from; ii < chunk->to; ii++) {
+		ECalBackendDecsyncStub *stub = g_ptr_array_index (chunk->stubs, ii);
+		ParsedObject *parsed = &chunk->parsed[ii];
+		ICalComponent *icomp;
+		gchar *str;
+
+		str = g_strndup (chunk->data + stub->offset, stub->length);
+		icomp = i_cal_parser_parse_string (str);
+		g_free (str);
+
+		parsed->comp = icomp ? e_cal_component_new_from_icalcomponent (icomp) : NULL;
+		if (parsed->comp)
+			parsed->has_times = get_occur_times (chunk->cbfile, parsed->comp, &parsed->start, &parsed->end);
+	}
+}
+
+/* Parses the objects @stubs point to in @data and computes their occur
+ * times, in chunks, on all processors.  Returns an array in the order of
+ * @stubs; an object which cannot be parsed has no component.  Called with
+ * the lock held for writing, the workers only read the VCALENDAR. */
+static ParsedObject *
+parse_objects (ECalBackendDecsync *cbfile,
+               const gchar *data,
+               GPtrArray *stubs)
+{
+	ParsedObject *parsed;
+	ParseChunk *chunks;
+	GThreadPool *pool = NULL;
+	guint n_chunks, ii;
+
+	parsed = g_new0 (ParsedObject, stubs->len);
+	n_chunks = (stubs->len + PARSE_CHUNK_SIZE - 1) / PARSE_CHUNK_SIZE;
+	chunks = g_new0 (ParseChunk, n_chunks);
+
+	if (n_chunks > 1)
+		pool = g_thread_pool_new (parse_chunk_thread, NULL, g_get_num_processors (), FALSE, NULL);
+
+	for (ii = 0; ii < n_chunks; ii++) {
+		chunks[ii].cbfile = cbfile;
+		chunks[ii].data = data;
+		chunks[ii].stubs = stubs;
+		chunks[ii].parsed = parsed;
+		chunks[ii].from = ii * PARSE_CHUNK_SIZE;
+		chunks[ii].to = MIN (chunks[ii].from + PARSE_CHUNK_SIZE, stubs->len);
+
+		if (pool)
+			g_thread_pool_push (pool, &chunks[ii], NULL);
+		else
+			parse_chunk_thread (&chunks[ii], NULL);
+	}
+
+	if (pool)
+		g_thread_pool_free (pool, FALSE, TRUE);
+
+	g_free (chunks);
+
+	return parsed;
+}
+
+static gint
+compare_stub_offsets (gconstpointer a,
+                      gconstpointer b)
+{
+	const ECalBackendDecsyncStub *stub_a = *((ECalBackendDecsyncStub **) a);
+	const ECalBackendDecsyncStub *stub_b = *((ECalBackendDecsyncStub **) b);
+
+	if (stub_a->offset == stub_b->offset)
+		return 0;
+
+	return stub_a->offset < stub_b->offset ? -1 : 1;
+}
+
+/* Drops the stubs of @uid, as its objects are parsed or superseded */
+static void
+forget_stubs (ECalBackendDecsync *cbfile,
+              const gchar *uid)
+{
+	ECalBackendDecsyncPrivate *priv = cbfile->priv;
+	GPtrArray *uid_stubs;
+	guint ii;
+
+	uid_stubs = priv->stubs ? g_hash_table_lookup (priv->stubs, uid) : NULL;
+	if (!uid_stubs)
+		return;
+
+	for (ii = 0; priv->stub_index && ii < uid_stubs->len; ii++)
+		stub_index_remove (priv->stub_index, g_ptr_array_index (uid_stubs, ii));
+
+	g_hash_table_remove (priv->stubs, uid);
+}
+
+/* Parses the objects with @uids which were not needed so far, in the
+ * order of the calendar file */
+static void
+materialize_uids (ECalBackendDecsync *cbfile,
+                  GPtrArray *uids)
+{
+	ECalBackendDecsyncPrivate *priv;
+	GPtrArray *uid_stubs, *stubs, *clean_uids;
+	ParsedObject *parsed;
+	guint ii, jj;
+
+	priv = cbfile->priv;
+
+	if (!priv->stubs)
+		return;
+
+	uid_stubs = g_ptr_array_new_with_free_func ((GDestroyNotify) g_ptr_array_unref);
+	stubs = g_ptr_array_new ();
+	clean_uids = g_ptr_array_new_with_free_func (g_free);
+
+	for (ii = 0; ii < uids->len; ii++) {
+		const gchar *uid = g_ptr_array_index (uids, ii);
+		GPtrArray *array;
+
+		array = uid ? g_hash_table_lookup (priv->stubs, uid) : NULL;
+		if (!array)
+			continue;
+
+		for (jj = 0; jj < array->len; jj++)
+			g_ptr_array_add (stubs, g_ptr_array_index (array, jj));
+
+		if (!g_hash_table_contains (priv->dirty_uids, uid))
+			g_ptr_array_add (clean_uids, g_strdup (uid));
+
+		/* removed first, thus adding the objects does not get here again */
+		g_ptr_array_add (uid_stubs, g_ptr_array_ref (array));
+		forget_stubs (cbfile, uid);
+	}
+
+	g_ptr_array_sort (stubs, compare_stub_offsets);
+
+	parsed = parse_objects (cbfile, g_mapped_file_get_contents (priv->mapped_file), stubs);
+
+	/* sorted into the time index at once */
+	e_cal_backend_decsync_intervals_freeze (priv->intervals);
+
+	for (ii = 0; ii < stubs->len; ii++) {
+		ECalBackendDecsyncStub *stub = g_ptr_array_index (stubs, ii);
+
+		if (parsed[ii].comp)
+			add_component_full (cbfile, parsed[ii].comp, TRUE, &parsed[ii]);
+		else
+			g_warning (G_STRLOC ": Cannot parse object '%s' of '%s'", stub->uid, priv->path);
+	}
+
+	e_cal_backend_decsync_intervals_thaw (priv->intervals);
+
+	/* just loaded, not changed */
+	for (ii = 0; ii < clean_uids->len; ii++)
+		g_hash_table_remove (priv->dirty_uids, g_ptr_array_index (clean_uids, ii));
+
+	g_free (parsed);
+	g_ptr_array_unref (clean_uids);
+	g_ptr_array_unref (stubs);
+	g_ptr_array_unref (uid_stubs);
+
+	if (!g_hash_table_size (priv->stubs)) {
+		g_clear_pointer (&priv->stub_index, stub_index_free);
+		g_clear_pointer (&priv->mapped_file, g_mapped_file_unref);
+	}
+}
+
+/* Parses the objects with @uid which were not needed so far */
+static void
+materialize_uid (ECalBackendDecsync *cbfile,
+                 const gchar *uid)
+{
+	GPtrArray *uids;
+
+	if (!cbfile->priv->stubs || !uid)
+		return;
+
+	uids = g_ptr_array_new ();
+	g_ptr_array_add (uids, (gpointer) uid);
+
+	materialize_uids (cbfile, uids);
+
+	g_ptr_array_unref (uids);
+}
+
+/* Parses the objects not parsed so far which may occur between @start
+ * and @end; -1 for @end means no upper bound */
+static void
+materialize_time_range (ECalBackendDecsync *cbfile,
+                        time_t start,
+                        time_t end)
+{
+	ECalBackendDecsyncPrivate *priv;
+	GPtrArray *stubs, *uids;
+	guint ii;
+
+	priv = cbfile->priv;
+
+	if (!priv->stub_index)
+		return;
+
+	stubs = g_ptr_array_new ();
+	stub_index_collect (priv->stub_index, start, end == -1 ? G_MAXINT64 : end, stubs);
+
+	/* a UID with several stubs is there again, materialize_uids() skips it */
+	uids = g_ptr_array_new_full (stubs->len, g_free);
+	for (ii = 0; ii < stubs->len; ii++)
+		g_ptr_array_add (uids, g_strdup (((ECalBackendDecsyncStub *) g_ptr_array_index (stubs, ii))->uid));
+
+	materialize_uids (cbfile, uids);
+
+	g_ptr_array_unref (uids);
+	g_ptr_array_unref (stubs);
+}
+
+static void
+materialize_all (ECalBackendDecsync *cbfile)
+{
+	ECalBackendDecsyncPrivate *priv;
+	GHashTableIter iter;
+	gpointer key;
+	GPtrArray *uids;
+
+	priv = cbfile->priv;
+
+	if (!priv->stubs || !g_hash_table_size (priv->stubs))
+		return;
+
+	uids = g_ptr_array_new_with_free_func (g_free);
+
+	g_hash_table_iter_init (&iter, priv->stubs);
+	while (g_hash_table_iter_next (&iter, &key, NULL))
+		g_ptr_array_add (uids, g_strdup (key));
+
+	materialize_uids (cbfile, uids);
+
+	g_ptr_array_unref (uids);
+}
+
+/* Returns the ECalBackendDecsyncObject for @uid, parsing it first when
+ * it has not been used yet */
+static ECalBackendDecsyncObject *
+lookup_object (ECalBackendDecsync *cbfile,
+               const gchar *uid)
+{
+	materialize_uid (cbfile, uid);
+
+	return g_hash_table_lookup (cbfile->priv->comp_uid_hash, uid);
+}
+
+/* Whether objects of @uid, or with no @uid, those which may occur between
+ * @start and @end, were not parsed yet */
+static gboolean
+needs_materialize (ECalBackendDecsync *cbfile,
+                   const gchar *uid,
+                   gint64 start,
+                   gint64 end)
+{
+	ECalBackendDecsyncPrivate *priv;
+
+	priv = cbfile->priv;
+
+	if (!priv->stubs || !g_hash_table_size (priv->stubs))
+		return FALSE;
+
+	if (uid)
+		return g_hash_table_contains (priv->stubs, uid);
+
+	return priv->stub_index && stub_index_collect (priv->stub_index, start, end, NULL);
+}
+
+/* Takes the lock for reading, once the objects a reader is going to look
+ * at are parsed; parsing them changes the calendar data, thus is done
+ * with the lock held for writing first */
+static void
+read_lock_materialized (ECalBackendDecsync *cbfile,
+                        const gchar *uid,
+                        gint64 start,
+                        gint64 end)
+{
+	ECalBackendDecsyncPrivate *priv;
+
+	priv = cbfile->priv;
+
+	for (;;) {
+		g_rw_lock_reader_lock (&priv->lock);
+
+		if (!needs_materialize (cbfile, uid, start, end))
+			break;
+
+		g_rw_lock_reader_unlock (&priv->lock);
+
+		g_rw_lock_writer_lock (&priv->lock);
+		if (uid)
+			materialize_uid (cbfile, uid);
+		else if (start == G_MININT64 && end == G_MAXINT64)
+			materialize_all (cbfile);
+		else
+			materialize_time_range (cbfile, start, end == G_MAXINT64 ? -1 : end);
+		g_rw_lock_writer_unlock (&priv->lock);
+	}
+}
+
+/* Takes the lock for reading, with all objects of @uid parsed */
+static void
+read_lock_uid (ECalBackendDecsync *cbfile,
+               const gchar *uid)
+{
+	read_lock_materialized (cbfile, uid, G_MININT64, G_MAXINT64);
+}
+
+/* Takes the lock for reading, with all objects which may occur between
+ * @start and @end parsed; -1 for @end means no upper bound */
+static void
+read_lock_time_range (ECalBackendDecsync *cbfile,
+                      time_t start,
+                      time_t end)
+{
+	read_lock_materialized (cbfile, NULL, start, end == -1 ? G_MAXINT64 : end);
+}
+
+/* Takes the lock for reading, with all objects parsed */
+static void
+read_lock_all (ECalBackendDecsync *cbfile)
+{
+	read_lock_materialized (cbfile, NULL, G_MININT64, G_MAXINT64);
+}
+
+/* Scans the toplevel VCALENDAR component and stores the objects it finds */
+static void
+scan_vcalendar (ECalBackendDecsync *cbfile)
+{
+	ECalBackendDecsyncPrivate *priv;
+	ICalCompIter *iter;
+	ICalComponent *icomp;
+
+	priv = cbfile->priv;
+	g_return_if_fail (priv->vcalendar != NULL);
+	g_return_if_fail (priv->comp_uid_hash != NULL);
+
+	e_cal_backend_decsync_intervals_freeze (priv->intervals);
+
+	iter = i_cal_component_begin_component (priv->vcalendar, I_CAL_ANY_COMPONENT);
+	icomp = iter ? i_cal_comp_iter_deref (iter) : NULL;
+	while (icomp) {
+		ICalComponentKind kind;
+		ECalComponent *comp;
+
+		kind = i_cal_component_isa (icomp);
+
+		if (kind == I_CAL_VEVENT_COMPONENT ||
+		    kind == I_CAL_VTODO_COMPONENT ||
+		    kind == I_CAL_VJOURNAL_COMPONENT) {
+			comp = e_cal_component_new ();
+
+			if (e_cal_component_set_icalcomponent (comp, icomp)) {
+				/* Thus it's not freed while being used in the 'comp' */
+				g_object_ref (icomp);
+				i_cal_object_set_owner (I_CAL_OBJECT (icomp), G_OBJECT (priv->vcalendar));
+
+				check_dup_uid (cbfile, comp);
+
+				add_component (cbfile, comp, FALSE);
+			} else {
+				g_object_unref (comp);
+			}
+		}
+
+		g_object_unref (icomp);
+		icomp = i_cal_comp_iter_next (iter);
+	}
+
+	g_clear_object (&iter);
+
+	e_cal_backend_decsync_intervals_thaw (priv->intervals);
+}
+
+static gchar *
+uri_to_path (ECalBackend *backend)
+{
+	ECalBackendDecsync *cbfile;
+	ECalBackendDecsyncPrivate *priv;
+	const gchar *cache_dir;
+	gchar *filename = NULL;
+
+	cbfile = E_CAL_BACKEND_DECSYNC (backend);
+	priv = cbfile->priv;
 
-		e_cal_util_component_set_x_property (cbfile->priv->vcalendar, ECAL_REVISION_X_PROP, revision);
+	cache_dir = e_cal_backend_get_cache_dir (backend);
 
-		g_free (revision);
+	filename = g_build_filename (cache_dir, priv->file_name, NULL);
 
-		prop = get_revision_property (cbfile);
-		g_warn_if_fail (prop != NULL);
+	if (filename != NULL && *filename == '\0') {
+		g_free (filename);
+		filename = NULL;
 	}
 
-	return prop;
+	return filename;
 }
 
 static void
-bump_revision (ECalBackendDecsync *cbfile)
+cal_backend_decsync_take_icomp (ECalBackendDecsync *cbfile,
+                                ICalComponent *icomp)
 {
-	/* Update the revision string */
-	ICalProperty *prop = ensure_revision (cbfile);
-	gchar *revision = make_revision_string (cbfile);
-
-	i_cal_property_set_x (prop, revision);
+	ICalProperty *prop;
 
-	e_cal_backend_notify_property_changed (E_CAL_BACKEND (cbfile),
-					      E_CAL_BACKEND_PROPERTY_REVISION,
-					      revision);
+	g_warn_if_fail (cbfile->priv->vcalendar == NULL);
 
-	g_object_unref (prop);
-	g_free (revision);
-}
+	g_mutex_lock (&cbfile->priv->tz_lock);
+	cbfile->priv->vcalendar = icomp;
+	vcalendar_timezones_changed (cbfile);
+	g_mutex_unlock (&cbfile->priv->tz_lock);
 
-/* Calendar backend methods */
+	prop = ensure_revision (cbfile);
 
-/* Get_email_address handler for the decsync backend */
-static gchar *
-e_cal_backend_decsync_get_backend_property (ECalBackend *backend,
-                                         const gchar *prop_name)
-{
-	g_return_val_if_fail (prop_name != NULL, FALSE);
+	e_cal_backend_notify_property_changed (
+		E_CAL_BACKEND (cbfile),
+		E_CAL_BACKEND_PROPERTY_REVISION,
+		i_cal_property_get_x (prop));
 
-	if (g_str_equal (prop_name, CLIENT_BACKEND_PROPERTY_CAPABILITIES)) {
-		return g_strjoin (
-			",",
-			E_CAL_STATIC_CAPABILITY_NO_EMAIL_ALARMS,
-			E_CAL_STATIC_CAPABILITY_NO_THISANDPRIOR,
-			E_CAL_STATIC_CAPABILITY_DELEGATE_SUPPORTED,
-			E_CAL_STATIC_CAPABILITY_REMOVE_ONLY_THIS,
-			E_CAL_STATIC_CAPABILITY_BULK_ADDS,
-			E_CAL_STATIC_CAPABILITY_BULK_MODIFIES,
-			E_CAL_STATIC_CAPABILITY_BULK_REMOVES,
-			E_CAL_STATIC_CAPABILITY_ALARM_DESCRIPTION,
-			E_CAL_STATIC_CAPABILITY_TASK_CAN_RECUR,
-			E_CAL_STATIC_CAPABILITY_COMPONENT_COLOR,
-			E_CAL_STATIC_CAPABILITY_REFRESH_SUPPORTED,
-			NULL);
+	g_clear_object (&prop);
+}
 
-	} else if (g_str_equal (prop_name, E_CAL_BACKEND_PROPERTY_CAL_EMAIL_ADDRESS) ||
-		   g_str_equal (prop_name, E_CAL_BACKEND_PROPERTY_ALARM_EMAIL_ADDRESS)) {
-		ESourceLocal *local_extension;
+/* Replaces the object with @uid by the objects in @icomp, a VCALENDAR
+ * as written by get_shard_payload(); removes it when @icomp is NULL */
+static void
+apply_shard (ECalBackendDecsync *cbfile,
+             const gchar *uid,
+             ICalComponent *icomp)
+{
+	ECalBackendDecsyncPrivate *priv;
+	ECalBackendDecsyncObject *obj_data;
+	ICalComponentKind kind;
+	ICalComponent *subcomp;
 
-		local_extension = e_source_get_extension (e_backend_get_source (E_BACKEND (backend)), E_SOURCE_EXTENSION_LOCAL_BACKEND);
+	priv = cbfile->priv;
 
-		return e_source_local_dup_email_address (local_extension);
+	/* the shard supersedes what the calendar file has for the UID */
+	forget_stubs (cbfile, uid);
 
-	} else if (g_str_equal (prop_name, E_CAL_BACKEND_PROPERTY_DEFAULT_OBJECT)) {
-		ECalComponent *comp;
-		gchar *prop_value;
+	obj_data = g_hash_table_lookup (priv->comp_uid_hash, uid);
+	if (obj_data)
+		remove_component (cbfile, uid, obj_data);
 
-		comp = e_cal_component_new ();
+	if (!icomp)
+		return;
 
-		switch (e_cal_backend_get_kind (E_CAL_BACKEND (backend))) {
-		case I_CAL_VEVENT_COMPONENT:
-			e_cal_component_set_new_vtype (comp, E_CAL_COMPONENT_EVENT);
-			break;
-		case I_CAL_VTODO_COMPONENT:
-			e_cal_component_set_new_vtype (comp, E_CAL_COMPONENT_TODO);
-			break;
-		case I_CAL_VJOURNAL_COMPONENT:
-			e_cal_component_set_new_vtype (comp, E_CAL_COMPONENT_JOURNAL);
-			break;
-		default:
-			g_object_unref (comp);
-			return NULL;
-		}
+	kind = e_cal_backend_get_kind (E_CAL_BACKEND (cbfile));
 
-		prop_value = e_cal_component_get_as_string (comp);
+	for (subcomp = i_cal_component_get_first_component (icomp, I_CAL_ANY_COMPONENT);
+	     subcomp;
+	     g_object_unref (subcomp), subcomp = i_cal_component_get_next_component (icomp, I_CAL_ANY_COMPONENT)) {
+		ICalComponentKind child_kind = i_cal_component_isa (subcomp);
 
-		g_object_unref (comp);
+		if (child_kind == I_CAL_VTIMEZONE_COMPONENT) {
+			ICalTimezone *zone;
 
-		return prop_value;
+			zone = i_cal_timezone_new ();
+			if (i_cal_timezone_set_component (zone, subcomp)) {
+				ICalTimezone *existing;
 
-	} else if (g_str_equal (prop_name, E_CAL_BACKEND_PROPERTY_REVISION)) {
-		ICalProperty *prop;
-		gchar *revision = NULL;
+				existing = i_cal_component_get_timezone (priv->vcalendar, i_cal_timezone_get_tzid (zone));
+				if (existing) {
+					g_object_unref (existing);
+				} else {
+					g_mutex_lock (&priv->tz_lock);
+					i_cal_component_take_component (priv->vcalendar, i_cal_component_clone (subcomp));
+					vcalendar_timezones_changed (cbfile);
+					g_mutex_unlock (&priv->tz_lock);
+				}
+			}
+			g_object_unref (zone);
+		} else if (child_kind == kind) {
+			ECalComponent *comp;
 
-		/* This returns NULL if backend lacks a vcalendar. */
-		prop = ensure_revision (E_CAL_BACKEND_DECSYNC (backend));
-		if (prop) {
-			revision = g_strdup (i_cal_property_get_x (prop));
-			g_object_unref (prop);
+			comp = e_cal_component_new_from_icalcomponent (i_cal_component_clone (subcomp));
+			if (comp)
+				add_component (cbfile, comp, TRUE);
 		}
-
-		return revision;
 	}
-
-	/* Chain up to parent's method. */
-	return E_CAL_BACKEND_CLASS (e_cal_backend_decsync_parent_class)->
-		impl_get_backend_property (backend, prop_name);
 }
 
-typedef struct _ResolveTzidData {
-	ICalComponent *vcalendar;
-	GHashTable *zones; /* gchar *tzid -> ICalTimezone * */
-} ResolveTzidData;
-
 static void
-resolve_tzid_data_init (ResolveTzidData *rtd,
-                        ICalComponent *vcalendar)
+set_revision (ECalBackendDecsync *cbfile,
+              const gchar *revision)
 {
-	if (rtd) {
-		rtd->vcalendar = vcalendar;
-		rtd->zones = NULL;
-	}
+	e_cal_util_component_set_x_property (cbfile->priv->vcalendar, ECAL_REVISION_X_PROP, revision);
+	e_cal_backend_notify_property_changed (
+		E_CAL_BACKEND (cbfile),
+		E_CAL_BACKEND_PROPERTY_REVISION,
+		revision);
 }
 
-/* Clears the content, not the structure */
+typedef struct {
+	gchar *path;
+	const gchar *uid;
+	ICalComponent *icomp;
+} ShardData;
+
 static void
-resolve_tzid_data_clear (ResolveTzidData *rtd)
+load_shard_thread (gpointer data,
+                   gpointer user_data)
 {
-	if (rtd && rtd->zones)
-		g_hash_table_destroy (rtd->zones);
+	ShardData *shard = data;
+	gchar *contents = NULL;
+	GError *error = NULL;
+
+	if (!g_file_get_contents (shard->path, &contents, NULL, &error)) {
+		g_warning (G_STRLOC ": Cannot read shard '%s': %s", shard->path, error->message);
+		g_clear_error (&error);
+		return;
+	}
+
+	shard->icomp = i_cal_parser_parse_string (contents);
+	if (shard->icomp && i_cal_component_isa (shard->icomp) != I_CAL_VCALENDAR_COMPONENT)
+		g_clear_object (&shard->icomp);
+
+	if (!shard->icomp)
+		g_warning (G_STRLOC ": Cannot parse shard '%s', keeping the previous version of '%s'", shard->path, shard->uid);
+
+	g_free (contents);
 }
 
-/* function to resolve timezones */
-static ICalTimezone *
-resolve_tzid_cb (const gchar *tzid,
-                 gpointer user_data,
-                 GCancellable *cancellable,
-                 GError **error)
+/* Reads the shards listed in the manifest in parallel and applies them on
+ * top of the calendar file.  A shard which cannot be read or parsed only
+ * loses the change of its own object.  Returns FALSE when the shards were
+ * written on top of another calendar file than the one loaded, which then
+ * is newer, and they were not applied. */
+static gboolean
+load_shards (ECalBackendDecsync *cbfile)
 {
-	ResolveTzidData *rtd = user_data;
-	ICalTimezone *zone;
+	ECalBackendDecsyncPrivate *priv;
+	GThreadPool *pool;
+	ShardData *shards;
+	gchar **keys, *revision, *base_revision;
+	gsize n_keys = 0, ii;
 
-	if (!tzid || !tzid[0])
-		return NULL;
-	else if (!strcmp (tzid, "UTC"))
-		return i_cal_timezone_get_utc_timezone ();
+	priv = cbfile->priv;
 
-	if (rtd->zones) {
-		zone = g_hash_table_lookup (rtd->zones, tzid);
-		if (zone)
-			return zone;
+	/* manifests written before the base revision was stored have none */
+	base_revision = g_key_file_get_string (priv->manifest, MANIFEST_GROUP_CALENDAR, "BaseRevision", NULL);
+	if (base_revision) {
+		revision = dup_revision (cbfile);
+
+		if (g_strcmp0 (base_revision, revision) != 0) {
+			g_warning (G_STRLOC ": Calendar file '%s' is of revision '%s', not '%s' of the manifest, ignoring its shards",
+				priv->path, revision ? revision : "", base_revision);
+			g_free (base_revision);
+			g_free (revision);
+			return FALSE;
+		}
+
+		g_free (base_revision);
+		g_free (revision);
 	}
 
-	zone = i_cal_timezone_get_builtin_timezone_from_tzid (tzid);
-	if (zone)
-		g_object_ref (zone);
-	else if (rtd->vcalendar)
-		zone = i_cal_component_get_timezone (rtd->vcalendar, tzid);
+	keys = g_key_file_get_keys (priv->manifest, MANIFEST_GROUP_SHARDS, &n_keys, NULL);
+	shards = g_new0 (ShardData, n_keys);
 
-	if (zone) {
-		if (!rtd->zones)
-			rtd->zones = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+	pool = n_keys > 1 ? g_thread_pool_new (load_shard_thread, NULL, g_get_num_processors (), FALSE, NULL) : NULL;
 
-		g_hash_table_insert (rtd->zones, g_strdup (tzid), zone);
+	for (ii = 0; ii < n_keys; ii++) {
+		gchar *uid;
+
+		/* the manifest keeps the UID, so that a removal can be applied */
+		uid = g_key_file_get_string (priv->manifest, MANIFEST_GROUP_SHARDS, keys[ii], NULL);
+		if (!uid || !*uid) {
+			g_free (uid);
+			continue;
+		}
+
+		shards[ii].path = g_build_filename (priv->shards_path, keys[ii], NULL);
+		shards[ii].uid = uid;
+
+		if (pool)
+			g_thread_pool_push (pool, &shards[ii], NULL);
+		else
+			load_shard_thread (&shards[ii], NULL);
 	}
 
-	return zone;
+	if (pool)
+		g_thread_pool_free (pool, FALSE, TRUE);
+
+	for (ii = 0; ii < n_keys; ii++) {
+		if (shards[ii].icomp)
+			apply_shard (cbfile, shards[ii].uid, shards[ii].icomp);
+
+		g_clear_object (&shards[ii].icomp);
+		g_free (shards[ii].path);
+		g_free ((gchar *) shards[ii].uid);
+	}
+
+	revision = g_key_file_get_string (priv->manifest, MANIFEST_GROUP_CALENDAR, "Revision", NULL);
+	if (revision && *revision)
+		set_revision (cbfile, revision);
+
+	g_free (revision);
+	g_free (shards);
+	g_strfreev (keys);
+
+	return TRUE;
 }
 
-/* Checks if the specified component has a duplicated UID and if so changes it.
- * UIDs may be shared between components if there is at most one component
- * without RECURRENCE-ID (master) and all others have different RECURRENCE-ID
- * values.
- */
+/* Loads the shards on top of the calendar file; the first time, converts
+ * the previous single-file layout by writing the calendar file and an
+ * empty manifest */
 static void
-check_dup_uid (ECalBackendDecsync *cbfile,
-               ECalComponent *comp)
+open_shards (ECalBackendDecsync *cbfile)
 {
 	ECalBackendDecsyncPrivate *priv;
-	ECalBackendDecsyncObject *obj_data;
-	const gchar *uid;
-	gchar *new_uid = NULL;
-	gchar *rid = NULL;
+	gchar *manifest_path;
+	GError *error = NULL;
 
 	priv = cbfile->priv;
 
-	uid = e_cal_component_get_uid (comp);
+	manifest_path = g_build_filename (priv->shards_path, SHARDS_MANIFEST, NULL);
 
-	if (!uid) {
-		g_warning ("Checking for duplicate uid, the component does not have a valid UID skipping it\n");
-		return;
-	}
+	if (g_key_file_load_from_file (priv->manifest, manifest_path, G_KEY_FILE_NONE, &error)) {
+		if (g_key_file_get_integer (priv->manifest, MANIFEST_GROUP_CALENDAR, "Version", NULL) > SHARDS_LAYOUT_VERSION)
+			g_warning (G_STRLOC ": Manifest '%s' is of a newer version", manifest_path);
 
-	obj_data = g_hash_table_lookup (priv->comp_uid_hash, uid);
-	if (!obj_data)
-		return; /* Everything is fine */
+		load_resource_digests (cbfile);
 
-	rid = e_cal_component_get_recurid_as_string (comp);
-	if (rid && *rid) {
-		/* new component has rid, must not be the same as in other detached recurrence */
-		if (!g_hash_table_lookup (obj_data->recurrences, rid))
-			goto done;
+		/* a full write replaces the manifest and drops the stale shards */
+		if (!load_shards (cbfile)) {
+			priv->needs_snapshot = TRUE;
+			save (cbfile, FALSE);
+		}
 	} else {
-		/* new component has no rid, must not clash with existing master */
-		if (!obj_data->full_object)
-			goto done;
+		if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			g_warning (G_STRLOC ": Cannot read manifest '%s': %s", manifest_path, error->message);
+		g_clear_error (&error);
+
+		priv->needs_snapshot = TRUE;
+		save (cbfile, FALSE);
 	}
 
-	d (
-		g_message (G_STRLOC ": Got object with duplicated UID `%s' and rid `%s', changing it...",
-		uid,
-		rid ? rid : ""));
+	g_free (manifest_path);
+}
 
-	new_uid = e_util_generate_uid ();
-	e_cal_component_set_uid (comp, new_uid);
+/* Timezone offsets reach 14 hours, which the approximate time span of
+ * a stub has to cover, as it ignores the time zones */
+#define STUB_TIME_SLACK (26 * 60 * 60)
+
+static gboolean
+line_is_property (const gchar *line,
+                  gsize line_len,
+                  const gchar *name)
+{
+	gsize name_len = strlen (name);
+
+	return line_len > name_len &&
+		g_ascii_strncasecmp (line, name, name_len) == 0 &&
+		(line[name_len] == ':' || line[name_len] == ';');
+}
+
+static gboolean
+line_is_begin (const gchar *line,
+               gsize line_len,
+               const gchar *kind)
+{
+	gsize kind_len = strlen (kind);
+
+	return line_len == kind_len + 6 &&
+		g_ascii_strncasecmp (line, "BEGIN:", 6) == 0 &&
+		g_ascii_strncasecmp (line + 6, kind, kind_len) == 0;
+}
+
+/* Returns the unfolded value of the property whose line starts at @pos */
+static gchar *
+get_property_value (const gchar *data,
+                    gsize len,
+                    gsize pos)
+{
+	GString *value;
+	gboolean in_quotes = FALSE;
+
+	/* skip the name and the parameters */
+	while (pos < len && data[pos] != '\n' && (in_quotes || data[pos] != ':')) {
+		if (data[pos] == '"')
+			in_quotes = !in_quotes;
+		pos++;
+	}
+
+	if (pos >= len || data[pos] != ':')
+		return NULL;
+
+	value = g_string_new (NULL);
+	pos++;
+
+	while (pos < len) {
+		const gchar *eol;
+		gsize line_len;
+
+		eol = memchr (data + pos, '\n', len - pos);
+		line_len = eol ? (gsize) (eol - data) - pos : len - pos;
+		if (line_len && data[pos + line_len - 1] == '\r')
+			line_len--;
+
+		g_string_append_len (value, data + pos, line_len);
+
+		if (!eol)
+			break;
 
-	/* FIXME: I think we need to reset the SEQUENCE property and reset the
-	 * CREATED/DTSTAMP/LAST-MODIFIED.
-	 */
+		pos = eol - data + 1;
+		if (pos >= len || (data[pos] != ' ' && data[pos] != '\t'))
+			break;
 
-	save (cbfile, FALSE);
+		/* a folded line */
+		pos++;
+	}
 
- done:
-	g_free (rid);
-	g_free (new_uid);
+	return g_string_free (value, FALSE);
 }
 
-static time_t
-get_rid_as_time_t (ECalComponent *comp)
+/* Reads the UTC time of a DATE or DATE-TIME value, ignoring its zone */
+static gboolean
+parse_stub_time (const gchar *value,
+                 gint64 *out_time)
 {
-	ECalComponentRange *range;
-	ECalComponentDateTime *dt;
-	time_t tmt = (time_t) -1;
+	gint year, month, day, hour = 0, minute = 0, second = 0;
+	GDateTime *dt;
 
-	range = e_cal_component_get_recurid (comp);
-	if (!range)
-		return tmt;
+	if (!value || sscanf (value, "%4d%2d%2d", &year, &month, &day) != 3)
+		return FALSE;
 
-	dt = e_cal_component_range_get_datetime (range);
-	if (!dt) {
-		e_cal_component_range_free (range);
-		return tmt;
-	}
+	if (strlen (value) > 8 && value[8] == 'T' &&
+	    sscanf (value + 9, "%2d%2d%2d", &hour, &minute, &second) != 3)
+		return FALSE;
 
-	tmt = i_cal_time_as_timet (e_cal_component_datetime_get_value (dt));
+	dt = g_date_time_new_utc (year, month, day, hour, minute, second);
+	if (!dt)
+		return FALSE;
 
-	e_cal_component_range_free (range);
+	*out_time = g_date_time_to_unix (dt);
+	g_date_time_unref (dt);
 
-	return tmt;
+	return TRUE;
 }
 
-/* Adds component to the interval tree
- */
+typedef struct {
+	ECalBackendDecsyncStub *stub;
+	gboolean has_start;
+	gboolean has_end;
+	gboolean recurs;
+	gint64 start;
+	gint64 end;
+	gint64 duration;
+} StubScanData;
+
 static void
-add_component_to_intervaltree (ECalBackendDecsync *cbfile,
-                               ECalComponent *comp)
+stub_scan_property (StubScanData *ssd,
+                    const gchar *data,
+                    gsize len,
+                    gsize pos,
+                    gsize line_len)
 {
-	time_t time_start = -1, time_end = -1;
-	ECalBackendDecsyncPrivate *priv;
-	ResolveTzidData rtd;
+	const gchar *line = data + pos;
+	gchar *value;
+
+	if (line_is_property (line, line_len, "UID")) {
+		g_free (ssd->stub->uid);
+		ssd->stub->uid = get_property_value (data, len, pos);
+	} else if (line_is_property (line, line_len, "RECURRENCE-ID")) {
+		g_free (ssd->stub->rid);
+		ssd->stub->rid = get_property_value (data, len, pos);
+	} else if (line_is_property (line, line_len, "DTSTART")) {
+		value = get_property_value (data, len, pos);
+		ssd->has_start = parse_stub_time (value, &ssd->start);
+		g_free (value);
+	} else if (line_is_property (line, line_len, "DTEND") ||
+		   line_is_property (line, line_len, "DUE")) {
+		value = get_property_value (data, len, pos);
+		ssd->has_end = parse_stub_time (value, &ssd->end);
+		g_free (value);
+	} else if (line_is_property (line, line_len, "DURATION")) {
+		ICalDuration *duration;
+
+		value = get_property_value (data, len, pos);
+		duration = value ? i_cal_duration_new_from_string (value) : NULL;
+		if (duration) {
+			ssd->duration = i_cal_duration_as_int (duration);
+			g_object_unref (duration);
+		}
+		g_free (value);
+	} else if (line_is_property (line, line_len, "RRULE") ||
+		   line_is_property (line, line_len, "RDATE")) {
+		ssd->recurs = TRUE;
+	}
+}
 
-	g_return_if_fail (cbfile != NULL);
-	g_return_if_fail (comp != NULL);
+static void
+stub_scan_finish (StubScanData *ssd)
+{
+	ECalBackendDecsyncStub *stub = ssd->stub;
 
-	priv = cbfile->priv;
+	if (!ssd->has_start) {
+		stub->start = G_MININT64;
+		stub->end = G_MAXINT64;
+		return;
+	}
 
-	resolve_tzid_data_init (&rtd, cbfile->priv->vcalendar);
+	stub->start = ssd->start - STUB_TIME_SLACK;
 
-	e_cal_util_get_component_occur_times (
-		comp, &time_start, &time_end,
-		resolve_tzid_cb, &rtd, i_cal_timezone_get_utc_timezone (),
-		e_cal_backend_get_kind (E_CAL_BACKEND (cbfile)));
+	if (ssd->recurs)
+		stub->end = G_MAXINT64;
+	else if (ssd->has_end)
+		stub->end = MAX (ssd->start, ssd->end) + STUB_TIME_SLACK;
+	else if (ssd->duration > 0)
+		stub->end = ssd->start + ssd->duration + STUB_TIME_SLACK;
+	else
+		stub->end = ssd->start + 24 * 60 * 60 + STUB_TIME_SLACK;
+}
 
-	resolve_tzid_data_clear (&rtd);
+static void
+add_stub (GHashTable *stubs,
+          ECalBackendDecsyncStub *stub)
+{
+	GPtrArray *uid_stubs;
 
-	if (time_end != -1 && time_start > time_end) {
-		gchar *str = e_cal_component_get_as_string (comp);
-		g_print ("Bogus component %s\n", str);
-		g_free (str);
-	} else {
-		g_rec_mutex_lock (&priv->idle_save_rmutex);
-		e_intervaltree_insert (priv->interval_tree, time_start, time_end, comp);
-		g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	uid_stubs = g_hash_table_lookup (stubs, stub->uid);
+	if (!uid_stubs) {
+		uid_stubs = g_ptr_array_new_with_free_func (free_stub);
+		g_hash_table_insert (stubs, g_strdup (stub->uid), uid_stubs);
 	}
+
+	g_ptr_array_add (uid_stubs, stub);
 }
 
+typedef struct {
+	const gchar *data;
+	gsize len;
+	gsize pos;
+} IndexReader;
+
 static gboolean
-remove_component_from_intervaltree (ECalBackendDecsync *cbfile,
-                                    ECalComponent *comp)
+index_get (IndexReader *reader,
+           gpointer value,
+           gsize size)
 {
-	const gchar *uid;
-	gchar *rid;
-	gboolean res;
-	ECalBackendDecsyncPrivate *priv;
+	if (size > reader->len - reader->pos)
+		return FALSE;
 
-	g_return_val_if_fail (cbfile != NULL, FALSE);
-	g_return_val_if_fail (comp != NULL, FALSE);
+	memcpy (value, reader->data + reader->pos, size);
+	reader->pos += size;
 
-	priv = cbfile->priv;
+	return TRUE;
+}
 
-	uid = e_cal_component_get_uid (comp);
-	rid = e_cal_component_get_recurid_as_string (comp);
+static gboolean
+index_get_string (IndexReader *reader,
+                  gchar **out_str)
+{
+	guint32 len;
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
-	res = e_intervaltree_remove (priv->interval_tree, uid, rid);
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	if (!index_get (reader, &len, sizeof (len)) || len > reader->len - reader->pos)
+		return FALSE;
 
-	g_free (rid);
+	*out_str = len ? g_strndup (reader->data + reader->pos, len) : NULL;
+	reader->pos += len;
 
-	return res;
+	return TRUE;
 }
 
-/* Tries to add an ICalComponent to the decsync backend.  We only store the objects
- * of the types we support; all others just remain in the toplevel component so
- * that we don't lose them.
- *
- * The caller is responsible for ensuring that the component has a UID and that
- * the UID is not in use already.
- */
-static void
-add_component (ECalBackendDecsync *cbfile,
-               ECalComponent *comp,
-               gboolean add_to_toplevel)
+/* Maps the calendar file and fills the objects not parsed yet from its
+ * index, as open_cal_lazy() does, with exact occurrence bounds.  Returns
+ * NULL when there is no index matching the file. */
+static ICalComponent *
+open_cal_from_index (const gchar *uristr,
+                     const gchar *index_path,
+                     GHashTable **out_stubs,
+                     GMappedFile **out_mapped_file)
 {
-	ECalBackendDecsyncPrivate *priv;
-	ECalBackendDecsyncObject *obj_data;
-	const gchar *uid;
+	IndexReader reader = { NULL };
+	GMappedFile *mapped_file = NULL;
+	GHashTable *stubs = NULL;
+	GString *header = NULL;
+	ICalComponent *icomp = NULL;
+	GStatBuf st;
+	gchar *contents = NULL, *revision = NULL, *file_revision = NULL;
+	const gchar *data;
+	gsize len, header_from = 0;
+	gint64 file_size, file_mtime;
+	guint32 version, n_entries, ii;
+
+	if (!g_file_get_contents (index_path, &contents, &reader.len, NULL))
+		return NULL;
 
-	priv = cbfile->priv;
+	reader.data = contents;
 
-	uid = e_cal_component_get_uid (comp);
+	if (reader.len < strlen (INDEX_MAGIC) || memcmp (contents, INDEX_MAGIC, strlen (INDEX_MAGIC)) != 0)
+		goto out;
 
-	if (!uid) {
-		g_warning ("The component does not have a valid UID skipping it\n");
-		return;
-	}
+	reader.pos = strlen (INDEX_MAGIC);
 
-	obj_data = g_hash_table_lookup (priv->comp_uid_hash, uid);
-	if (e_cal_component_is_instance (comp)) {
-		gchar *rid;
+	if (!index_get (&reader, &version, sizeof (version)) || version != INDEX_VERSION ||
+	    !index_get (&reader, &file_size, sizeof (file_size)) ||
+	    !index_get (&reader, &file_mtime, sizeof (file_mtime)) ||
+	    !index_get_string (&reader, &revision) || !revision ||
+	    !index_get (&reader, &n_entries, sizeof (n_entries)))
+		goto out;
 
-		rid = e_cal_component_get_recurid_as_string (comp);
-		if (obj_data) {
-			if (g_hash_table_lookup (obj_data->recurrences, rid)) {
-				g_warning (G_STRLOC ": Tried to add an already existing recurrence");
-				g_free (rid);
-				return;
-			}
-		} else {
-			obj_data = g_new0 (ECalBackendDecsyncObject, 1);
-			obj_data->full_object = NULL;
-			obj_data->recurrences = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
-			g_hash_table_insert (priv->comp_uid_hash, g_strdup (uid), obj_data);
-		}
+	/* the file was changed after the index had been written */
+	if (g_stat (uristr, &st) != 0 || st.st_size != file_size || st.st_mtime != file_mtime)
+		goto out;
 
-		g_hash_table_insert (obj_data->recurrences, rid, comp);
-		obj_data->recurrences_list = g_list_append (obj_data->recurrences_list, comp);
-	} else {
-		if (obj_data) {
-			if (obj_data->full_object) {
-				g_warning (G_STRLOC ": Tried to add an already existing object");
-				return;
-			}
+	mapped_file = g_mapped_file_new (uristr, FALSE, NULL);
+	if (!mapped_file || g_mapped_file_get_length (mapped_file) != (gsize) file_size)
+		goto out;
 
-			obj_data->full_object = comp;
-		} else {
-			obj_data = g_new0 (ECalBackendDecsyncObject, 1);
-			obj_data->full_object = comp;
-			obj_data->recurrences = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+	data = g_mapped_file_get_contents (mapped_file);
+	len = g_mapped_file_get_length (mapped_file);
 
-			g_hash_table_insert (priv->comp_uid_hash, g_strdup (uid), obj_data);
+	stubs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
+	header = g_string_sized_new (4096);
+
+	for (ii = 0; ii < n_entries; ii++) {
+		ECalBackendDecsyncStub *stub;
+		gint64 offset, length;
+
+		stub = g_slice_new0 (ECalBackendDecsyncStub);
+
+		if (!index_get_string (&reader, &stub->uid) ||
+		    !index_get_string (&reader, &stub->rid) ||
+		    !index_get (&reader, &stub->start, sizeof (stub->start)) ||
+		    !index_get (&reader, &stub->end, sizeof (stub->end)) ||
+		    !index_get (&reader, &offset, sizeof (offset)) ||
+		    !index_get (&reader, &length, sizeof (length)) ||
+		    !stub->uid || offset < (gint64) header_from || length < 6 ||
+		    offset + length > (gint64) len ||
+		    g_ascii_strncasecmp (data + offset, "BEGIN:", 6) != 0) {
+			free_stub (stub);
+			goto out;
 		}
-	}
 
-	add_component_to_intervaltree (cbfile, comp);
+		stub->offset = offset;
+		stub->length = length;
 
-	priv->comp = g_list_prepend (priv->comp, comp);
+		g_string_append_len (header, data + header_from, stub->offset - header_from);
+		header_from = stub->offset + stub->length;
 
-	/* Put the object in the toplevel component if required */
+		add_stub (stubs, stub);
+	}
 
-	if (add_to_toplevel) {
-		ICalComponent *icomp;
+	g_string_append_len (header, data + header_from, len - header_from);
 
-		icomp = e_cal_component_get_icalcomponent (comp);
-		g_return_if_fail (icomp != NULL);
+	icomp = i_cal_parser_parse_string (header->str);
+	if (icomp && i_cal_component_isa (icomp) != I_CAL_VCALENDAR_COMPONENT)
+		g_clear_object (&icomp);
 
-		i_cal_component_add_component (priv->vcalendar, icomp);
+	/* the index describes a different version of the file */
+	file_revision = icomp ? e_cal_util_component_dup_x_property (icomp, ECAL_REVISION_X_PROP) : NULL;
+	if (icomp && g_strcmp0 (revision, file_revision) != 0)
+		g_clear_object (&icomp);
+
+ out:
+	if (icomp) {
+		*out_stubs = stubs;
+		*out_mapped_file = mapped_file;
+	} else {
+		g_clear_pointer (&stubs, g_hash_table_destroy);
+		g_clear_pointer (&mapped_file, g_mapped_file_unref);
 	}
+
+	if (header)
+		g_string_free (header, TRUE);
+	g_free (file_revision);
+	g_free (revision);
+	g_free (contents);
+
+	return icomp;
 }
 
-/* g_hash_table_foreach_remove() callback to remove recurrences from the calendar */
+/* Splits the VCALENDAR in @data on the boundaries of its objects, which
+ * are added to @objects as stubs, with what a look at their properties
+ * tells without parsing them; everything else goes to @header.  Fails
+ * when @data is not a single well-formed VCALENDAR. */
 static gboolean
-remove_recurrence_cb (gpointer key,
-                      gpointer value,
-                      gpointer data)
+split_vcalendar (const gchar *data,
+                 gsize len,
+                 GString *header,
+                 GPtrArray *objects)
 {
-	ICalComponent *icomp;
-	ECalBackendDecsyncPrivate *priv;
-	ECalComponent *comp = value;
-	ECalBackendDecsync *cbfile = data;
+	StubScanData ssd = { NULL };
+	gsize pos = 0, header_from = 0;
+	gint depth = 0, n_vcalendars = 0;
+	gboolean failed = FALSE;
+
+	while (pos < len && !failed) {
+		const gchar *line = data + pos, *eol;
+		gsize line_len, next;
+
+		eol = memchr (line, '\n', len - pos);
+		line_len = eol ? (gsize) (eol - line) : len - pos;
+		next = pos + line_len + (eol ? 1 : 0);
+		if (line_len && line[line_len - 1] == '\r')
+			line_len--;
+
+		if (line_is_property (line, line_len, "BEGIN")) {
+			if (depth == 0 && n_vcalendars++ > 0) {
+				/* not a single VCALENDAR */
+				failed = TRUE;
+			} else if (depth == 1 && (
+				   line_is_begin (line, line_len, "VEVENT") ||
+				   line_is_begin (line, line_len, "VTODO") ||
+				   line_is_begin (line, line_len, "VJOURNAL"))) {
+				memset (&ssd, 0, sizeof (StubScanData));
+				ssd.stub = g_slice_new0 (ECalBackendDecsyncStub);
+				ssd.stub->offset = pos;
+
+				g_string_append_len (header, data + header_from, pos - header_from);
+			}
 
-	priv = cbfile->priv;
+			depth++;
+		} else if (line_is_property (line, line_len, "END")) {
+			depth--;
 
-	/* remove the recurrence from the top-level calendar */
-	icomp = e_cal_component_get_icalcomponent (comp);
-	g_return_val_if_fail (icomp != NULL, FALSE);
+			if (depth == 1 && ssd.stub) {
+				ECalBackendDecsyncStub *stub = ssd.stub;
 
-	icomp = g_object_ref (icomp);
+				ssd.stub = NULL;
+				stub->length = next - stub->offset;
+				header_from = next;
 
-	if (!remove_component_from_intervaltree (cbfile, comp)) {
-		g_message (G_STRLOC " Could not remove component from interval tree!");
+				stub_scan_finish (&ssd);
+				g_ptr_array_add (objects, stub);
+			} else if (depth < 0) {
+				failed = TRUE;
+			}
+		} else if (ssd.stub && depth == 2) {
+			stub_scan_property (&ssd, data, len, pos, line_len);
+		}
+
+		pos = next;
 	}
-	i_cal_component_remove_component (priv->vcalendar, icomp);
 
-	g_object_unref (icomp);
+	if (ssd.stub) {
+		free_stub (ssd.stub);
+		failed = TRUE;
+	}
 
-	/* remove it from our mapping */
-	priv->comp = g_list_remove (priv->comp, comp);
+	if (!failed)
+		g_string_append_len (header, data + header_from, len - header_from);
 
-	return TRUE;
+	return !failed;
 }
 
-/* Removes a component from the backend's hash and lists.  Does not perform
- * notification on the clients.  Also removes the component from the toplevel
- * ICalComponent.
- */
-static void
-remove_component (ECalBackendDecsync *cbfile,
-                  const gchar *uid,
-                  ECalBackendDecsyncObject *obj_data)
+/* Parses what split_vcalendar() left in @header */
+static ICalComponent *
+parse_vcalendar_header (GString *header)
 {
-	ECalBackendDecsyncPrivate *priv;
 	ICalComponent *icomp;
-	GList *l;
 
-	priv = cbfile->priv;
+	icomp = i_cal_parser_parse_string (header->str);
+	if (icomp && i_cal_component_isa (icomp) != I_CAL_VCALENDAR_COMPONENT)
+		g_clear_object (&icomp);
 
-	/* Remove the ICalComponent from the toplevel */
-	if (obj_data->full_object) {
-		icomp = e_cal_component_get_icalcomponent (obj_data->full_object);
-		g_return_if_fail (icomp != NULL);
+	return icomp;
+}
 
-		i_cal_component_remove_component (priv->vcalendar, icomp);
+/* Maps the calendar file and indexes its objects without parsing them.
+ * Returns the VCALENDAR with everything else, or NULL when the file
+ * cannot be opened this way. */
+static ICalComponent *
+open_cal_lazy (const gchar *uristr,
+               GHashTable **out_stubs,
+               GMappedFile **out_mapped_file)
+{
+	GMappedFile *mapped_file;
+	GHashTable *stubs, *ids;
+	GPtrArray *objects;
+	GString *header;
+	ICalComponent *icomp = NULL;
+	guint ii;
+
+	mapped_file = g_mapped_file_new (uristr, FALSE, NULL);
+	if (!mapped_file)
+		return NULL;
 
-		/* Remove it from our mapping */
-		l = g_list_find (priv->comp, obj_data->full_object);
-		g_return_if_fail (l != NULL);
-		priv->comp = g_list_delete_link (priv->comp, l);
+	objects = g_ptr_array_new_with_free_func (free_stub);
+	header = g_string_sized_new (4096);
 
-		if (!remove_component_from_intervaltree (cbfile, obj_data->full_object)) {
-			g_message (G_STRLOC " Could not remove component from interval tree!");
+	if (split_vcalendar (g_mapped_file_get_contents (mapped_file), g_mapped_file_get_length (mapped_file), header, objects)) {
+		icomp = parse_vcalendar_header (header);
+
+		/* objects without UID or with duplicate IDs are fixed up by
+		 * the full parse */
+		ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+		for (ii = 0; icomp && ii < objects->len; ii++) {
+			ECalBackendDecsyncStub *stub = g_ptr_array_index (objects, ii);
+			gchar *id;
+
+			id = stub->uid ? g_strconcat (stub->uid, "\n", stub->rid, NULL) : NULL;
+			if (!id || !*stub->uid || g_hash_table_contains (ids, id)) {
+				g_free (id);
+				g_clear_object (&icomp);
+				break;
+			}
+
+			g_hash_table_add (ids, id);
 		}
+
+		g_hash_table_destroy (ids);
 	}
 
-	/* remove the recurrences also */
-	g_hash_table_foreach_remove (obj_data->recurrences, (GHRFunc) remove_recurrence_cb, cbfile);
+	g_string_free (header, TRUE);
 
-	g_hash_table_remove (priv->comp_uid_hash, uid);
+	if (!icomp) {
+		g_ptr_array_unref (objects);
+		g_mapped_file_unref (mapped_file);
+		return NULL;
+	}
 
-	save (cbfile, TRUE);
-}
+	stubs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
 
-/* Scans the toplevel VCALENDAR component and stores the objects it finds */
-static void
-scan_vcalendar (ECalBackendDecsync *cbfile)
-{
-	ECalBackendDecsyncPrivate *priv;
-	ICalCompIter *iter;
-	ICalComponent *icomp;
+	/* the stubs move to the hash table */
+	g_ptr_array_set_free_func (objects, NULL);
+	for (ii = 0; ii < objects->len; ii++)
+		add_stub (stubs, g_ptr_array_index (objects, ii));
+	g_ptr_array_unref (objects);
 
-	priv = cbfile->priv;
-	g_return_if_fail (priv->vcalendar != NULL);
-	g_return_if_fail (priv->comp_uid_hash != NULL);
+	*out_stubs = stubs;
+	*out_mapped_file = mapped_file;
 
-	iter = i_cal_component_begin_component (priv->vcalendar, I_CAL_ANY_COMPONENT);
-	icomp = iter ? i_cal_comp_iter_deref (iter) : NULL;
-	while (icomp) {
-		ICalComponentKind kind;
-		ECalComponent *comp;
+	return icomp;
+}
 
-		kind = i_cal_component_isa (icomp);
+/* Maps the calendar file and splits it into its objects, for a full parse
+ * by parse_objects().  Returns the VCALENDAR with everything else, or NULL
+ * when the file cannot be opened this way. */
+static ICalComponent *
+open_cal_split (const gchar *uristr,
+                GPtrArray **out_objects,
+                GMappedFile **out_mapped_file)
+{
+	GMappedFile *mapped_file;
+	GPtrArray *objects;
+	GString *header;
+	ICalComponent *icomp = NULL;
 
-		if (kind == I_CAL_VEVENT_COMPONENT ||
-		    kind == I_CAL_VTODO_COMPONENT ||
-		    kind == I_CAL_VJOURNAL_COMPONENT) {
-			comp = e_cal_component_new ();
+	mapped_file = g_mapped_file_new (uristr, FALSE, NULL);
+	if (!mapped_file)
+		return NULL;
 
-			if (e_cal_component_set_icalcomponent (comp, icomp)) {
-				/* Thus it's not freed while being used in the 'comp' */
-				g_object_ref (icomp);
-				i_cal_object_set_owner (I_CAL_OBJECT (icomp), G_OBJECT (priv->vcalendar));
+	objects = g_ptr_array_new_with_free_func (free_stub);
+	header = g_string_sized_new (4096);
 
-				check_dup_uid (cbfile, comp);
+	if (split_vcalendar (g_mapped_file_get_contents (mapped_file), g_mapped_file_get_length (mapped_file), header, objects))
+		icomp = parse_vcalendar_header (header);
 
-				add_component (cbfile, comp, FALSE);
-			} else {
-				g_object_unref (comp);
-			}
-		}
+	g_string_free (header, TRUE);
 
-		g_object_unref (icomp);
-		icomp = i_cal_comp_iter_next (iter);
+	if (!icomp) {
+		g_ptr_array_unref (objects);
+		g_mapped_file_unref (mapped_file);
+		return NULL;
 	}
 
-	g_clear_object (&iter);
+	*out_objects = objects;
+	*out_mapped_file = mapped_file;
+
+	return icomp;
 }
 
-static gchar *
-uri_to_path (ECalBackend *backend)
+/* Stores the objects split from the calendar file by open_cal_split(),
+ * parsed in parallel, in the order of the file */
+static void
+scan_objects (ECalBackendDecsync *cbfile,
+              GMappedFile *mapped_file,
+              GPtrArray *objects)
 {
-	ECalBackendDecsync *cbfile;
 	ECalBackendDecsyncPrivate *priv;
-	const gchar *cache_dir;
-	gchar *filename = NULL;
+	ParsedObject *parsed;
+	guint ii;
 
-	cbfile = E_CAL_BACKEND_DECSYNC (backend);
 	priv = cbfile->priv;
 
-	cache_dir = e_cal_backend_get_cache_dir (backend);
+	parsed = parse_objects (cbfile, g_mapped_file_get_contents (mapped_file), objects);
 
-	filename = g_build_filename (cache_dir, priv->file_name, NULL);
+	/* sorted into the time index at once */
+	e_cal_backend_decsync_intervals_freeze (priv->intervals);
 
-	if (filename != NULL && *filename == '\0') {
-		g_free (filename);
-		filename = NULL;
-	}
+	for (ii = 0; ii < objects->len; ii++) {
+		ECalComponent *comp = parsed[ii].comp;
 
-	return filename;
-}
+		if (!comp) {
+			ECalBackendDecsyncStub *stub = g_ptr_array_index (objects, ii);
 
-static void
-cal_backend_decsync_take_icomp (ECalBackendDecsync *cbfile,
-                                ICalComponent *icomp)
-{
-	ICalProperty *prop;
+			g_warning (G_STRLOC ": Cannot parse object '%s' of '%s'", stub->uid ? stub->uid : "", priv->path);
+			continue;
+		}
 
-	g_warn_if_fail (cbfile->priv->vcalendar == NULL);
-	cbfile->priv->vcalendar = icomp;
+		/* objects without UID are not stored, but they stay in
+		 * the toplevel component, as with scan_vcalendar() */
+		if (!e_cal_component_get_uid (comp)) {
+			i_cal_component_take_component (priv->vcalendar,
+				i_cal_component_clone (e_cal_component_get_icalcomponent (comp)));
+			g_object_unref (comp);
+			continue;
+		}
 
-	prop = ensure_revision (cbfile);
+		check_dup_uid (cbfile, comp);
 
-	e_cal_backend_notify_property_changed (
-		E_CAL_BACKEND (cbfile),
-		E_CAL_BACKEND_PROPERTY_REVISION,
-		i_cal_property_get_x (prop));
+		add_component_full (cbfile, comp, TRUE, &parsed[ii]);
+	}
 
-	g_clear_object (&prop);
+	e_cal_backend_decsync_intervals_thaw (priv->intervals);
+
+	g_free (parsed);
 }
 
-/* Parses an open iCalendar file and loads it into the backend */
+/* Parses an open iCalendar file and loads it into the backend; called
+ * with the lock held for writing */
 static void
 open_cal (ECalBackendDecsync *cbfile,
           const gchar *uristr,
@@ -968,10 +3746,31 @@ open_cal (ECalBackendDecsync *cbfile,
 {
 	ECalBackendDecsyncPrivate *priv;
 	ICalComponent *icomp;
+	GHashTable *stubs = NULL;
+	GMappedFile *mapped_file = NULL, *split_file = NULL;
+	GPtrArray *objects = NULL;
+	GStatBuf st;
+	gchar *path, *index_path;
+	gboolean build_index = FALSE;
 
 	priv = cbfile->priv;
 
-	icomp = e_cal_util_parse_ics_file (uristr);
+	path = uri_to_path (E_CAL_BACKEND (cbfile));
+	index_path = g_strconcat (path, INDEX_SUFFIX, NULL);
+
+	icomp = open_cal_from_index (uristr, index_path, &stubs, &mapped_file);
+	if (!icomp && g_stat (uristr, &st) == 0 && st.st_size >= LAZY_OPEN_THRESHOLD) {
+		icomp = open_cal_lazy (uristr, &stubs, &mapped_file);
+		build_index = TRUE;
+	}
+
+	g_free (index_path);
+	g_free (path);
+
+	if (!icomp)
+		icomp = open_cal_split (uristr, &objects, &split_file);
+	if (!icomp)
+		icomp = e_cal_util_parse_ics_file (uristr);
 	if (!icomp) {
 		g_propagate_error (perror, e_client_error_create_fmt (E_CLIENT_ERROR_OTHER_ERROR, _("Cannot parse ISC file “%s”"), uristr));
 		return;
@@ -988,18 +3787,38 @@ open_cal (ECalBackendDecsync *cbfile,
 		return;
 	}
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
-
 	cal_backend_decsync_take_icomp (cbfile, icomp);
 	priv->path = uri_to_path (E_CAL_BACKEND (cbfile));
+	priv->shards_path = g_strconcat (priv->path, SHARDS_SUFFIX, NULL);
 
 	priv->comp_uid_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, free_object_data);
-	priv->interval_tree = e_intervaltree_new ();
-	scan_vcalendar (cbfile);
+	priv->intervals = e_cal_backend_decsync_intervals_new ();
+	priv->stubs = stubs;
+	priv->stub_index = stubs ? stub_index_new (stubs) : NULL;
+	priv->mapped_file = mapped_file;
+
+	if (objects) {
+		scan_objects (cbfile, split_file, objects);
+		g_ptr_array_unref (objects);
+		g_mapped_file_unref (split_file);
+	} else {
+		scan_vcalendar (cbfile);
+	}
+
+	open_shards (cbfile);
+
+	/* a full write of the file produces the index for the next open */
+	if (build_index) {
+		priv->needs_snapshot = TRUE;
+		if (!priv->compact_idle_id)
+			priv->compact_idle_id = g_idle_add_full (G_PRIORITY_LOW, compact_shards_when_idle, cbfile, NULL);
+	}
 
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	/* what was just loaded is on the disk already */
+	g_hash_table_remove_all (priv->dirty_uids);
 }
 
+/* Called with the lock held for writing */
 static void
 create_cal (ECalBackendDecsync *cbfile,
             const gchar *uristr,
@@ -1021,19 +3840,17 @@ create_cal (ECalBackendDecsync *cbfile,
 
 	g_free (dirname);
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
-
 	/* Create the new calendar information */
 	icomp = e_cal_util_new_top_level ();
 	cal_backend_decsync_take_icomp (cbfile, icomp);
 
 	/* Create our internal data */
 	priv->comp_uid_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, free_object_data);
-	priv->interval_tree = e_intervaltree_new ();
+	priv->intervals = e_cal_backend_decsync_intervals_new ();
 
 	priv->path = uri_to_path (E_CAL_BACKEND (cbfile));
-
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	priv->shards_path = g_strconcat (priv->path, SHARDS_SUFFIX, NULL);
+	priv->needs_snapshot = TRUE;
 
 	save (cbfile, TRUE);
 }
@@ -1065,7 +3882,7 @@ e_cal_backend_decsync_open (ECalBackendSync *backend,
 
 	cbfile = E_CAL_BACKEND_DECSYNC (backend);
 	priv = cbfile->priv;
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
+	g_rw_lock_writer_lock (&priv->lock);
 
 	/* Decsync source is always connected. */
 	e_source_set_connection_status (e_backend_get_source (E_BACKEND (backend)),
@@ -1097,7 +3914,7 @@ e_cal_backend_decsync_open (ECalBackendSync *backend,
 	g_idle_add ((GSourceFunc) ecal_backend_decsync_refresh_start, cbfile);
 
   done:
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	g_rw_lock_writer_unlock (&priv->lock);
 	e_cal_backend_set_writable (E_CAL_BACKEND (backend), writable);
 	e_backend_set_online (E_BACKEND (backend), TRUE);
 
@@ -1105,17 +3922,125 @@ e_cal_backend_decsync_open (ECalBackendSync *backend,
 		g_propagate_error (perror, g_error_copy (err));
 }
 
-static void
-add_detached_recur_to_vcalendar (gpointer key,
-                                 gpointer value,
-                                 gpointer user_data)
+/* e_cal_component_get_as_string(), serializing @comp only the first time
+ * after it changed; called with its component_lock() held */
+static gchar *
+component_dup_string (ECalComponent *comp)
+{
+	gchar *str;
+
+	str = g_object_get_qdata (G_OBJECT (comp), ical_string_quark ());
+	if (!str) {
+		str = e_cal_component_get_as_string (comp);
+		if (!str)
+			return NULL;
+
+		g_object_set_qdata_full (G_OBJECT (comp), ical_string_quark (), str, g_free);
+	}
+
+	return g_strdup (str);
+}
+
+/* e_cal_component_get_as_string() for the readers, see component_lock() */
+static gchar *
+component_get_as_string (ECalBackendDecsync *cbfile,
+                         ECalComponent *comp)
+{
+	GMutex *mutex;
+	gchar *str;
+
+	mutex = component_lock (cbfile, e_cal_component_get_icalcomponent (comp));
+	g_mutex_lock (mutex);
+	str = component_dup_string (comp);
+	g_mutex_unlock (mutex);
+
+	return str;
+}
+
+/* Copies the ICalComponent of @comp, for the readers */
+static ICalComponent *
+component_clone_icalcomponent (ECalBackendDecsync *cbfile,
+                               ECalComponent *comp)
+{
+	ICalComponent *icomp;
+	GMutex *mutex;
+
+	icomp = e_cal_component_get_icalcomponent (comp);
+
+	mutex = component_lock (cbfile, icomp);
+	g_mutex_lock (mutex);
+	icomp = i_cal_component_clone (icomp);
+	g_mutex_unlock (mutex);
+
+	return icomp;
+}
+
+/* Builds the instance of the master @comp at @rid, for the readers */
+static ICalComponent *
+component_construct_instance (ECalBackendDecsync *cbfile,
+                              ECalComponent *comp,
+                              const gchar *rid)
+{
+	ICalComponent *icomp;
+	ICalTime *itt;
+	GMutex *mutex;
+
+	icomp = e_cal_component_get_icalcomponent (comp);
+	itt = i_cal_time_new_from_string (rid);
+
+	mutex = component_lock (cbfile, icomp);
+	g_mutex_lock (mutex);
+	icomp = e_cal_util_construct_instance (icomp, itt);
+	g_mutex_unlock (mutex);
+
+	g_object_unref (itt);
+
+	return icomp;
+}
+
+/* Returns @obj_data as a VCALENDAR with the master object and all its
+ * detached recurrences, for the readers.  It is built only the first time
+ * after any of them changed; readers racing to build it keep the string
+ * of the first one. */
+static gchar *
+get_object_as_string (ECalBackendDecsync *cbfile,
+                      ECalBackendDecsyncObject *obj_data)
 {
-	ECalComponent *recurrence = value;
-	ICalComponent *vcalendar = user_data;
+	ICalComponent *icomp;
+	GHashTableIter iter;
+	gpointer value;
+	gchar *str;
+
+	str = g_atomic_pointer_get (&obj_data->ical_string);
+	if (str)
+		return g_strdup (str);
+
+	icomp = e_cal_util_new_top_level ();
+
+	/* detached recurrences don't have full_object */
+	if (obj_data->full_object)
+		i_cal_component_take_component (
+			icomp,
+			component_clone_icalcomponent (cbfile, obj_data->full_object));
+
+	/* add all detached recurrences */
+	g_hash_table_iter_init (&iter, obj_data->recurrences);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		i_cal_component_take_component (
+			icomp,
+			component_clone_icalcomponent (cbfile, value));
+	}
+
+	str = i_cal_component_as_ical_string (icomp);
+
+	g_object_unref (icomp);
 
-	i_cal_component_take_component (
-		vcalendar,
-		i_cal_component_clone (e_cal_component_get_icalcomponent (recurrence)));
+	if (!g_atomic_pointer_compare_and_exchange (&obj_data->ical_string, NULL, str)) {
+		g_free (str);
+		str = g_atomic_pointer_get (&obj_data->ical_string);
+	}
+
+	return g_strdup (str);
 }
 
 static void
@@ -1146,11 +4071,11 @@ e_cal_backend_decsync_get_ical (ECalBackendSync *backend,
 	g_return_if_fail (uid != NULL);
 	g_return_if_fail (priv->comp_uid_hash != NULL);
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
+	read_lock_uid (cbfile, uid);
 
 	obj_data = g_hash_table_lookup (priv->comp_uid_hash, uid);
 	if (!obj_data) {
-		g_rec_mutex_unlock (&priv->idle_save_rmutex);
+		g_rw_lock_reader_unlock (&priv->lock);
 		g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_OBJECT_NOT_FOUND));
 		return;
 	}
@@ -1160,25 +4085,19 @@ e_cal_backend_decsync_get_ical (ECalBackendSync *backend,
 
 		comp = g_hash_table_lookup (obj_data->recurrences, rid);
 		if (!always_ical && comp) {
-			*object = e_cal_component_get_as_string (comp);
+			*object = component_get_as_string (cbfile, comp);
 		} else {
 			ICalComponent *icomp;
-			ICalTime *itt;
 
 			if (!obj_data->full_object) {
-				g_rec_mutex_unlock (&priv->idle_save_rmutex);
+				g_rw_lock_reader_unlock (&priv->lock);
 				g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_OBJECT_NOT_FOUND));
 				return;
 			}
 
-			itt = i_cal_time_new_from_string (rid);
-			icomp = e_cal_util_construct_instance (
-				e_cal_component_get_icalcomponent (obj_data->full_object),
-				itt);
-			g_object_unref (itt);
-
+			icomp = component_construct_instance (cbfile, obj_data->full_object, rid);
 			if (!icomp) {
-				g_rec_mutex_unlock (&priv->idle_save_rmutex);
+				g_rw_lock_reader_unlock (&priv->lock);
 				g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_OBJECT_NOT_FOUND));
 				return;
 			}
@@ -1189,28 +4108,13 @@ e_cal_backend_decsync_get_ical (ECalBackendSync *backend,
 		}
 	} else {
 		if (always_ical || g_hash_table_size (obj_data->recurrences) > 0) {
-			ICalComponent *icomp;
-
 			/* if we have detached recurrences, return a VCALENDAR */
-			icomp = e_cal_util_new_top_level ();
-
-			/* detached recurrences don't have full_object */
-			if (obj_data->full_object)
-				i_cal_component_add_component (
-					icomp,
-					i_cal_component_clone (e_cal_component_get_icalcomponent (obj_data->full_object)));
-
-			/* add all detached recurrences */
-			g_hash_table_foreach (obj_data->recurrences, (GHFunc) add_detached_recur_to_vcalendar, icomp);
-
-			*object = i_cal_component_as_ical_string (icomp);
-
-			g_object_unref (icomp);
+			*object = get_object_as_string (cbfile, obj_data);
 		} else if (obj_data->full_object)
-			*object = e_cal_component_get_as_string (obj_data->full_object);
+			*object = component_get_as_string (cbfile, obj_data->full_object);
 	}
 
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	g_rw_lock_reader_unlock (&priv->lock);
 }
 /* Get_object_component handler for the decsync backend */
 static void
@@ -1264,28 +4168,202 @@ typedef struct {
 	ECalBackend *backend;
 	EDataCalView *view;
 	gboolean as_string;
+	GPtrArray *matches; /* when set, gets the components which matched */
+
+	/* when set, the query is only the time range below, and components
+	 * in filter if that is set; see prepare_time_range_match() */
+	gboolean by_time_range;
+	time_t range_start;
+	time_t range_end;
+	ICalTimezone *default_zone;
+	GHashTable *filter;
 } MatchObjectData;
 
+static gboolean
+stop_at_instance_cb (ICalComponent *icomp,
+                     ICalTime *instance_start,
+                     ICalTime *instance_end,
+                     gpointer user_data,
+                     GCancellable *cancellable,
+                     GError **error)
+{
+	gboolean *occurs = user_data;
+
+	*occurs = TRUE;
+
+	return FALSE;
+}
+
+/* Returns the instances of the recurring @comp expanded for @default_zone
+ * over a window which includes @start to @end, expanding them first when
+ * they are not, or NULL when the window would be too wide to keep them.
+ * Called with its component_lock() held. */
+static ECalBackendDecsyncInstances *
+component_get_instances (ECalBackendDecsync *cbfile,
+                         ECalComponent *comp,
+                         ICalTimezone *default_zone,
+                         time_t start,
+                         time_t end)
+{
+	ECalBackendDecsyncInstances *instances = NULL;
+	GPtrArray *expanded;
+	gint64 window_start, window_end, now;
+	guint ii;
+
+	if (start == -1 || end == -1 || start > end ||
+	    !e_cal_component_has_recurrences (comp))
+		return NULL;
+
+	expanded = g_object_get_qdata (G_OBJECT (comp), instances_quark ());
+	for (ii = 0; expanded && ii < expanded->len && !instances; ii++) {
+		if (e_cal_backend_decsync_instances_is_for_zone (g_ptr_array_index (expanded, ii), default_zone))
+			instances = g_ptr_array_index (expanded, ii);
+	}
+
+	if (instances && e_cal_backend_decsync_instances_get_window (instances, &window_start, &window_end) &&
+	    window_start <= start && end <= window_end)
+		return instances;
+
+	/* the window around now, extended as far as asked for */
+	now = time (NULL);
+	if (!instances || !e_cal_backend_decsync_instances_get_window (instances, &window_start, &window_end)) {
+		window_start = now - INSTANCES_WINDOW_PAST;
+		window_end = now + INSTANCES_WINDOW_FUTURE;
+	}
+
+	window_start = MIN (window_start, start);
+	window_end = MAX (window_end, end);
+
+	if (window_end - window_start > INSTANCES_MAX_WINDOW)
+		return NULL;
+
+	if (!instances) {
+		if (!expanded) {
+			expanded = g_ptr_array_new_with_free_func ((GDestroyNotify) e_cal_backend_decsync_instances_free);
+			g_object_set_qdata_full (G_OBJECT (comp), instances_quark (), expanded, (GDestroyNotify) g_ptr_array_unref);
+		}
+
+		instances = e_cal_backend_decsync_instances_new (default_zone);
+		g_ptr_array_add (expanded, instances);
+	}
+
+	e_cal_backend_decsync_instances_expand (instances,
+		e_cal_component_get_icalcomponent (comp),
+		window_start, window_end,
+		resolve_query_tzid_cb, cbfile);
+
+	return instances;
+}
+
+/* Whether @comp occurs in the time range of @match_data, as
+ * occur-in-time-range? tells, but without evaluating the query; the
+ * instances of recurring components are expanded once for all queries.
+ * Called with its component_lock() held. */
+static gboolean
+component_occurs_in_range (MatchObjectData *match_data,
+                           ECalComponent *comp)
+{
+	ECalBackendDecsyncInstances *instances;
+	ICalTime *starttt, *endtt;
+	gboolean occurs = FALSE;
+
+	instances = component_get_instances (E_CAL_BACKEND_DECSYNC (match_data->backend), comp,
+		match_data->default_zone, match_data->range_start, match_data->range_end);
+	if (instances && e_cal_backend_decsync_instances_lookup (instances,
+			match_data->range_start, match_data->range_end, NULL, &occurs))
+		return occurs;
+
+	starttt = i_cal_time_new_from_timet_with_zone (match_data->range_start, FALSE, i_cal_timezone_get_utc_timezone ());
+	endtt = i_cal_time_new_from_timet_with_zone (match_data->range_end, FALSE, i_cal_timezone_get_utc_timezone ());
+
+	e_cal_recur_generate_instances_sync (
+		e_cal_component_get_icalcomponent (comp), starttt, endtt,
+		stop_at_instance_cb, &occurs,
+		resolve_query_tzid_cb, match_data->backend,
+		match_data->default_zone,
+		NULL, NULL);
+
+	g_object_unref (starttt);
+	g_object_unref (endtt);
+
+	return occurs;
+}
+
+/* Lets @match_data match by the occurrences of the components alone,
+ * rather than by evaluating the query, when the query is only a time
+ * range, possibly with predicates the query indexes answer exactly.
+ * Called with the lock held for reading. */
+static void
+prepare_time_range_match (ECalBackendDecsync *cbfile,
+                          MatchObjectData *match_data,
+                          time_t occur_start,
+                          time_t occur_end)
+{
+	gchar *zone = NULL;
+
+	if (!match_data->search_needed || occur_start == -1 || occur_end == -1 ||
+	    !e_cal_backend_decsync_query_index_plan_time_range (cbfile->priv->query_index,
+			match_data->query, &zone, &match_data->filter))
+		return;
+
+	match_data->by_time_range = TRUE;
+	match_data->range_start = occur_start;
+	match_data->range_end = occur_end;
+	match_data->default_zone = zone ? resolve_query_tzid_cb (zone, cbfile, NULL, NULL) : NULL;
+	if (!match_data->default_zone)
+		match_data->default_zone = i_cal_timezone_get_utc_timezone ();
+
+	g_free (zone);
+}
+
+/* Adds @comp to the result when it matches; the components are shared
+ * with other readers, thus the result gets strings or copies of them */
+static void
+match_component (MatchObjectData *match_data,
+                 ECalComponent *comp)
+{
+	ECalBackendDecsync *cbfile;
+	GMutex *mutex;
+	gboolean matched;
+
+	cbfile = E_CAL_BACKEND_DECSYNC (match_data->backend);
+
+	mutex = component_lock (cbfile, e_cal_component_get_icalcomponent (comp));
+	g_mutex_lock (mutex);
+
+	if (!match_data->search_needed) {
+		matched = TRUE;
+	} else if (match_data->by_time_range) {
+		matched = (!match_data->filter || g_hash_table_contains (match_data->filter, comp)) &&
+			component_occurs_in_range (match_data, comp);
+	} else {
+		matched = e_cal_backend_sexp_match_comp (match_data->obj_sexp, comp, E_TIMEZONE_CACHE (match_data->backend));
+	}
+
+	if (matched) {
+		if (match_data->as_string)
+			match_data->comps_list = g_slist_prepend (match_data->comps_list, component_dup_string (comp));
+		else
+			match_data->comps_list = g_slist_prepend (match_data->comps_list, e_cal_component_clone (comp));
+
+		if (match_data->matches)
+			g_ptr_array_add (match_data->matches, g_object_ref (comp));
+	}
+
+	g_mutex_unlock (mutex);
+}
+
 static void
 match_object_sexp_to_component (gpointer value,
                                 gpointer data)
 {
 	ECalComponent *comp = value;
 	MatchObjectData *match_data = data;
-	ETimezoneCache *timezone_cache;
 
 	g_return_if_fail (comp != NULL);
 	g_return_if_fail (match_data->backend != NULL);
 
-	timezone_cache = E_TIMEZONE_CACHE (match_data->backend);
-
-	if ((!match_data->search_needed) ||
-	    (e_cal_backend_sexp_match_comp (match_data->obj_sexp, comp, timezone_cache))) {
-		if (match_data->as_string)
-			match_data->comps_list = g_slist_prepend (match_data->comps_list, e_cal_component_get_as_string (comp));
-		else
-			match_data->comps_list = g_slist_prepend (match_data->comps_list, comp);
-	}
+	match_component (match_data, comp);
 }
 
 static void
@@ -1293,19 +4371,7 @@ match_recurrence_sexp (gpointer key,
                        gpointer value,
                        gpointer data)
 {
-	ECalComponent *comp = value;
-	MatchObjectData *match_data = data;
-	ETimezoneCache *timezone_cache;
-
-	timezone_cache = E_TIMEZONE_CACHE (match_data->backend);
-
-	if ((!match_data->search_needed) ||
-	    (e_cal_backend_sexp_match_comp (match_data->obj_sexp, comp, timezone_cache))) {
-		if (match_data->as_string)
-			match_data->comps_list = g_slist_prepend (match_data->comps_list, e_cal_component_get_as_string (comp));
-		else
-			match_data->comps_list = g_slist_prepend (match_data->comps_list, comp);
-	}
+	match_component (data, value);
 }
 
 static void
@@ -1315,21 +4381,9 @@ match_object_sexp (gpointer key,
 {
 	ECalBackendDecsyncObject *obj_data = value;
 	MatchObjectData *match_data = data;
-	ETimezoneCache *timezone_cache;
 
-	timezone_cache = E_TIMEZONE_CACHE (match_data->backend);
-
-	if (obj_data->full_object) {
-		if ((!match_data->search_needed) ||
-		    (e_cal_backend_sexp_match_comp (match_data->obj_sexp,
-						    obj_data->full_object,
-						    timezone_cache))) {
-			if (match_data->as_string)
-				match_data->comps_list = g_slist_prepend (match_data->comps_list, e_cal_component_get_as_string (obj_data->full_object));
-			else
-				match_data->comps_list = g_slist_prepend (match_data->comps_list, obj_data->full_object);
-		}
-	}
+	if (obj_data->full_object)
+		match_component (match_data, obj_data->full_object);
 
 	/* match also recurrences */
 	g_hash_table_foreach (obj_data->recurrences,
@@ -1337,6 +4391,191 @@ match_object_sexp (gpointer key,
 			      match_data);
 }
 
+/* Components matched by a worker of match_components() at a time */
+#define MATCH_CHUNK_SIZE 256
+
+/* The result of a chunk, in reverse like the one of the caller */
+typedef struct {
+	GSList *comps_list;
+	GPtrArray *matches;
+} MatchChunk;
+
+/* A match_components() call the workers of the matcher pool help with;
+ * each worker takes the next chunk not taken yet until none is left */
+typedef struct {
+	gint ref_count;
+	MatchObjectData match_data; /* of the caller */
+	GPtrArray *comps;
+	MatchChunk *chunks;
+	guint n_chunks;
+	gint next_chunk; /* accessed atomically */
+
+	GMutex lock;
+	GCond done_cond;
+	guint n_done;
+} MatchTask;
+
+static void
+match_task_unref (MatchTask *task)
+{
+	if (!g_atomic_int_dec_and_test (&task->ref_count))
+		return;
+
+	g_mutex_clear (&task->lock);
+	g_cond_clear (&task->done_cond);
+	g_free (task->chunks);
+	g_slice_free (MatchTask, task);
+}
+
+/* Matches chunks of @task until none is left.  Evaluating a query is
+ * serialized, thus a worker other than the caller evaluates a query of
+ * its own, made once it got a chunk.  Once the last chunk is done, the
+ * caller goes on, thus then nothing of its @match_data is touched. */
+static void
+match_task_run (MatchTask *task,
+                gboolean is_caller)
+{
+	MatchObjectData match_data = task->match_data;
+	gboolean has_sexp = is_caller;
+	guint ii, jj;
+
+	while ((ii = (guint) g_atomic_int_add (&task->next_chunk, 1)) < task->n_chunks) {
+		if (!has_sexp) {
+			if (match_data.search_needed && !match_data.by_time_range)
+				match_data.obj_sexp = e_cal_backend_sexp_new (match_data.query);
+			if (!match_data.obj_sexp)
+				match_data.obj_sexp = g_object_ref (task->match_data.obj_sexp);
+			has_sexp = TRUE;
+		}
+
+		match_data.comps_list = NULL;
+		match_data.matches = task->match_data.matches ? g_ptr_array_new_with_free_func (g_object_unref) : NULL;
+
+		for (jj = ii * MATCH_CHUNK_SIZE; jj < task->comps->len && jj < (ii + 1) * MATCH_CHUNK_SIZE; jj++)
+			match_component (&match_data, g_ptr_array_index (task->comps, jj));
+
+		task->chunks[ii].comps_list = match_data.comps_list;
+		task->chunks[ii].matches = match_data.matches;
+
+		g_mutex_lock (&task->lock);
+		if (++task->n_done == task->n_chunks)
+			g_cond_signal (&task->done_cond);
+		g_mutex_unlock (&task->lock);
+	}
+
+	if (has_sexp && !is_caller)
+		g_object_unref (match_data.obj_sexp);
+}
+
+/* Runs in a thread of the matcher pool */
+static void
+match_worker_thread (gpointer data,
+                     gpointer user_data)
+{
+	MatchTask *task = data;
+
+	match_task_run (task, FALSE);
+	match_task_unref (task);
+}
+
+/* Matches @comps, in chunks on all processors when there are enough of
+ * them: the caller and up to as many workers of the matcher pool, which
+ * all concurrent readers share.  The result is as if @comps were
+ * matched one by one. */
+static void
+match_components (MatchObjectData *match_data,
+                  GPtrArray *comps)
+{
+	ECalBackendDecsyncPrivate *priv;
+	MatchTask *task;
+	guint n_chunks, n_helpers, ii;
+
+	n_chunks = (comps->len + MATCH_CHUNK_SIZE - 1) / MATCH_CHUNK_SIZE;
+
+	if (n_chunks <= 1) {
+		g_ptr_array_foreach (comps, (GFunc) match_object_sexp_to_component, match_data);
+		return;
+	}
+
+	priv = E_CAL_BACKEND_DECSYNC (match_data->backend)->priv;
+
+	task = g_slice_new0 (MatchTask);
+	task->match_data = *match_data;
+	task->comps = comps;
+	task->chunks = g_new0 (MatchChunk, n_chunks);
+	task->n_chunks = n_chunks;
+	g_mutex_init (&task->lock);
+	g_cond_init (&task->done_cond);
+
+	n_helpers = MIN (n_chunks - 1, (guint) g_thread_pool_get_max_threads (priv->matcher));
+	task->ref_count = n_helpers + 1;
+	for (ii = 0; ii < n_helpers; ii++)
+		g_thread_pool_push (priv->matcher, task, NULL);
+
+	match_task_run (task, TRUE);
+
+	g_mutex_lock (&task->lock);
+	while (task->n_done < task->n_chunks)
+		g_cond_wait (&task->done_cond, &task->lock);
+	g_mutex_unlock (&task->lock);
+
+	for (ii = 0; ii < n_chunks; ii++) {
+		match_data->comps_list = g_slist_concat (task->chunks[ii].comps_list, match_data->comps_list);
+
+		if (match_data->matches) {
+			GPtrArray *matches = task->chunks[ii].matches;
+			guint jj;
+
+			for (jj = 0; jj < matches->len; jj++)
+				g_ptr_array_add (match_data->matches, g_object_ref (g_ptr_array_index (matches, jj)));
+			g_ptr_array_unref (matches);
+		}
+	}
+
+	/* the workers still queued find no chunk left */
+	match_task_unref (task);
+}
+
+static void
+collect_object_components (gpointer key,
+                           gpointer value,
+                           gpointer data)
+{
+	ECalBackendDecsyncObject *obj_data = value;
+	GPtrArray *comps = data;
+	GHashTableIter iter;
+	gpointer comp;
+
+	if (obj_data->full_object)
+		g_ptr_array_add (comps, obj_data->full_object);
+
+	g_hash_table_iter_init (&iter, obj_data->recurrences);
+	while (g_hash_table_iter_next (&iter, NULL, &comp))
+		g_ptr_array_add (comps, comp);
+}
+
+/* Returns the components to match a query which cannot be pruned by
+ * time against; only those which the query indexes leave, or all */
+static GPtrArray *
+find_all_candidates (ECalBackendDecsync *cbfile,
+                     MatchObjectData *match_data)
+{
+	ECalBackendDecsyncPrivate *priv;
+	GPtrArray *candidates = NULL;
+
+	priv = cbfile->priv;
+
+	if (match_data->search_needed)
+		candidates = e_cal_backend_decsync_query_index_plan (priv->query_index, match_data->query);
+
+	if (!candidates) {
+		candidates = g_ptr_array_sized_new (g_hash_table_size (priv->comp_uid_hash));
+		g_hash_table_foreach (priv->comp_uid_hash, collect_object_components, candidates);
+	}
+
+	return candidates;
+}
+
 /* Get_objects_in_range handler for the decsync backend */
 static void
 e_cal_backend_decsync_get_object_list (ECalBackendSync *backend,
@@ -1351,7 +4590,8 @@ e_cal_backend_decsync_get_object_list (ECalBackendSync *backend,
 	MatchObjectData match_data = { 0, };
 	time_t occur_start = -1, occur_end = -1;
 	gboolean prunning_by_time;
-	GList * objs_occuring_in_tw;
+	GPtrArray *candidates;
+	gchar *revision;
 	cbfile = E_CAL_BACKEND_DECSYNC (backend);
 	priv = cbfile->priv;
 
@@ -1372,48 +4612,67 @@ e_cal_backend_decsync_get_object_list (ECalBackendSync *backend,
 		return;
 	}
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
-
 	prunning_by_time = e_cal_backend_sexp_evaluate_occur_times (
 		match_data.obj_sexp,
 		&occur_start,
 		&occur_end);
 
-	objs_occuring_in_tw = NULL;
+	if (prunning_by_time)
+		read_lock_time_range (cbfile, occur_start, occur_end);
+	else
+		read_lock_all (cbfile);
+
+	revision = dup_revision (cbfile);
 
-	if (!prunning_by_time) {
-		g_hash_table_foreach (priv->comp_uid_hash, (GHFunc) match_object_sexp,
-				      &match_data);
+	candidates = e_cal_backend_decsync_results_lookup (priv->query_results, sexp, revision);
+	if (candidates) {
+		/* they matched already */
+		match_data.search_needed = FALSE;
 	} else {
-		objs_occuring_in_tw = e_intervaltree_search (
-			priv->interval_tree,
-			occur_start, occur_end);
+		if (prunning_by_time) {
+			candidates = search_intervaltree (cbfile, occur_start, occur_end);
+			prepare_time_range_match (cbfile, &match_data, occur_start, occur_end);
+		} else {
+			candidates = find_all_candidates (cbfile, &match_data);
+		}
 
-		g_list_foreach (objs_occuring_in_tw, (GFunc) match_object_sexp_to_component,
-			       &match_data);
+		match_data.matches = g_ptr_array_new_with_free_func (g_object_unref);
 	}
 
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	match_components (&match_data, candidates);
+
+	/* still at @revision, the lock was held all along */
+	if (match_data.matches)
+		e_cal_backend_decsync_results_insert (priv->query_results, sexp, revision, match_data.matches);
+
+	g_rw_lock_reader_unlock (&priv->lock);
 
 	*objects = g_slist_reverse (match_data.comps_list);
 
-	if (objs_occuring_in_tw) {
-		g_list_foreach (objs_occuring_in_tw, (GFunc) g_object_unref, NULL);
-		g_list_free (objs_occuring_in_tw);
-	}
+	g_ptr_array_unref (candidates);
+	if (match_data.matches)
+		g_ptr_array_unref (match_data.matches);
+	if (match_data.filter)
+		g_hash_table_destroy (match_data.filter);
+	g_free (revision);
 
 	g_object_unref (match_data.obj_sexp);
 }
 
 static void
-add_attach_uris (GSList **attachment_uris,
+add_attach_uris (ECalBackendDecsync *cbfile,
+                 GSList **attachment_uris,
                  ICalComponent *icomp)
 {
 	ICalProperty *prop;
+	GMutex *mutex;
 
 	g_return_if_fail (attachment_uris != NULL);
 	g_return_if_fail (icomp != NULL);
 
+	mutex = component_lock (cbfile, icomp);
+	g_mutex_lock (mutex);
+
 	for (prop = i_cal_component_get_first_property (icomp, I_CAL_ATTACH_PROPERTY);
 	     prop;
 	     g_object_unref (prop), prop = i_cal_component_get_next_property (icomp, I_CAL_ATTACH_PROPERTY)) {
@@ -1436,17 +4695,8 @@ add_attach_uris (GSList **attachment_uris,
 
 		g_clear_object (&attach);
 	}
-}
-
-static void
-add_detached_recur_attach_uris (gpointer key,
-                                gpointer value,
-                                gpointer user_data)
-{
-	ECalComponent *recurrence = value;
-	GSList **attachment_uris = user_data;
 
-	add_attach_uris (attachment_uris, e_cal_component_get_icalcomponent (recurrence));
+	g_mutex_unlock (mutex);
 }
 
 /* Gets the list of attachments */
@@ -1468,11 +4718,11 @@ e_cal_backend_decsync_get_attachment_uris (ECalBackendSync *backend,
 
 	g_return_if_fail (priv->comp_uid_hash != NULL);
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
+	read_lock_uid (cbfile, uid);
 
 	obj_data = g_hash_table_lookup (priv->comp_uid_hash, uid);
 	if (!obj_data) {
-		g_rec_mutex_unlock (&priv->idle_save_rmutex);
+		g_rw_lock_reader_unlock (&priv->lock);
 		g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_OBJECT_NOT_FOUND));
 		return;
 	}
@@ -1482,50 +4732,57 @@ e_cal_backend_decsync_get_attachment_uris (ECalBackendSync *backend,
 
 		comp = g_hash_table_lookup (obj_data->recurrences, rid);
 		if (comp) {
-			add_attach_uris (attachment_uris, e_cal_component_get_icalcomponent (comp));
+			add_attach_uris (cbfile, attachment_uris, e_cal_component_get_icalcomponent (comp));
 		} else {
 			ICalComponent *icomp;
-			ICalTime *itt;
 
 			if (!obj_data->full_object) {
-				g_rec_mutex_unlock (&priv->idle_save_rmutex);
+				g_rw_lock_reader_unlock (&priv->lock);
 				g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_OBJECT_NOT_FOUND));
 				return;
 			}
 
-			itt = i_cal_time_new_from_string (rid);
-			icomp = e_cal_util_construct_instance (
-				e_cal_component_get_icalcomponent (obj_data->full_object),
-				itt);
-			g_object_unref (itt);
+			icomp = component_construct_instance (cbfile, obj_data->full_object, rid);
 			if (!icomp) {
-				g_rec_mutex_unlock (&priv->idle_save_rmutex);
+				g_rw_lock_reader_unlock (&priv->lock);
 				g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_OBJECT_NOT_FOUND));
 				return;
 			}
 
-			add_attach_uris (attachment_uris, icomp);
+			add_attach_uris (cbfile, attachment_uris, icomp);
 
 			g_object_unref (icomp);
 		}
 	} else {
 		if (g_hash_table_size (obj_data->recurrences) > 0) {
+			GHashTableIter iter;
+			gpointer value;
+
 			/* detached recurrences don't have full_object */
 			if (obj_data->full_object)
-				add_attach_uris (attachment_uris, e_cal_component_get_icalcomponent (obj_data->full_object));
+				add_attach_uris (cbfile, attachment_uris, e_cal_component_get_icalcomponent (obj_data->full_object));
 
 			/* add all detached recurrences */
-			g_hash_table_foreach (obj_data->recurrences, add_detached_recur_attach_uris, attachment_uris);
+			g_hash_table_iter_init (&iter, obj_data->recurrences);
+			while (g_hash_table_iter_next (&iter, NULL, &value))
+				add_attach_uris (cbfile, attachment_uris, e_cal_component_get_icalcomponent (value));
 		} else if (obj_data->full_object)
-			add_attach_uris (attachment_uris, e_cal_component_get_icalcomponent (obj_data->full_object));
+			add_attach_uris (cbfile, attachment_uris, e_cal_component_get_icalcomponent (obj_data->full_object));
 	}
 
 	*attachment_uris = g_slist_reverse (*attachment_uris);
 
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	g_rw_lock_reader_unlock (&priv->lock);
 }
 
-/* get_query handler for the decsync backend */
+/* Components a view is populated with at a time, see start_view() */
+#define VIEW_CHUNK_SIZE 1024
+
+/* get_query handler for the decsync backend.  The components which may
+ * match are looked up first, then matched and sent to the view a chunk at
+ * a time, with the lock released in between: the first of them show up
+ * early, writers are not kept waiting for all of them, and a view which
+ * was stopped meanwhile is not populated any further. */
 static void
 e_cal_backend_decsync_start_view (ECalBackend *backend,
                                EDataCalView *query)
@@ -1536,7 +4793,10 @@ e_cal_backend_decsync_start_view (ECalBackend *backend,
 	MatchObjectData match_data = { 0, };
 	time_t occur_start = -1, occur_end = -1;
 	gboolean prunning_by_time;
-	GList * objs_occuring_in_tw;
+	GPtrArray *candidates, *chunk;
+	gchar *revision;
+	gboolean unchecked = FALSE;
+	guint ii, jj;
 	cbfile = E_CAL_BACKEND_DECSYNC (backend);
 	priv = cbfile->priv;
 
@@ -1567,164 +4827,320 @@ e_cal_backend_decsync_start_view (ECalBackend *backend,
 		&occur_start,
 		&occur_end);
 
-	objs_occuring_in_tw = NULL;
-
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
+	if (prunning_by_time)
+		read_lock_time_range (cbfile, occur_start, occur_end);
+	else
+		read_lock_all (cbfile);
 
-	if (!prunning_by_time) {
-		/* full scan */
-		g_hash_table_foreach (priv->comp_uid_hash, (GHFunc) match_object_sexp,
-				      &match_data);
+	revision = dup_revision (cbfile);
 
-		e_debug_log (
-			FALSE, E_DEBUG_LOG_DOMAIN_CAL_QUERIES,  "---;%p;QUERY-ITEMS;%s;%s;%d", query,
-			e_cal_backend_sexp_text (sexp), G_OBJECT_TYPE_NAME (backend),
-			g_hash_table_size (priv->comp_uid_hash));
+	candidates = e_cal_backend_decsync_results_lookup (priv->query_results, match_data.query, revision);
+	if (candidates) {
+		/* they matched already */
+		unchecked = match_data.search_needed;
+		match_data.search_needed = FALSE;
 	} else {
-		/* matches objects in new "interval tree" way */
-		/* events occuring in time window */
-		objs_occuring_in_tw = e_intervaltree_search (priv->interval_tree, occur_start, occur_end);
+		if (prunning_by_time) {
+			/* matches objects in new "interval tree" way */
+			/* events occuring in time window */
+			candidates = search_intervaltree (cbfile, occur_start, occur_end);
+			prepare_time_range_match (cbfile, &match_data, occur_start, occur_end);
+		} else {
+			/* full scan, unless the query indexes narrow it down */
+			candidates = find_all_candidates (cbfile, &match_data);
+		}
 
-		g_list_foreach (objs_occuring_in_tw, (GFunc) match_object_sexp_to_component,
-			       &match_data);
+		/* keep them around while the lock is released */
+		g_ptr_array_set_free_func (candidates, g_object_unref);
+		for (ii = 0; ii < candidates->len; ii++)
+			g_object_ref (g_ptr_array_index (candidates, ii));
 
-		e_debug_log (
-			FALSE, E_DEBUG_LOG_DOMAIN_CAL_QUERIES,  "---;%p;QUERY-ITEMS;%s;%s;%d", query,
-			e_cal_backend_sexp_text (sexp), G_OBJECT_TYPE_NAME (backend),
-			g_list_length (objs_occuring_in_tw));
+		match_data.matches = g_ptr_array_new_with_free_func (g_object_unref);
 	}
 
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	g_rw_lock_reader_unlock (&priv->lock);
+
+	d (g_message (G_STRLOC ": Query results cached: %u hits, %u misses",
+		e_cal_backend_decsync_results_get_hits (priv->query_results),
+		e_cal_backend_decsync_results_get_misses (priv->query_results)));
+
+	e_debug_log (
+		FALSE, E_DEBUG_LOG_DOMAIN_CAL_QUERIES,  "---;%p;QUERY-ITEMS;%s;%s;%d", query,
+		e_cal_backend_sexp_text (sexp), G_OBJECT_TYPE_NAME (backend),
+		candidates->len);
+
+	chunk = g_ptr_array_sized_new (MIN (candidates->len, VIEW_CHUNK_SIZE));
+
+	for (ii = 0; ii < candidates->len; ii += VIEW_CHUNK_SIZE) {
+		if (e_data_cal_view_is_stopped (query))
+			break;
+
+		g_rw_lock_reader_lock (&priv->lock);
+
+		/* components which matched before may have been changed in place
+		 * meanwhile, thus the rest of them is matched again */
+		if (unchecked) {
+			gchar *current_revision;
 
-	/* notify listeners of all objects */
-	if (match_data.comps_list) {
-		match_data.comps_list = g_slist_reverse (match_data.comps_list);
+			current_revision = dup_revision (cbfile);
+			if (g_strcmp0 (current_revision, revision) != 0) {
+				match_data.search_needed = TRUE;
+				unchecked = FALSE;
+			}
+			g_free (current_revision);
+		}
+
+		/* what was removed meanwhile was already notified as such */
+		g_ptr_array_set_size (chunk, 0);
+		for (jj = ii; jj < candidates->len && jj < ii + VIEW_CHUNK_SIZE; jj++) {
+			ECalComponent *comp = g_ptr_array_index (candidates, jj);
+
+			if (e_cal_backend_decsync_registry_lookup (priv->components, comp))
+				g_ptr_array_add (chunk, comp);
+		}
+
+		match_data.comps_list = NULL;
+		match_components (&match_data, chunk);
+
+		g_rw_lock_reader_unlock (&priv->lock);
+
+		/* notify listeners of the objects */
+		if (match_data.comps_list) {
+			match_data.comps_list = g_slist_reverse (match_data.comps_list);
 
-		e_data_cal_view_notify_components_added (query, match_data.comps_list);
+			e_data_cal_view_notify_components_added (query, match_data.comps_list);
 
-		/* free memory */
-		g_slist_free (match_data.comps_list);
+			/* free memory */
+			g_slist_free_full (match_data.comps_list, g_object_unref);
+		}
+
+		if (jj < candidates->len)
+			e_data_cal_view_notify_progress (query, jj * 100 / candidates->len, NULL);
 	}
 
-	if (objs_occuring_in_tw) {
-		g_list_foreach (objs_occuring_in_tw, (GFunc) g_object_unref, NULL);
-		g_list_free (objs_occuring_in_tw);
+	g_ptr_array_unref (chunk);
+	g_ptr_array_unref (candidates);
+
+	/* the result is only complete when nothing changed meanwhile */
+	if (match_data.matches && !e_data_cal_view_is_stopped (query)) {
+		gchar *current_revision;
+
+		g_rw_lock_reader_lock (&priv->lock);
+
+		/* a reload of the same revision has components of its own */
+		current_revision = dup_revision (cbfile);
+		for (ii = 0; ii < match_data.matches->len; ii++) {
+			if (!e_cal_backend_decsync_registry_lookup (priv->components, g_ptr_array_index (match_data.matches, ii)))
+				break;
+		}
+
+		if (ii == match_data.matches->len && g_strcmp0 (current_revision, revision) == 0)
+			e_cal_backend_decsync_results_insert (priv->query_results, match_data.query, revision, match_data.matches);
+
+		g_rw_lock_reader_unlock (&priv->lock);
+
+		g_free (current_revision);
 	}
 
-	e_data_cal_view_notify_complete (query, NULL /* Success */);
+	if (match_data.matches)
+		g_ptr_array_unref (match_data.matches);
+	if (match_data.filter)
+		g_hash_table_destroy (match_data.filter);
+	g_free (revision);
+
+	if (!e_data_cal_view_is_stopped (query))
+		e_data_cal_view_notify_complete (query, NULL /* Success */);
 }
 
-static gboolean
-free_busy_instance (ICalComponent *icomp,
-                    ICalTime *instance_start,
-                    ICalTime *instance_end,
-                    gpointer user_data,
-                    GCancellable *cancellable,
-                    GError **error)
+static void
+clear_busy_period (gpointer data)
 {
-	ICalComponent *vfb = user_data;
-	ICalProperty *prop;
-	ICalParameter *param;
-	ICalPeriod *ipt;
+	BusyPeriod *period = data;
+
+	g_free (period->summary);
+	g_free (period->location);
+}
+
+static void
+busy_periods_free (BusyPeriods *busy)
+{
+	if (!busy)
+		return;
+
+	g_free (busy->revision);
+	g_array_unref (busy->periods);
+	g_slice_free (BusyPeriods, busy);
+}
+
+static gint
+busy_period_compare (gconstpointer a,
+                     gconstpointer b)
+{
+	const BusyPeriod *period_a = a, *period_b = b;
+
+	if (period_a->start != period_b->start)
+		return period_a->start < period_b->start ? -1 : 1;
+	if (period_a->end != period_b->end)
+		return period_a->end < period_b->end ? -1 : 1;
+
+	return 0;
+}
+
+/* Adds the time from @start to @end, in UTC, as busy because of @icomp */
+static void
+add_busy_period (BusyPeriods *busy,
+                 ICalComponent *icomp,
+                 gint64 start,
+                 gint64 end,
+                 gboolean is_date)
+{
+	BusyPeriod period;
 	const gchar *summary, *location;
 
+	summary = i_cal_component_get_summary (icomp);
+	location = i_cal_component_get_location (icomp);
+
+	period.start = start;
+	period.end = end;
+	period.is_date = is_date;
+	period.summary = summary && *summary ? g_strdup (summary) : NULL;
+	period.location = location && *location ? g_strdup (location) : NULL;
+
+	g_array_append_val (busy->periods, period);
+	busy->max_length = MAX (busy->max_length, end - start);
+}
+
+static gboolean
+busy_period_instance (ICalComponent *icomp,
+                      ICalTime *instance_start,
+                      ICalTime *instance_end,
+                      gpointer user_data,
+                      GCancellable *cancellable,
+                      GError **error)
+{
+	BusyPeriods *busy = user_data;
+
 	if (!i_cal_time_is_date (instance_start))
 		i_cal_time_convert_to_zone_inplace (instance_start, i_cal_timezone_get_utc_timezone ());
 
 	if (!i_cal_time_is_date (instance_end))
 		i_cal_time_convert_to_zone_inplace (instance_end, i_cal_timezone_get_utc_timezone ());
 
-	ipt = i_cal_period_new_null_period ();
-	i_cal_period_set_start (ipt, instance_start);
-	i_cal_period_set_end (ipt, instance_end);
+	add_busy_period (busy, icomp,
+		i_cal_time_as_timet (instance_start),
+		i_cal_time_as_timet (instance_end),
+		i_cal_time_is_date (instance_start));
 
-        /* add busy information to the vfb component */
-	prop = i_cal_property_new (I_CAL_FREEBUSY_PROPERTY);
-	i_cal_property_set_freebusy (prop, ipt);
-	g_object_unref (ipt);
+	return TRUE;
+}
 
-	param = i_cal_parameter_new_fbtype (I_CAL_FBTYPE_BUSY);
-	i_cal_property_take_parameter (prop, param);
+/* Adds the busy periods of @comp between @start and @end from its expanded
+ * instances; FALSE when they cannot tell them.  Called with its
+ * component_lock() held. */
+static gboolean
+add_busy_instances (ECalBackendDecsync *cbfile,
+                    ECalComponent *comp,
+                    BusyPeriods *busy,
+                    gint64 start,
+                    gint64 end)
+{
+	ECalBackendDecsyncInstances *instances;
+	GArray *hits;
+	gboolean occurs = FALSE;
+	guint ii;
 
-	summary = i_cal_component_get_summary (icomp);
-	if (summary && *summary)
-		i_cal_property_set_parameter_from_string (prop, "X-SUMMARY", summary);
-	location = i_cal_component_get_location (icomp);
-	if (location && *location)
-		i_cal_property_set_parameter_from_string (prop, "X-LOCATION", location);
+	instances = component_get_instances (cbfile, comp, i_cal_timezone_get_utc_timezone (), start, end);
+	if (!instances)
+		return FALSE;
+
+	hits = g_array_new (FALSE, FALSE, sizeof (ECalBackendDecsyncInstance));
+
+	if (!e_cal_backend_decsync_instances_lookup (instances, start, end, hits, &occurs)) {
+		g_array_unref (hits);
+		return FALSE;
+	}
+
+	for (ii = 0; ii < hits->len; ii++) {
+		ECalBackendDecsyncInstance *instance = &g_array_index (hits, ECalBackendDecsyncInstance, ii);
+
+		add_busy_period (busy, e_cal_component_get_icalcomponent (comp),
+			instance->start, instance->end, instance->is_date);
+	}
 
-	i_cal_component_take_property (vfb, prop);
+	g_array_unref (hits);
 
 	return TRUE;
 }
 
-static ICalComponent *
-create_user_free_busy (ECalBackendDecsync *cbfile,
-                       const gchar *address,
-                       const gchar *cn,
-                       time_t start,
-                       time_t end,
-                       GCancellable *cancellable)
+/* Whether the busy period of @comp is the span the interval index has for
+ * it: that of a single timed event.  The span of an all-day one is kept in
+ * UTC, not as dates, thus it is expanded like a recurring one. */
+static gboolean
+component_busy_is_span (ECalComponent *comp,
+                        OccurTimes *times)
 {
-	ECalBackendDecsyncPrivate *priv;
-	GList *l;
-	ICalComponent *vfb;
+	ICalTime *dtstart;
+	gboolean is_span;
+
+	if (!times || times->recurs ||
+	    times->start == G_MININT64 || times->end == G_MAXINT64 ||
+	    e_cal_component_get_vtype (comp) != E_CAL_COMPONENT_EVENT)
+		return FALSE;
+
+	dtstart = i_cal_component_get_dtstart (e_cal_component_get_icalcomponent (comp));
+	is_span = dtstart && !i_cal_time_is_null_time (dtstart) && !i_cal_time_is_date (dtstart);
+	g_clear_object (&dtstart);
+
+	return is_span;
+}
+
+/* Collects the busy periods of all instances between @start and @end, of
+ * the components the interval index has for then.  Called with the lock
+ * held for reading. */
+static BusyPeriods *
+collect_busy_periods (ECalBackendDecsync *cbfile,
+                      const gchar *revision,
+                      gint64 start,
+                      gint64 end,
+                      GCancellable *cancellable)
+{
+	BusyPeriods *busy;
 	ICalTimezone *utc_zone;
 	ICalTime *starttt, *endtt;
-	ECalBackendSExp *obj_sexp;
-	gchar *query, *iso_start, *iso_end;
-
-	priv = cbfile->priv;
+	GPtrArray *candidates;
+	guint ii;
 
-	/* create the (unique) VFREEBUSY object that we'll return */
-	vfb = i_cal_component_new_vfreebusy ();
-	if (address != NULL) {
-		ICalProperty *prop;
-		ICalParameter *param;
+	busy = g_slice_new0 (BusyPeriods);
+	busy->revision = g_strdup (revision);
+	busy->start = start;
+	busy->end = end;
+	busy->periods = g_array_new (FALSE, FALSE, sizeof (BusyPeriod));
+	g_array_set_clear_func (busy->periods, clear_busy_period);
 
-		prop = i_cal_property_new_organizer (address);
-		if (prop != NULL && cn != NULL) {
-			param = i_cal_parameter_new_cn (cn);
-			i_cal_property_add_parameter (prop, param);
-		}
-		if (prop != NULL)
-			i_cal_component_take_property (vfb, prop);
-	}
 	utc_zone = i_cal_timezone_get_utc_timezone ();
-
 	starttt = i_cal_time_new_from_timet_with_zone (start, FALSE, utc_zone);
-	i_cal_component_set_dtstart (vfb, starttt);
-
 	endtt = i_cal_time_new_from_timet_with_zone (end, FALSE, utc_zone);
-	i_cal_component_set_dtend (vfb, endtt);
-
-	/* add all objects in the given interval */
-	iso_start = isodate_from_time_t (start);
-	iso_end = isodate_from_time_t (end);
-	query = g_strdup_printf (
-		"occur-in-time-range? (make-time \"%s\") (make-time \"%s\")",
-		iso_start, iso_end);
-	obj_sexp = e_cal_backend_sexp_new (query);
-	g_free (query);
-	g_free (iso_start);
-	g_free (iso_end);
-
-	if (!obj_sexp) {
-		g_clear_object (&starttt);
-		g_clear_object (&endtt);
-		return vfb;
-	}
-
-	for (l = priv->comp; l; l = l->next) {
-		ECalComponent *comp = l->data;
+
+	candidates = search_intervaltree (cbfile, start, end);
+
+	for (ii = 0; ii < candidates->len; ii++) {
+		ECalComponent *comp = g_ptr_array_index (candidates, ii);
 		ICalComponent *icomp, *vcalendar_comp;
 		ICalProperty *prop;
+		OccurTimes *times;
 		ResolveTzidData rtd;
+		GMutex *mutex;
+
+		if (g_cancellable_is_cancelled (cancellable))
+			break;
 
 		icomp = e_cal_component_get_icalcomponent (comp);
 		if (!icomp)
 			continue;
 
+		mutex = component_lock (cbfile, icomp);
+		g_mutex_lock (mutex);
+
 		/* If the event is TRANSPARENT, skip it. */
 		prop = i_cal_component_get_first_property (icomp, I_CAL_TRANSP_PROPERTY);
 		if (prop) {
@@ -1733,33 +5149,211 @@ create_user_free_busy (ECalBackendDecsync *cbfile,
 			g_object_unref (prop);
 
 			if (transp_val == I_CAL_TRANSP_TRANSPARENT ||
-			    transp_val == I_CAL_TRANSP_TRANSPARENTNOCONFLICT)
+			    transp_val == I_CAL_TRANSP_TRANSPARENTNOCONFLICT) {
+				g_mutex_unlock (mutex);
 				continue;
+			}
+		}
+
+		times = g_object_get_qdata (G_OBJECT (comp), occur_times_quark ());
+		if (component_busy_is_span (comp, times)) {
+			add_busy_period (busy, icomp, times->start, times->end, FALSE);
+			g_mutex_unlock (mutex);
+			continue;
 		}
 
-		if (!e_cal_backend_sexp_match_comp (obj_sexp, comp, E_TIMEZONE_CACHE (cbfile)))
+		/* the busy times of a recurring one from its expanded instances */
+		if (add_busy_instances (cbfile, comp, busy, start, end)) {
+			g_mutex_unlock (mutex);
 			continue;
+		}
 
 		vcalendar_comp = i_cal_component_get_parent (icomp);
 
 		resolve_tzid_data_init (&rtd, vcalendar_comp);
 
 		e_cal_recur_generate_instances_sync (
-			e_cal_component_get_icalcomponent (comp), starttt, endtt,
-			free_busy_instance,
-			vfb,
+			icomp, starttt, endtt,
+			busy_period_instance,
+			busy,
 			resolve_tzid_cb,
 			&rtd,
-			i_cal_timezone_get_utc_timezone (),
+			utc_zone,
 			cancellable, NULL);
 
 		resolve_tzid_data_clear (&rtd);
 		g_clear_object (&vcalendar_comp);
+
+		g_mutex_unlock (mutex);
 	}
 
+	g_ptr_array_unref (candidates);
 	g_clear_object (&starttt);
 	g_clear_object (&endtt);
-	g_object_unref (obj_sexp);
+
+	g_array_sort (busy->periods, busy_period_compare);
+
+	return busy;
+}
+
+/* Builds the VFREEBUSY between @start and @end, for no one in particular,
+ * from the periods of @busy which overlap that range */
+static ICalComponent *
+busy_periods_to_free_busy (BusyPeriods *busy,
+                           time_t start,
+                           time_t end)
+{
+	ICalComponent *vfb;
+	ICalTimezone *utc_zone;
+	ICalTime *itt;
+	guint lower, upper, ii;
+
+	/* create the (unique) VFREEBUSY object that we'll return */
+	vfb = i_cal_component_new_vfreebusy ();
+
+	utc_zone = i_cal_timezone_get_utc_timezone ();
+
+	itt = i_cal_time_new_from_timet_with_zone (start, FALSE, utc_zone);
+	i_cal_component_set_dtstart (vfb, itt);
+	g_object_unref (itt);
+
+	itt = i_cal_time_new_from_timet_with_zone (end, FALSE, utc_zone);
+	i_cal_component_set_dtend (vfb, itt);
+	g_object_unref (itt);
+
+	/* none which starts longer than max_length before @start overlaps */
+	lower = 0;
+	upper = busy->periods->len;
+	while (lower < upper) {
+		guint middle = lower + (upper - lower) / 2;
+
+		if (g_array_index (busy->periods, BusyPeriod, middle).start < (gint64) start - busy->max_length)
+			lower = middle + 1;
+		else
+			upper = middle;
+	}
+
+	for (ii = lower; ii < busy->periods->len; ii++) {
+		BusyPeriod *period = &g_array_index (busy->periods, BusyPeriod, ii);
+		ICalProperty *prop;
+		ICalPeriod *ipt;
+
+		if (period->start >= end)
+			break;
+
+		if (period->end <= start && (period->start != period->end || period->start < start))
+			continue;
+
+		ipt = i_cal_period_new_null_period ();
+		itt = i_cal_time_new_from_timet_with_zone (period->start, period->is_date, utc_zone);
+		i_cal_period_set_start (ipt, itt);
+		g_object_unref (itt);
+		itt = i_cal_time_new_from_timet_with_zone (period->end, period->is_date, utc_zone);
+		i_cal_period_set_end (ipt, itt);
+		g_object_unref (itt);
+
+		/* add busy information to the vfb component */
+		prop = i_cal_property_new (I_CAL_FREEBUSY_PROPERTY);
+		i_cal_property_set_freebusy (prop, ipt);
+		g_object_unref (ipt);
+
+		i_cal_property_take_parameter (prop, i_cal_parameter_new_fbtype (I_CAL_FBTYPE_BUSY));
+
+		if (period->summary)
+			i_cal_property_set_parameter_from_string (prop, "X-SUMMARY", period->summary);
+		if (period->location)
+			i_cal_property_set_parameter_from_string (prop, "X-LOCATION", period->location);
+
+		i_cal_component_take_property (vfb, prop);
+	}
+
+	return vfb;
+}
+
+/* Returns the VFREEBUSY of the calendar between @start and @end, for no
+ * one in particular.  It is cut from the busy periods kept for the
+ * revision, which are collected again only for a range they do not
+ * cover: then for this one widened by its length on both sides, together
+ * with what they covered before for the same revision, so that a range
+ * moved a bit is answered from them as well.  Readers use them
+ * concurrently, thus they are only read with free_busy_lock held.  Called
+ * with the lock held for reading. */
+static ICalComponent *
+create_free_busy (ECalBackendDecsync *cbfile,
+                  time_t start,
+                  time_t end,
+                  GCancellable *cancellable)
+{
+	ECalBackendDecsyncPrivate *priv;
+	BusyPeriods *busy;
+	ICalComponent *vfb;
+	gchar *revision;
+	gint64 length, window_start, window_end;
+
+	priv = cbfile->priv;
+
+	revision = dup_revision (cbfile);
+
+	length = MAX ((gint64) end - start, 0);
+	window_start = (gint64) start - length;
+	window_end = (gint64) end + length;
+
+	g_mutex_lock (&priv->free_busy_lock);
+	busy = priv->busy_periods;
+	if (busy && revision && g_strcmp0 (busy->revision, revision) == 0) {
+		if (busy->start <= start && busy->end >= end) {
+			vfb = busy_periods_to_free_busy (busy, start, end);
+			g_mutex_unlock (&priv->free_busy_lock);
+			g_free (revision);
+
+			return vfb;
+		}
+
+		window_start = MIN (window_start, busy->start);
+		window_end = MAX (window_end, busy->end);
+	}
+	g_mutex_unlock (&priv->free_busy_lock);
+
+	busy = collect_busy_periods (cbfile, revision, window_start, window_end, cancellable);
+	vfb = busy_periods_to_free_busy (busy, start, end);
+
+	if (revision && !g_cancellable_is_cancelled (cancellable)) {
+		g_mutex_lock (&priv->free_busy_lock);
+		busy_periods_free (priv->busy_periods);
+		priv->busy_periods = busy;
+		g_mutex_unlock (&priv->free_busy_lock);
+	} else {
+		busy_periods_free (busy);
+	}
+
+	g_free (revision);
+
+	return vfb;
+}
+
+/* Copies @free_busy for the user with @address and @cn */
+static ICalComponent *
+create_user_free_busy (ECalBackendDecsync *cbfile,
+                       ICalComponent *free_busy,
+                       const gchar *address,
+                       const gchar *cn)
+{
+	ICalComponent *vfb;
+
+	vfb = i_cal_component_clone (free_busy);
+
+	if (address != NULL) {
+		ICalProperty *prop;
+		ICalParameter *param;
+
+		prop = i_cal_property_new_organizer (address);
+		if (prop != NULL && cn != NULL) {
+			param = i_cal_parameter_new_cn (cn);
+			i_cal_property_add_parameter (prop, param);
+		}
+		if (prop != NULL)
+			i_cal_component_take_property (vfb, prop);
+	}
 
 	return vfb;
 }
@@ -1779,7 +5373,7 @@ e_cal_backend_decsync_get_free_busy (ECalBackendSync *backend,
 	ECalBackendDecsync *cbfile;
 	ECalBackendDecsyncPrivate *priv;
 	gchar *address, *name;
-	ICalComponent *vfb;
+	ICalComponent *free_busy, *vfb;
 	gchar *calobj;
 	const GSList *l;
 
@@ -1795,15 +5389,18 @@ e_cal_backend_decsync_get_free_busy (ECalBackendSync *backend,
 		return;
 	}
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
+	read_lock_time_range (cbfile, start, end);
 
 	*freebusy = NULL;
 
 	registry = e_cal_backend_get_registry (E_CAL_BACKEND (backend));
 
+	/* the same for each of the users */
+	free_busy = create_free_busy (cbfile, start, end, cancellable);
+
 	if (users == NULL) {
 		if (e_cal_backend_mail_account_get_default (registry, &address, &name)) {
-			vfb = create_user_free_busy (cbfile, address, name, start, end, cancellable);
+			vfb = create_user_free_busy (cbfile, free_busy, address, name);
 			calobj = i_cal_component_as_ical_string (vfb);
 			*freebusy = g_slist_append (*freebusy, calobj);
 			g_object_unref (vfb);
@@ -1814,7 +5411,7 @@ e_cal_backend_decsync_get_free_busy (ECalBackendSync *backend,
 		for (l = users; l != NULL; l = l->next ) {
 			address = l->data;
 			if (e_cal_backend_mail_account_is_valid (registry, address, &name)) {
-				vfb = create_user_free_busy (cbfile, address, name, start, end, cancellable);
+				vfb = create_user_free_busy (cbfile, free_busy, address, name);
 				calobj = i_cal_component_as_ical_string (vfb);
 				*freebusy = g_slist_append (*freebusy, calobj);
 				g_object_unref (vfb);
@@ -1823,7 +5420,9 @@ e_cal_backend_decsync_get_free_busy (ECalBackendSync *backend,
 		}
 	}
 
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	g_object_unref (free_busy);
+
+	g_rw_lock_reader_unlock (&priv->lock);
 }
 
 static void
@@ -1904,7 +5503,7 @@ e_cal_backend_decsync_create_objects_with_decsync (ECalBackendSync *backend,
 
 	*new_components = NULL;
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
+	g_rw_lock_writer_lock (&priv->lock);
 
 	/* First step, parse input strings and do uid verification: may fail */
 	for (l = in_calobjs; l; l = l->next) {
@@ -1915,7 +5514,7 @@ e_cal_backend_decsync_create_objects_with_decsync (ECalBackendSync *backend,
 		icomp = i_cal_parser_parse_string ((gchar *) l->data);
 		if (!icomp) {
 			g_slist_free_full (icomps, g_object_unref);
-			g_rec_mutex_unlock (&priv->idle_save_rmutex);
+			g_rw_lock_writer_unlock (&priv->lock);
 			g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_INVALID_OBJECT));
 			return;
 		}
@@ -1926,7 +5525,7 @@ e_cal_backend_decsync_create_objects_with_decsync (ECalBackendSync *backend,
 		/* Check kind with the parent */
 		if (i_cal_component_isa (icomp) != e_cal_backend_get_kind (E_CAL_BACKEND (backend))) {
 			g_slist_free_full (icomps, g_object_unref);
-			g_rec_mutex_unlock (&priv->idle_save_rmutex);
+			g_rw_lock_writer_unlock (&priv->lock);
 			g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_INVALID_OBJECT));
 			return;
 		}
@@ -1939,7 +5538,7 @@ e_cal_backend_decsync_create_objects_with_decsync (ECalBackendSync *backend,
 			new_uid = e_util_generate_uid ();
 			if (!new_uid) {
 				g_slist_free_full (icomps, g_object_unref);
-				g_rec_mutex_unlock (&priv->idle_save_rmutex);
+				g_rw_lock_writer_unlock (&priv->lock);
 				g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_INVALID_OBJECT));
 				return;
 			}
@@ -1953,7 +5552,7 @@ e_cal_backend_decsync_create_objects_with_decsync (ECalBackendSync *backend,
 		/* check that the object is not in our cache */
 		if (uid_in_use (cbfile, comp_uid)) {
 			g_slist_free_full (icomps, g_object_unref);
-			g_rec_mutex_unlock (&priv->idle_save_rmutex);
+			g_rw_lock_writer_unlock (&priv->lock);
 			g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_OBJECT_ID_ALREADY_EXISTS));
 			return;
 		}
@@ -2004,7 +5603,7 @@ e_cal_backend_decsync_create_objects_with_decsync (ECalBackendSync *backend,
 	/* Save the file */
 	save (cbfile, TRUE);
 
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	g_rw_lock_writer_unlock (&priv->lock);
 
 	if (uids)
 		*uids = g_slist_reverse (*uids);
@@ -2022,6 +5621,7 @@ e_cal_backend_decsync_create_objects_with_decsync (ECalBackendSync *backend,
 			value_json = json_object_new_string (object);
 			value_string = json_object_to_json_string (value_json);
 			decsync_set_entry (priv->decsync, path, 2, key_string, value_string);
+			set_resource_payload (cbfile, path[1], object);
 			json_object_put (value_json);
 
 			g_free (object);
@@ -2073,9 +5673,9 @@ remove_object_instance_cb (gpointer key,
 			i_cal_component_remove_component (
 				rrdata->cbfile->priv->vcalendar,
 				e_cal_component_get_icalcomponent (instance));
-			rrdata->cbfile->priv->comp = g_list_remove (rrdata->cbfile->priv->comp, instance);
+			unregister_component (rrdata->cbfile, instance);
 
-			rrdata->obj_data->recurrences_list = g_list_remove (rrdata->obj_data->recurrences_list, instance);
+			e_cal_backend_decsync_registry_remove (rrdata->obj_data->recurrence_registry, instance);
 
 			return TRUE;
 		}
@@ -2134,7 +5734,7 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 	if (new_components)
 		*new_components = NULL;
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
+	g_rw_lock_writer_lock (&priv->lock);
 
 	/* First step, parse input strings and do uid verification: may fail */
 	for (l = calobjs; l; l = l->next) {
@@ -2145,7 +5745,7 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 		icomp = i_cal_parser_parse_string (l->data);
 		if (!icomp) {
 			g_slist_free_full (icomps, g_object_unref);
-			g_rec_mutex_unlock (&priv->idle_save_rmutex);
+			g_rw_lock_writer_unlock (&priv->lock);
 			g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_INVALID_OBJECT));
 			return;
 		}
@@ -2155,7 +5755,7 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 		/* Check kind with the parent */
 		if (i_cal_component_isa (icomp) != e_cal_backend_get_kind (E_CAL_BACKEND (backend))) {
 			g_slist_free_full (icomps, g_object_unref);
-			g_rec_mutex_unlock (&priv->idle_save_rmutex);
+			g_rw_lock_writer_unlock (&priv->lock);
 			g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_INVALID_OBJECT));
 			return;
 		}
@@ -2164,9 +5764,9 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 		comp_uid = i_cal_component_get_uid (icomp);
 
 		/* Get the object from our cache */
-		if (!g_hash_table_lookup (priv->comp_uid_hash, comp_uid)) {
+		if (!lookup_object (cbfile, comp_uid)) {
 			g_slist_free_full (icomps, g_object_unref);
-			g_rec_mutex_unlock (&priv->idle_save_rmutex);
+			g_rw_lock_writer_unlock (&priv->lock);
 			g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_OBJECT_NOT_FOUND));
 			return;
 		}
@@ -2192,7 +5792,8 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 			continue;
 
 		comp_uid = i_cal_component_get_uid (icomp);
-		obj_data = g_hash_table_lookup (priv->comp_uid_hash, comp_uid);
+		obj_data = lookup_object (cbfile, comp_uid);
+		mark_uid_dirty (cbfile, comp_uid);
 
 		/* Set the last modified time on the component */
 		current = i_cal_time_new_current_with_zone (i_cal_timezone_get_utc_timezone ());
@@ -2214,7 +5815,7 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 					i_cal_component_remove_component (
 						priv->vcalendar,
 						e_cal_component_get_icalcomponent (obj_data->full_object));
-					priv->comp = g_list_remove (priv->comp, obj_data->full_object);
+					unregister_component (cbfile, obj_data->full_object);
 
 					g_object_unref (obj_data->full_object);
 				}
@@ -2233,7 +5834,7 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 				i_cal_component_add_component (
 					priv->vcalendar,
 					e_cal_component_get_icalcomponent (obj_data->full_object));
-				priv->comp = g_list_prepend (priv->comp, obj_data->full_object);
+				register_component (cbfile, obj_data->full_object, TRUE);
 				break;
 			}
 
@@ -2247,8 +5848,8 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 				i_cal_component_remove_component (
 					priv->vcalendar,
 					e_cal_component_get_icalcomponent (recurrence));
-				priv->comp = g_list_remove (priv->comp, recurrence);
-				obj_data->recurrences_list = g_list_remove (obj_data->recurrences_list, recurrence);
+				unregister_component (cbfile, recurrence);
+				e_cal_backend_decsync_registry_remove (obj_data->recurrence_registry, recurrence);
 				g_hash_table_remove (obj_data->recurrences, rid);
 			} else {
 				if (old_components)
@@ -2263,8 +5864,8 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 			i_cal_component_add_component (
 				priv->vcalendar,
 				e_cal_component_get_icalcomponent (comp));
-			priv->comp = g_list_append (priv->comp, comp);
-			obj_data->recurrences_list = g_list_append (obj_data->recurrences_list, comp);
+			register_component (cbfile, comp, FALSE);
+			add_recurrence_to_registry (obj_data, comp);
 			break;
 		case E_CAL_OBJ_MOD_THIS_AND_PRIOR:
 		case E_CAL_OBJ_MOD_THIS_AND_FUTURE:
@@ -2295,7 +5896,8 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 				i_cal_component_remove_component (
 					priv->vcalendar,
 					e_cal_component_get_icalcomponent (obj_data->full_object));
-				priv->comp = g_list_remove (priv->comp, obj_data->full_object);
+				unregister_component (cbfile, obj_data->full_object);
+				unshare_component (cbfile, obj_data->full_object);
 			}
 
 			/* now deal with the detached recurrence */
@@ -2309,8 +5911,8 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 				i_cal_component_remove_component (
 					priv->vcalendar,
 					e_cal_component_get_icalcomponent (recurrence));
-				priv->comp = g_list_remove (priv->comp, recurrence);
-				obj_data->recurrences_list = g_list_remove (obj_data->recurrences_list, recurrence);
+				unregister_component (cbfile, recurrence);
+				e_cal_backend_decsync_registry_remove (obj_data->recurrence_registry, recurrence);
 				g_hash_table_remove (obj_data->recurrences, rid);
 			} else {
 				if (old_components) // TODO: upstream bug (was *old_components)
@@ -2359,7 +5961,7 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 				i_cal_component_add_component (
 					priv->vcalendar,
 					e_cal_component_get_icalcomponent (obj_data->full_object));
-				priv->comp = g_list_prepend (priv->comp, obj_data->full_object);
+				register_component (cbfile, obj_data->full_object, TRUE);
 
 				g_clear_object (&rid_struct);
 				g_clear_object (&master_dtstart);
@@ -2394,11 +5996,11 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 			if (old_components)
 				*old_components = g_slist_prepend (*old_components, obj_data->full_object ? e_cal_component_clone (obj_data->full_object) : NULL);
 
-			if (obj_data->recurrences_list) {
+			if (e_cal_backend_decsync_registry_get_length (obj_data->recurrence_registry)) {
 				/* has detached components, preserve them */
 				GList *ll;
 
-				for (ll = obj_data->recurrences_list; ll; ll = ll->next) {
+				for (ll = e_cal_backend_decsync_registry_peek_head (obj_data->recurrence_registry); ll; ll = ll->next) {
 					detached = g_list_prepend (detached, g_object_ref (ll->data));
 				}
 			}
@@ -2414,7 +6016,7 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 				/* it had some detached components, place them back */
 				comp_uid = i_cal_component_get_uid (e_cal_component_get_icalcomponent (comp));
 
-				if ((obj_data = g_hash_table_lookup (priv->comp_uid_hash, comp_uid)) != NULL) {
+				if ((obj_data = lookup_object (cbfile, comp_uid)) != NULL) {
 					GList *ll;
 
 					for (ll = detached; ll; ll = ll->next) {
@@ -2422,8 +6024,8 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 
 						g_hash_table_insert (obj_data->recurrences, e_cal_component_get_recurid_as_string (c), c);
 						i_cal_component_add_component (priv->vcalendar, e_cal_component_get_icalcomponent (c));
-						priv->comp = g_list_append (priv->comp, c);
-						obj_data->recurrences_list = g_list_append (obj_data->recurrences_list, c);
+						register_component (cbfile, c, FALSE);
+						add_recurrence_to_registry (obj_data, c);
 					}
 				}
 
@@ -2451,7 +6053,7 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 	/* All the components were updated, now we save the file */
 	save (cbfile, TRUE);
 
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	g_rw_lock_writer_unlock (&priv->lock);
 
 	if (old_components)
 		*old_components = g_slist_reverse (*old_components);
@@ -2472,6 +6074,7 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 			value_json = json_object_new_string (object);
 			value_string = json_object_to_json_string (value_json);
 			decsync_set_entry (priv->decsync, path, 2, key_string, value_string);
+			set_resource_payload (cbfile, path[1], object);
 			json_object_put (value_json);
 
 			g_free (object);
@@ -2499,6 +6102,7 @@ e_cal_backend_decsync_modify_objects_with_decsync (ECalBackendSync *backend,
 			value_json = json_object_new_string (object);
 			value_string = json_object_to_json_string (value_json);
 			decsync_set_entry (priv->decsync, path, 2, key_string, value_string);
+			set_resource_payload (cbfile, path[1], object);
 			json_object_put (value_json);
 
 			g_free (object);
@@ -2546,37 +6150,35 @@ e_cal_backend_decsync_discard_alarm_sync (ECalBackendSync *backend,
 	g_return_if_fail (uid != NULL);
 	g_return_if_fail (priv->comp_uid_hash != NULL);
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
+	read_lock_uid (cbfile, uid);
 
 	obj_data = g_hash_table_lookup (priv->comp_uid_hash, uid);
 	if (!obj_data) {
-		g_rec_mutex_unlock (&priv->idle_save_rmutex);
+		g_rw_lock_reader_unlock (&priv->lock);
 		g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_OBJECT_NOT_FOUND));
 		return;
 	}
 
+	/* acknowledged on a copy, the stored object changes only through
+	 * modify_objects(), which takes the lock itself */
 	if (rid && *rid) {
 		comp = g_hash_table_lookup (obj_data->recurrences, rid);
 
 		if (comp) {
-			g_object_ref (comp);
+			comp = e_cal_component_new_from_icalcomponent (component_clone_icalcomponent (cbfile, comp));
 		} else if (obj_data->full_object) {
 			ICalComponent *icomp;
-			ICalTime *itt;
-
-			itt = i_cal_time_new_from_string (rid);
-			icomp = e_cal_util_construct_instance (
-				e_cal_component_get_icalcomponent (obj_data->full_object),
-				itt);
-			g_object_unref (itt);
 
+			icomp = component_construct_instance (cbfile, obj_data->full_object, rid);
 			if (icomp)
 				comp = e_cal_component_new_from_icalcomponent (icomp);
 		}
 	} else if (obj_data->full_object) {
-		comp = g_object_ref (obj_data->full_object);
+		comp = e_cal_component_new_from_icalcomponent (component_clone_icalcomponent (cbfile, obj_data->full_object));
 	}
 
+	g_rw_lock_reader_unlock (&priv->lock);
+
 	if (comp) {
 		if (e_cal_util_set_alarm_acknowledged (comp, auid, 0)) {
 			GSList *calobjs;
@@ -2596,8 +6198,6 @@ e_cal_backend_decsync_discard_alarm_sync (ECalBackendSync *backend,
 	} else {
 		g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_OBJECT_NOT_FOUND));
 	}
-
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
 }
 
 /**
@@ -2631,6 +6231,8 @@ remove_instance (ECalBackendDecsync *cbfile,
 	if (rid && !*rid)
 		rid = NULL;
 
+	mark_uid_dirty (cbfile, uid);
+
 	if (rid) {
 		ICalTime *rid_struct;
 		ResolveTzidData rtd;
@@ -2665,8 +6267,8 @@ remove_instance (ECalBackendDecsync *cbfile,
 			i_cal_component_remove_component (
 				cbfile->priv->vcalendar,
 				e_cal_component_get_icalcomponent (comp));
-			cbfile->priv->comp = g_list_remove (cbfile->priv->comp, comp);
-			obj_data->recurrences_list = g_list_remove (obj_data->recurrences_list, comp);
+			unregister_component (cbfile, comp);
+			e_cal_backend_decsync_registry_remove (obj_data->recurrence_registry, comp);
 			g_hash_table_remove (obj_data->recurrences, rid);
 		} else if (mod == E_CAL_OBJ_MOD_ONLY_THIS) {
 			if (error)
@@ -2677,7 +6279,7 @@ remove_instance (ECalBackendDecsync *cbfile,
 		}
 		/* component empty? */
 		if (!obj_data->full_object) {
-			if (!obj_data->recurrences_list) {
+			if (!e_cal_backend_decsync_registry_get_length (obj_data->recurrence_registry)) {
 				/* empty now, remove it */
 				remove_component (cbfile, uid, obj_data);
 				return NULL;
@@ -2694,7 +6296,8 @@ remove_instance (ECalBackendDecsync *cbfile,
 		i_cal_component_remove_component (
 			cbfile->priv->vcalendar,
 			e_cal_component_get_icalcomponent (obj_data->full_object));
-		cbfile->priv->comp = g_list_remove (cbfile->priv->comp, obj_data->full_object);
+		unregister_component (cbfile, obj_data->full_object);
+		unshare_component (cbfile, obj_data->full_object);
 
 		/* add EXDATE or EXRULE to parent, report as update */
 		if (old_comp) {
@@ -2736,7 +6339,7 @@ remove_instance (ECalBackendDecsync *cbfile,
 		i_cal_component_add_component (
 			cbfile->priv->vcalendar,
 			e_cal_component_get_icalcomponent (obj_data->full_object));
-		cbfile->priv->comp = g_list_prepend (cbfile->priv->comp, obj_data->full_object);
+		register_component (cbfile, obj_data->full_object, TRUE);
 	} else {
 		if (!obj_data->full_object) {
 			/* Nothing to do, parent doesn't exist. Tell
@@ -2756,7 +6359,7 @@ remove_instance (ECalBackendDecsync *cbfile,
 		i_cal_component_remove_component (
 			cbfile->priv->vcalendar,
 			e_cal_component_get_icalcomponent (obj_data->full_object));
-		cbfile->priv->comp = g_list_remove (cbfile->priv->comp, obj_data->full_object);
+		unregister_component (cbfile, obj_data->full_object);
 
 		/* remove parent, report as removal */
 		if (old_comp) {
@@ -2766,7 +6369,7 @@ remove_instance (ECalBackendDecsync *cbfile,
 		obj_data->full_object = NULL;
 
 		/* component may be empty now, check that */
-		if (!obj_data->recurrences_list) {
+		if (!e_cal_backend_decsync_registry_get_length (obj_data->recurrence_registry)) {
 			remove_component (cbfile, uid, obj_data);
 			return NULL;
 		}
@@ -2864,14 +6467,14 @@ e_cal_backend_decsync_remove_objects_with_decsync (ECalBackendSync *backend,
 
 	*old_components = *new_components = NULL;
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
+	g_rw_lock_writer_lock (&priv->lock);
 
 	/* First step, validate the input */
 	for (l = ids; l; l = l->next) {
 		ECalComponentId *id = l->data;
 		/* Make the ID contains a uid */
 		if (!id || !e_cal_component_id_get_uid (id)) {
-			g_rec_mutex_unlock (&priv->idle_save_rmutex);
+			g_rw_lock_writer_unlock (&priv->lock);
 			g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_OBJECT_NOT_FOUND));
 			return;
 		}
@@ -2879,13 +6482,13 @@ e_cal_backend_decsync_remove_objects_with_decsync (ECalBackendSync *backend,
 					 or E_CAL_OBJ_MOD_THIS_AND_FUTURE */
 		if ((mod == E_CAL_OBJ_MOD_THIS_AND_PRIOR || mod == E_CAL_OBJ_MOD_THIS_AND_FUTURE) &&
 			!e_cal_component_id_get_rid (id)) {
-			g_rec_mutex_unlock (&priv->idle_save_rmutex);
+			g_rw_lock_writer_unlock (&priv->lock);
 			g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_OBJECT_NOT_FOUND));
 			return;
 		}
 				/* Make sure the uid exists in the local hash table */
-		if (!g_hash_table_lookup (priv->comp_uid_hash, e_cal_component_id_get_uid (id))) {
-			g_rec_mutex_unlock (&priv->idle_save_rmutex);
+		if (!lookup_object (cbfile, e_cal_component_id_get_uid (id))) {
+			g_rw_lock_writer_unlock (&priv->lock);
 			g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_OBJECT_NOT_FOUND));
 			return;
 		}
@@ -2899,16 +6502,16 @@ e_cal_backend_decsync_remove_objects_with_decsync (ECalBackendSync *backend,
 		ECalBackendDecsyncObject *obj_data;
 		ECalComponentId *id = l->data;
 
-		obj_data = g_hash_table_lookup (priv->comp_uid_hash, e_cal_component_id_get_uid (id));
+		obj_data = lookup_object (cbfile, e_cal_component_id_get_uid (id));
 		recur_id = e_cal_component_id_get_rid (id);
+		mark_uid_dirty (cbfile, e_cal_component_id_get_uid (id));
 
 		switch (mod) {
 		case E_CAL_OBJ_MOD_ALL :
 			*old_components = g_slist_prepend (*old_components, clone_ecalcomp_from_fileobject (obj_data, recur_id));
 			*new_components = g_slist_prepend (*new_components, NULL);
 
-			if (obj_data->recurrences_list)
-				g_list_foreach (obj_data->recurrences_list, notify_comp_removed_cb, cbfile);
+			g_list_foreach (e_cal_backend_decsync_registry_peek_head (obj_data->recurrence_registry), notify_comp_removed_cb, cbfile);
 			remove_component (cbfile, e_cal_component_id_get_uid (id), obj_data);
 			break;
 		case E_CAL_OBJ_MOD_ONLY_THIS:
@@ -2938,7 +6541,8 @@ e_cal_backend_decsync_remove_objects_with_decsync (ECalBackendSync *backend,
 				i_cal_component_remove_component (
 					priv->vcalendar,
 					e_cal_component_get_icalcomponent (comp));
-				priv->comp = g_list_remove (priv->comp, comp);
+				unregister_component (cbfile, comp);
+				unshare_component (cbfile, comp);
 
 				rid_struct = i_cal_time_new_from_string (recur_id);
 				if (!i_cal_time_get_timezone (rid_struct)) {
@@ -2974,7 +6578,7 @@ e_cal_backend_decsync_remove_objects_with_decsync (ECalBackendSync *backend,
 			 * so that it's always before any detached instance we
 			 * might have */
 			if (comp)
-				priv->comp = g_list_prepend (priv->comp, comp);
+				register_component (cbfile, comp, TRUE);
 
 			if (obj_data->full_object) {
 				*new_components = g_slist_prepend (*new_components, e_cal_component_clone (obj_data->full_object));
@@ -2987,7 +6591,7 @@ e_cal_backend_decsync_remove_objects_with_decsync (ECalBackendSync *backend,
 
 	save (cbfile, TRUE);
 
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	g_rw_lock_writer_unlock (&priv->lock);
 
 	*old_components = g_slist_reverse (*old_components);
 	*new_components = g_slist_reverse (*new_components);
@@ -3006,6 +6610,7 @@ e_cal_backend_decsync_remove_objects_with_decsync (ECalBackendSync *backend,
 				value_json = json_object_new_string (object);
 			value_string = json_object_to_json_string (value_json);
 			decsync_set_entry (priv->decsync, path, 2, key_string, value_string);
+			set_resource_payload (cbfile, path[1], object);
 			json_object_put (value_json);
 
 			g_free (object);
@@ -3035,19 +6640,16 @@ cancel_received_object (ECalBackendDecsync *cbfile,
                         ECalComponent **new_comp)
 {
 	ECalBackendDecsyncObject *obj_data;
-	ECalBackendDecsyncPrivate *priv;
 	gchar *rid;
 	const gchar *uid;
 
-	priv = cbfile->priv;
-
 	*old_comp = NULL;
 	*new_comp = NULL;
 
 	uid = e_cal_component_get_uid (comp);
 
 	/* Find the old version of the component. */
-	obj_data = uid ? g_hash_table_lookup (priv->comp_uid_hash, uid) : NULL;
+	obj_data = uid ? lookup_object (cbfile, uid) : NULL;
 	if (!obj_data)
 		return FALSE;
 
@@ -3191,58 +6793,101 @@ masters_uid_cmp (gconstpointer ptr1, gconstpointer ptr2)
 	ICalComponent *icomp1 = (ICalComponent *) ptr1;
 	ICalComponent *icomp2 = (ICalComponent *) ptr2;
 
-	return g_strcmp0 (icomp1 ? i_cal_component_get_uid (icomp1) : NULL,
-	                  icomp2 ? i_cal_component_get_uid (icomp2) : NULL);
+	return g_strcmp0 (icomp1 ? i_cal_component_get_uid (icomp1) : NULL,
+	                  icomp2 ? i_cal_component_get_uid (icomp2) : NULL);
+}
+
+/* A change of a component to announce to the views, queued while the
+ * lock is held and notified once it is released */
+typedef struct {
+	ECalComponentId *id;
+	ECalComponent *old_component;
+	ECalComponent *new_component;
+} PendingChange;
+
+static void
+pending_change_free (gpointer data)
+{
+	PendingChange *change = data;
+
+	if (change->id)
+		e_cal_component_id_free (change->id);
+	g_clear_object (&change->old_component);
+	g_clear_object (&change->new_component);
+
+	g_slice_free (PendingChange, change);
+}
+
+/* Queues a removal when @id is set, otherwise a modification or, without
+ * @old_component, a creation; it takes over all the arguments */
+static void
+queue_change (GQueue *changes,
+              ECalComponentId *id,
+              ECalComponent *old_component,
+              ECalComponent *new_component)
+{
+	PendingChange *change;
+
+	change = g_slice_new (PendingChange);
+	change->id = id;
+	change->old_component = old_component;
+	change->new_component = new_component;
+
+	g_queue_push_tail (changes, change);
+}
+
+/* g_list_foreach() callback queueing the removal of a detached instance */
+static void
+queue_comp_removed_cb (gpointer pecalcomp,
+                       gpointer pchanges)
+{
+	ECalComponent *comp = pecalcomp;
+	ECalComponentId *id;
+
+	id = e_cal_component_get_id (comp);
+	g_return_if_fail (id != NULL);
+
+	queue_change (pchanges, id, g_object_ref (comp), NULL);
 }
 
+/* Notifies the views of the changes in @changes and empties it; called
+ * without the lock held */
 static void
-e_cal_backend_decsync_receive_objects_with_decsync (ECalBackendSync *backend,
-                                                 GCancellable *cancellable,
-                                                 const gchar *calobj,
-                                                 ECalOperationFlags opflags,
-                                                 gboolean update_decsync,
-                                                 GError **error)
+notify_changes (ECalBackend *backend,
+                GQueue *changes)
 {
-	ESourceRegistry *registry;
-	ECalBackendDecsync *cbfile;
-	ECalBackendDecsyncPrivate *priv;
-	ECalClientTzlookupICalCompData *lookup_data = NULL;
-	ICalComponent *toplevel_comp, *icomp = NULL;
-	ICalComponentKind kind;
-	ICalPropertyMethod toplevel_method, method;
-	ICalComponent *subcomp;
-	GSList *comps = NULL, *del_comps = NULL, *link;
-	ECalComponent *comp;
-	ECalBackendDecsyncTzidData tzdata;
-	GError *err = NULL;
-	const gchar *path[2], *key_string, *value_string;
-	json_object *value_json = NULL;
-
-	cbfile = E_CAL_BACKEND_DECSYNC (backend);
-	priv = cbfile->priv;
+	PendingChange *change;
+
+	while ((change = g_queue_pop_head (changes)) != NULL) {
+		if (change->id)
+			e_cal_backend_notify_component_removed (backend,
+				change->id, change->old_component, change->new_component);
+		else if (change->old_component)
+			e_cal_backend_notify_component_modified (backend,
+				change->old_component, change->new_component);
+		else
+			e_cal_backend_notify_component_created (backend, change->new_component);
 
-	if (priv->vcalendar == NULL) {
-		g_set_error_literal (
-			error, E_CAL_CLIENT_ERROR,
-			E_CAL_CLIENT_ERROR_NO_SUCH_CALENDAR,
-			e_cal_client_error_to_string (
-			E_CAL_CLIENT_ERROR_NO_SUCH_CALENDAR));
-		return;
+		pending_change_free (change);
 	}
+}
+
+/* Parses @calobj into a VCALENDAR with a METHOD, wrapping a single
+ * component into one */
+static ICalComponent *
+parse_received_objects (const gchar *calobj,
+                        GError **error)
+{
+	ICalComponent *toplevel_comp, *icomp;
 
 	/* Pull the component from the string and ensure that it is sane */
 	toplevel_comp = i_cal_parser_parse_string (calobj);
 	if (!toplevel_comp) {
 		g_propagate_error (error, ECC_ERROR (E_CAL_CLIENT_ERROR_INVALID_OBJECT));
-		return;
+		return NULL;
 	}
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
-
-	registry = e_cal_backend_get_registry (E_CAL_BACKEND (backend));
-
-	kind = i_cal_component_isa (toplevel_comp);
-	if (kind != I_CAL_VCALENDAR_COMPONENT) {
+	if (i_cal_component_isa (toplevel_comp) != I_CAL_VCALENDAR_COMPONENT) {
 		/* If it is not a VCALENDAR, make it one to simplify below */
 		icomp = toplevel_comp;
 		toplevel_comp = e_cal_util_new_top_level ();
@@ -3250,12 +6895,73 @@ e_cal_backend_decsync_receive_objects_with_decsync (ECalBackendSync *backend,
 			i_cal_component_set_method (toplevel_comp, I_CAL_METHOD_CANCEL);
 		else
 			i_cal_component_set_method (toplevel_comp, I_CAL_METHOD_PUBLISH);
-		i_cal_component_add_component (toplevel_comp, icomp);
+		i_cal_component_take_component (toplevel_comp, icomp);
 	} else {
 		if (!e_cal_util_component_has_property (toplevel_comp, I_CAL_METHOD_PROPERTY))
 			i_cal_component_set_method (toplevel_comp, I_CAL_METHOD_PUBLISH);
 	}
 
+	return toplevel_comp;
+}
+
+/* Returns the TZIDs of the VTIMEZONEs of @toplevel_comp which @vcalendar
+ * does not have yet; called with tz_lock held */
+static GPtrArray *
+collect_new_tzids (ICalComponent *vcalendar,
+                   ICalComponent *toplevel_comp)
+{
+	GPtrArray *tzids;
+	ICalComponent *subcomp;
+
+	tzids = g_ptr_array_new_with_free_func (g_free);
+
+	for (subcomp = i_cal_component_get_first_component (toplevel_comp, I_CAL_VTIMEZONE_COMPONENT);
+	     subcomp;
+	     g_object_unref (subcomp), subcomp = i_cal_component_get_next_component (toplevel_comp, I_CAL_VTIMEZONE_COMPONENT)) {
+		ICalProperty *prop;
+		ICalTimezone *zone = NULL;
+
+		prop = i_cal_component_get_first_property (subcomp, I_CAL_TZID_PROPERTY);
+		if (prop)
+			zone = i_cal_component_get_timezone (vcalendar, i_cal_property_get_tzid (prop));
+
+		if (prop && !zone)
+			g_ptr_array_add (tzids, g_strdup (i_cal_property_get_tzid (prop)));
+
+		g_clear_object (&zone);
+		g_clear_object (&prop);
+	}
+
+	return tzids;
+}
+
+/* Applies the components of @toplevel_comp, as parse_received_objects()
+ * made it, and queues the changes to @changes; the components applied are
+ * returned in @out_comps.  It takes over @toplevel_comp.  Called with the
+ * lock held for writing. */
+static gboolean
+receive_components (ECalBackendDecsync *cbfile,
+                    ICalComponent *toplevel_comp,
+                    GQueue *changes,
+                    GSList **out_comps,
+                    GError **error)
+{
+	ECalBackend *backend = E_CAL_BACKEND (cbfile);
+	ECalBackendDecsyncPrivate *priv = cbfile->priv;
+	ESourceRegistry *registry;
+	ECalClientTzlookupICalCompData *lookup_data = NULL;
+	ICalComponentKind kind;
+	ICalPropertyMethod toplevel_method, method;
+	ICalComponent *subcomp;
+	GSList *comps = NULL, *del_comps = NULL, *link;
+	GPtrArray *new_tzids;
+	ECalComponent *comp;
+	ECalBackendDecsyncTzidData tzdata;
+	GError *err = NULL;
+	guint ii;
+
+	registry = e_cal_backend_get_registry (backend);
+
 	toplevel_method = i_cal_component_get_method (toplevel_comp);
 
 	/* Build a list of timezones so we can make sure all the objects have valid info */
@@ -3273,7 +6979,7 @@ e_cal_backend_decsync_receive_objects_with_decsync (ECalBackendSync *backend,
 	}
 
 	/* First we make sure all the components are usuable */
-	kind = e_cal_backend_get_kind (E_CAL_BACKEND (backend));
+	kind = e_cal_backend_get_kind (backend);
 
 	for (subcomp = i_cal_component_get_first_component (toplevel_comp, I_CAL_ANY_COMPONENT);
 	     subcomp;
@@ -3345,9 +7051,17 @@ e_cal_backend_decsync_receive_objects_with_decsync (ECalBackendSync *backend,
 
 	/* Merge the iCalendar components with our existing VCALENDAR,
 	 * resolving any conflicting TZIDs. It also frees the toplevel_comp. */
+	g_mutex_lock (&priv->tz_lock);
+	new_tzids = collect_new_tzids (priv->vcalendar, toplevel_comp);
 	i_cal_component_merge_component (priv->vcalendar, toplevel_comp);
+	vcalendar_timezones_changed (cbfile);
+	g_mutex_unlock (&priv->tz_lock);
 	g_clear_object (&toplevel_comp);
 
+	for (ii = 0; ii < new_tzids->len; ii++)
+		forget_instances_in_zone (cbfile, g_ptr_array_index (new_tzids, ii));
+	g_ptr_array_unref (new_tzids);
+
 	/* Now we manipulate the components we care about */
 	comps = g_slist_sort (comps, masters_first_cmp);
 
@@ -3409,8 +7123,8 @@ e_cal_backend_decsync_receive_objects_with_decsync (ECalBackendSync *backend,
 
 			/* handle attachments */
 			if (!is_declined && e_cal_component_has_attachments (comp))
-				fetch_attachments (backend, comp);
-			obj_data = g_hash_table_lookup (priv->comp_uid_hash, uid);
+				fetch_attachments (E_CAL_BACKEND_SYNC (cbfile), comp);
+			obj_data = lookup_object (cbfile, uid);
 			if (obj_data) {
 
 				if (rid) {
@@ -3429,30 +7143,22 @@ e_cal_backend_decsync_receive_objects_with_decsync (ECalBackendSync *backend,
 					remove_component (cbfile, uid, obj_data);
 				}
 
-				if (!is_declined)
+				if (!is_declined) {
 					add_component (cbfile, comp, FALSE);
 
-				if (!is_declined)
-					e_cal_backend_notify_component_modified (E_CAL_BACKEND (backend),
-										 old_component, comp);
-				else {
-					ECalComponentId *id = e_cal_component_get_id (comp);
-
-					e_cal_backend_notify_component_removed (E_CAL_BACKEND (backend),
-										id, old_component,
-										rid ? comp : NULL);
+					queue_change (changes, NULL, old_component, g_object_ref (comp));
+				} else {
+					queue_change (changes, e_cal_component_get_id (comp),
+						old_component, rid ? comp : NULL);
 
-					e_cal_component_id_free (id);
-					g_object_unref (comp);
+					if (!rid)
+						g_object_unref (comp);
 				}
 
-				if (old_component)
-					g_object_unref (old_component);
-
 			} else if (!is_declined) {
 				add_component (cbfile, comp, FALSE);
 
-				e_cal_backend_notify_component_created (E_CAL_BACKEND (backend), comp);
+				queue_change (changes, NULL, NULL, g_object_ref (comp));
 			} else {
 				g_object_unref (comp);
 			}
@@ -3479,21 +7185,11 @@ e_cal_backend_decsync_receive_objects_with_decsync (ECalBackendSync *backend,
 			break;
 		case I_CAL_METHOD_CANCEL:
 			if (cancel_received_object (cbfile, comp, mod, &old_component, &new_component)) {
-				ECalComponentId *id;
-
-				id = e_cal_component_get_id (comp);
-
-				e_cal_backend_notify_component_removed (E_CAL_BACKEND (backend),
-									id, old_component, new_component);
+				queue_change (changes, e_cal_component_get_id (comp),
+					old_component, new_component);
 
 				/* remove the component from the toplevel VCALENDAR */
 				i_cal_component_remove_component (priv->vcalendar, subcomp);
-				e_cal_component_id_free (id);
-
-				if (new_component)
-					g_object_unref (new_component);
-				if (old_component)
-					g_object_unref (old_component);
 			}
 			g_object_unref (comp);
 			g_free (rid);
@@ -3506,12 +7202,76 @@ e_cal_backend_decsync_receive_objects_with_decsync (ECalBackendSync *backend,
 		}
 	}
 
-	save (cbfile, TRUE);
+ error:
+	g_clear_object (&toplevel_comp);
+	g_slist_free_full (del_comps, g_object_unref);
 
-	if (update_decsync) {
+	g_hash_table_destroy (tzdata.zones);
+	e_cal_client_tzlookup_icalcomp_data_free (lookup_data);
+
+	if (err) {
+		g_slist_free_full (comps, g_object_unref);
+		g_propagate_error (error, err);
+		return FALSE;
+	}
+
+	if (out_comps)
+		*out_comps = comps;
+	else
+		g_slist_free_full (comps, g_object_unref);
+
+	return TRUE;
+}
+
+static void
+e_cal_backend_decsync_receive_objects_with_decsync (ECalBackendSync *backend,
+                                                 GCancellable *cancellable,
+                                                 const gchar *calobj,
+                                                 ECalOperationFlags opflags,
+                                                 gboolean update_decsync,
+                                                 GError **error)
+{
+	ECalBackendDecsync *cbfile;
+	ECalBackendDecsyncPrivate *priv;
+	ICalComponent *toplevel_comp;
+	GSList *comps = NULL, *link;
+	GQueue changes = G_QUEUE_INIT;
+	gboolean success;
+	const gchar *path[2], *key_string, *value_string;
+	json_object *value_json = NULL;
+
+	cbfile = E_CAL_BACKEND_DECSYNC (backend);
+	priv = cbfile->priv;
+
+	if (priv->vcalendar == NULL) {
+		g_set_error_literal (
+			error, E_CAL_CLIENT_ERROR,
+			E_CAL_CLIENT_ERROR_NO_SUCH_CALENDAR,
+			e_cal_client_error_to_string (
+			E_CAL_CLIENT_ERROR_NO_SUCH_CALENDAR));
+		return;
+	}
+
+	toplevel_comp = parse_received_objects (calobj, error);
+	if (!toplevel_comp)
+		return;
+
+	g_rw_lock_writer_lock (&priv->lock);
+
+	success = receive_components (cbfile, toplevel_comp, &changes, &comps, error);
+	if (success)
+		save (cbfile, TRUE);
+
+	/* e_cal_backend_decsync_get_ical() takes the lock itself */
+	g_rw_lock_writer_unlock (&priv->lock);
+
+	notify_changes (E_CAL_BACKEND (backend), &changes);
+
+	if (success && update_decsync) {
 		const gchar *prev_uid = NULL;
 		comps = g_slist_sort (comps, masters_uid_cmp);
 		for (link = comps; link; link = g_slist_next (link)) {
+			ICalComponent *subcomp;
 			const gchar *uid;
 			gchar *object = NULL;
 
@@ -3527,6 +7287,7 @@ e_cal_backend_decsync_receive_objects_with_decsync (ECalBackendSync *backend,
 					value_json = json_object_new_string (object);
 				value_string = json_object_to_json_string (value_json);
 				decsync_set_entry (priv->decsync, path, 2, key_string, value_string);
+				set_resource_payload (cbfile, uid, object);
 				json_object_put (value_json);
 
 				g_free (object);
@@ -3535,16 +7296,7 @@ e_cal_backend_decsync_receive_objects_with_decsync (ECalBackendSync *backend,
 		}
 	}
 
- error:
-	g_slist_free_full (del_comps, g_object_unref);
 	g_slist_free_full (comps, g_object_unref);
-
-	g_hash_table_destroy (tzdata.zones);
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
-	e_cal_client_tzlookup_icalcomp_data_free (lookup_data);
-
-	if (err)
-		g_propagate_error (error, err);
 }
 
 /* Update_objects handler for the decsync backend. */
@@ -3601,23 +7353,24 @@ cal_backend_decsync_constructed (GObject *object)
 	uid = e_source_get_uid (source);
 	g_return_if_fail (uid != NULL);
 
+	/* backends made for the benchmarks have no registry */
 	switch (kind) {
 		case I_CAL_VEVENT_COMPONENT:
 			component_type = "calendar";
-			builtin_source = e_source_registry_ref_builtin_calendar (registry);
+			builtin_source = registry ? e_source_registry_ref_builtin_calendar (registry) : NULL;
 			break;
 		case I_CAL_VTODO_COMPONENT:
 			component_type = "tasks";
-			builtin_source = e_source_registry_ref_builtin_task_list (registry);
+			builtin_source = registry ? e_source_registry_ref_builtin_task_list (registry) : NULL;
 			break;
 		case I_CAL_VJOURNAL_COMPONENT:
 			component_type = "memos";
-			builtin_source = e_source_registry_ref_builtin_memo_list (registry);
+			builtin_source = registry ? e_source_registry_ref_builtin_memo_list (registry) : NULL;
 			break;
 		default:
 			g_warn_if_reached ();
 			component_type = "calendar";
-			builtin_source = e_source_registry_ref_builtin_calendar (registry);
+			builtin_source = registry ? e_source_registry_ref_builtin_calendar (registry) : NULL;
 			break;
 	}
 
@@ -3627,14 +7380,14 @@ cal_backend_decsync_constructed (GObject *object)
 	 * "system-$COMPONENT" but since the data directories are already
 	 * split out by component, we'll continue to use the old "system"
 	 * directories for these particular data sources. */
-	if (e_source_equal (source, builtin_source))
+	if (builtin_source && e_source_equal (source, builtin_source))
 		uid = "system";
 
 	filename = g_build_filename (user_data_dir, component_type, uid, NULL);
 	e_cal_backend_set_cache_dir (backend, filename);
 	g_free (filename);
 
-	g_object_unref (builtin_source);
+	g_clear_object (&builtin_source);
 }
 
 static void
@@ -3642,20 +7395,29 @@ cal_backend_decsync_add_cached_timezone (ETimezoneCache *cache,
                                       ICalTimezone *zone)
 {
 	ECalBackendDecsyncPrivate *priv;
+	ICalTimezone *existing;
 	const gchar *tzid;
 	gboolean timezone_added = FALSE;
 
 	priv = E_CAL_BACKEND_DECSYNC (cache)->priv;
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
+	g_rw_lock_writer_lock (&priv->lock);
 
 	tzid = i_cal_timezone_get_tzid (zone);
-	if (!i_cal_component_get_timezone (priv->vcalendar, tzid)) {
+	existing = i_cal_component_get_timezone (priv->vcalendar, tzid);
+	if (existing) {
+		g_object_unref (existing);
+	} else {
 		ICalComponent *tz_comp;
 
 		tz_comp = i_cal_timezone_get_component (zone);
 
+		g_mutex_lock (&priv->tz_lock);
 		i_cal_component_take_component (priv->vcalendar, i_cal_component_clone (tz_comp));
+		vcalendar_timezones_changed (E_CAL_BACKEND_DECSYNC (cache));
+		g_mutex_unlock (&priv->tz_lock);
+
+		forget_instances_in_zone (E_CAL_BACKEND_DECSYNC (cache), tzid);
 
 		g_clear_object (&tz_comp);
 
@@ -3663,7 +7425,7 @@ cal_backend_decsync_add_cached_timezone (ETimezoneCache *cache,
 		save (E_CAL_BACKEND_DECSYNC (cache), TRUE);
 	}
 
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	g_rw_lock_writer_unlock (&priv->lock);
 
 	/* Emit the signal outside of the mutex. */
 	if (timezone_added)
@@ -3679,14 +7441,15 @@ cal_backend_decsync_get_cached_timezone (ETimezoneCache *cache,
 
 	priv = E_CAL_BACKEND_DECSYNC (cache)->priv;
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
+	/* called with and without the lock held, from the readers too */
+	g_mutex_lock (&priv->tz_lock);
 	zone = g_hash_table_lookup (priv->cached_timezones, tzid);
-	if (!zone) {
+	if (!zone && priv->vcalendar) {
 		zone = i_cal_component_get_timezone (priv->vcalendar, tzid);
 		if (zone)
 			g_hash_table_insert (priv->cached_timezones, g_strdup (tzid), zone);
 	}
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	g_mutex_unlock (&priv->tz_lock);
 
 	if (zone != NULL)
 		return zone;
@@ -3713,6 +7476,23 @@ cal_backend_decsync_list_cached_timezones (ETimezoneCache *cache)
 
 typedef struct {
 	ECalBackend *backend;
+
+	/* the resources entries of a refresh, staged to be applied at once:
+	 * UID -> its iCalendar string, NULL when removed; the UIDs are also
+	 * in resource_uids, in the order they came in, and parsed holds what
+	 * parseResources() made of them */
+	GHashTable *resources;
+	GPtrArray *resource_uids;
+	GPtrArray *parsed;
+	/* UID -> digest of the resource staged for it */
+	GHashTable *digests;
+
+	/* the info entries of a refresh, applied with the resources, as
+	 * they change the ESource: the last name and color, NULL when
+	 * unchanged, and whether the collection was deleted */
+	gchar *name;
+	gchar *color;
+	gboolean deleted;
 } Extra;
 
 static void
@@ -3772,33 +7552,316 @@ updateColor (Extra *extra, const gchar *color)
 	}
 }
 
-static void
-updateEvent (const gchar *uid, const gchar *ical, Extra *extra)
-{
-	ECalBackendSync *backend;
+/* Stages the resource @uid to be applied, unless it is what was applied
+ * or written for it last, or is staged already */
+static void
+stageResource (Extra *extra, const gchar *uid, const gchar *ical)
+{
+	ECalBackendDecsync *cbfile;
+	const gchar *staged;
+	gchar *digest;
+
+	cbfile = E_CAL_BACKEND_DECSYNC (extra->backend);
+	digest = compute_resource_digest (ical);
+
+	staged = g_hash_table_lookup (extra->digests, uid);
+	if (staged ? g_strcmp0 (staged, digest) == 0 : resource_is_unchanged (cbfile, uid, digest)) {
+		g_atomic_int_inc (&cbfile->priv->resource_skips);
+		g_free (digest);
+		return;
+	}
+
+	if (!g_hash_table_contains (extra->resources, uid))
+		g_ptr_array_add (extra->resource_uids, g_strdup (uid));
+
+	/* a later entry of the same resource replaces an earlier one */
+	g_hash_table_insert (extra->resources, g_strdup (uid), g_strdup (ical));
+	g_hash_table_insert (extra->digests, g_strdup (uid), digest);
+}
+
+/* Removes the object with @uid, received from DecSync as removed; called
+ * with the lock held for writing */
+static void
+removeResource (ECalBackendDecsync *cbfile, const gchar *uid, GQueue *changes)
+{
+	ECalBackendDecsyncObject *obj_data;
+	ECalComponent *old_component;
+
+	obj_data = lookup_object (cbfile, uid);
+	if (!obj_data)
+		return;
+
+	mark_uid_dirty (cbfile, uid);
+
+	old_component = clone_ecalcomp_from_fileobject (obj_data, NULL);
+	g_list_foreach (e_cal_backend_decsync_registry_peek_head (obj_data->recurrence_registry), queue_comp_removed_cb, changes);
+	remove_component (cbfile, uid, obj_data);
+
+	queue_change (changes, e_cal_component_id_new (uid, NULL), old_component, NULL);
+}
+
+/* Replaces the object @uid with the components of @toplevel_comp, as a
+ * resource of DecSync has it, without what receive_components() does for
+ * iTIP: the old master and detached instances are swapped for the new
+ * ones and the views are told precisely which of them were modified,
+ * created or removed.  The time zones not known yet are added; those
+ * which are keep their definition.  Returns FALSE, changing nothing,
+ * when @toplevel_comp holds components of another UID, has a METHOD
+ * other than PUBLISH, or asks for attachments to be
+ * fetched or declined invitations to be dropped; it takes over
+ * @toplevel_comp otherwise.  Called with the lock held for writing. */
+static gboolean
+replaceResource (ECalBackendDecsync *cbfile, const gchar *uid, ICalComponent *toplevel_comp, GQueue *changes)
+{
+	ECalBackendDecsyncPrivate *priv = cbfile->priv;
+	ECalBackendDecsyncObject *obj_data;
+	ESourceRegistry *registry;
+	ICalComponentKind kind;
+	ICalPropertyMethod method;
+	ICalComponent *subcomp;
+	ICalTime *current;
+	GPtrArray *icomps, *zones, *comps;
+	GHashTable *old_comps;
+	GHashTableIter iter;
+	gpointer value;
+	gboolean usable = TRUE;
+	guint ii, pass;
+
+	method = i_cal_component_get_method (toplevel_comp);
+	if (method != I_CAL_METHOD_NONE && method != I_CAL_METHOD_PUBLISH)
+		return FALSE;
+
+	registry = e_cal_backend_get_registry (E_CAL_BACKEND (cbfile));
+	kind = e_cal_backend_get_kind (E_CAL_BACKEND (cbfile));
+
+	icomps = g_ptr_array_new_with_free_func (g_object_unref);
+	zones = g_ptr_array_new_with_free_func (g_object_unref);
+
+	for (subcomp = i_cal_component_get_first_component (toplevel_comp, I_CAL_ANY_COMPONENT);
+	     subcomp && usable;
+	     g_object_unref (subcomp), subcomp = i_cal_component_get_next_component (toplevel_comp, I_CAL_ANY_COMPONENT)) {
+		ICalComponentKind child_kind = i_cal_component_isa (subcomp);
+
+		if (child_kind == I_CAL_VTIMEZONE_COMPONENT)
+			g_ptr_array_add (zones, g_object_ref (subcomp));
+		else if (child_kind != kind)
+			continue;
+		else if (g_strcmp0 (i_cal_component_get_uid (subcomp), uid) != 0 ||
+			 e_cal_util_component_has_property (subcomp, I_CAL_METHOD_PROPERTY) ||
+			 e_cal_util_component_has_property (subcomp, I_CAL_ATTACH_PROPERTY) ||
+			 e_cal_backend_user_declined (registry, subcomp))
+			usable = FALSE;
+		else
+			g_ptr_array_add (icomps, g_object_ref (subcomp));
+	}
+	g_clear_object (&subcomp);
+
+	/* the components, before anything is changed */
+	comps = g_ptr_array_new_with_free_func (g_object_unref);
+	for (ii = 0; ii < icomps->len && usable; ii++) {
+		ECalComponent *comp;
+
+		comp = e_cal_component_new_from_icalcomponent (g_object_ref (g_ptr_array_index (icomps, ii)));
+		if (comp)
+			g_ptr_array_add (comps, comp);
+		else
+			usable = FALSE;
+	}
+
+	if (!usable || !comps->len) {
+		g_ptr_array_unref (comps);
+		g_ptr_array_unref (icomps);
+		g_ptr_array_unref (zones);
+		return FALSE;
+	}
+
+	g_mutex_lock (&priv->tz_lock);
+	for (ii = 0; ii < zones->len; ii++) {
+		ICalComponent *zone_comp = g_ptr_array_index (zones, ii);
+		ICalProperty *prop;
+		ICalTimezone *zone = NULL;
+
+		prop = i_cal_component_get_first_property (zone_comp, I_CAL_TZID_PROPERTY);
+		if (prop)
+			zone = i_cal_component_get_timezone (priv->vcalendar, i_cal_property_get_tzid (prop));
+
+		if (prop && !zone) {
+			i_cal_component_take_component (priv->vcalendar, i_cal_component_clone (zone_comp));
+			forget_instances_in_zone (cbfile, i_cal_property_get_tzid (prop));
+		}
+
+		g_clear_object (&zone);
+		g_clear_object (&prop);
+	}
+	if (zones->len)
+		vcalendar_timezones_changed (cbfile);
+	g_mutex_unlock (&priv->tz_lock);
+
+	/* the old components by RECURRENCE-ID, the master by "" */
+	old_comps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+
+	obj_data = lookup_object (cbfile, uid);
+	if (obj_data) {
+		if (obj_data->full_object)
+			g_hash_table_insert (old_comps, g_strdup (""), g_object_ref (obj_data->full_object));
+
+		g_hash_table_iter_init (&iter, obj_data->recurrences);
+		while (g_hash_table_iter_next (&iter, NULL, &value))
+			g_hash_table_insert (old_comps, e_cal_component_get_recurid_as_string (value), g_object_ref (value));
+
+		/* they are not changed in place afterwards, thus can be
+		 * handed to the views as they are */
+		remove_component (cbfile, uid, obj_data);
+	}
+
+	current = i_cal_time_new_current_with_zone (i_cal_timezone_get_utc_timezone ());
+
+	/* the master first, then the detached instances */
+	for (pass = 0; pass < 2; pass++) {
+		for (ii = 0; ii < comps->len; ii++) {
+			ECalComponent *comp = g_ptr_array_index (comps, ii);
+			ECalComponent *old_component;
+			gchar *rid;
+
+			if (e_cal_component_is_instance (comp) != (pass == 1))
+				continue;
+
+			if (!e_cal_util_component_has_property (g_ptr_array_index (icomps, ii), I_CAL_CREATED_PROPERTY)) {
+				e_cal_component_set_created (comp, current);
+				e_cal_component_set_last_modified (comp, current);
+			} else if (!e_cal_util_component_has_property (g_ptr_array_index (icomps, ii), I_CAL_LASTMODIFIED_PROPERTY)) {
+				e_cal_component_set_last_modified (comp, current);
+			}
+
+			i_cal_component_remove_component (toplevel_comp, g_ptr_array_index (icomps, ii));
+			add_component (cbfile, g_object_ref (comp), TRUE);
+
+			rid = e_cal_component_get_recurid_as_string (comp);
+			if (!rid)
+				rid = g_strdup ("");
+
+			if (g_hash_table_steal_extended (old_comps, rid, NULL, (gpointer *) &old_component))
+				queue_change (changes, NULL, old_component, g_object_ref (comp));
+			else
+				queue_change (changes, NULL, NULL, g_object_ref (comp));
+
+			g_free (rid);
+		}
+	}
+
+	g_object_unref (current);
+
+	/* what is not there anymore */
+	g_hash_table_iter_init (&iter, old_comps);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		queue_change (changes, e_cal_component_get_id (value), value, NULL);
+		g_hash_table_iter_steal (&iter);
+	}
+
+	g_hash_table_destroy (old_comps);
+	g_ptr_array_unref (comps);
+	g_ptr_array_unref (icomps);
+	g_ptr_array_unref (zones);
+	g_object_unref (toplevel_comp);
+
+	return TRUE;
+}
+
+static void
+free_parsed_resource (gpointer data)
+{
+	if (data)
+		g_object_unref (data);
+}
+
+/* Parses the resources staged during a refresh, into extra->parsed: NULL
+ * for removals and what does not parse.  Does not touch the calendar
+ * data, thus it needs no lock. */
+static void
+parseResources (Extra *extra)
+{
+	guint ii;
+
+	extra->parsed = g_ptr_array_new_full (extra->resource_uids->len, free_parsed_resource);
+
+	for (ii = 0; ii < extra->resource_uids->len; ii++) {
+		const gchar *ical;
+		ICalComponent *toplevel_comp = NULL;
+
+		ical = g_hash_table_lookup (extra->resources, g_ptr_array_index (extra->resource_uids, ii));
+		if (ical)
+			toplevel_comp = parse_received_objects (ical, NULL);
+
+		g_ptr_array_add (extra->parsed, toplevel_comp);
+	}
+}
+
+/* Applies the resources staged and parsed during a refresh under one lock,
+ * saves them once and notifies the views of all the changes afterwards */
+static void
+applyResources (Extra *extra)
+{
+	ECalBackendDecsync *cbfile;
+	ECalBackendDecsyncPrivate *priv;
+	GQueue changes = G_QUEUE_INIT;
+	guint ii;
+
+	if (!extra->resource_uids->len)
+		return;
+
+	cbfile = E_CAL_BACKEND_DECSYNC (extra->backend);
+	priv = cbfile->priv;
+
+	if (!priv->vcalendar)
+		return;
+
+	g_rw_lock_writer_lock (&priv->lock);
+
+	e_cal_backend_decsync_intervals_freeze (priv->intervals);
+
+	for (ii = 0; ii < extra->resource_uids->len; ii++) {
+		const gchar *uid = g_ptr_array_index (extra->resource_uids, ii);
+		ICalComponent *toplevel_comp;
+		GError *error = NULL;
+
+		/* receive_components() takes it over */
+		toplevel_comp = g_ptr_array_index (extra->parsed, ii);
+		extra->parsed->pdata[ii] = NULL;
+
+		if (!g_hash_table_lookup (extra->resources, uid)) {
+			removeResource (cbfile, uid, &changes);
+			set_resource_digest (cbfile, uid, g_hash_table_lookup (extra->digests, uid));
+		} else if (toplevel_comp && !replaceResource (cbfile, uid, toplevel_comp, &changes) &&
+			   !receive_components (cbfile, toplevel_comp, &changes, NULL, &error)) {
+			/* may work out later, as when a time zone is missing */
+			g_warning ("Cannot apply resource %s: %s", uid, error->message);
+			g_clear_error (&error);
+		} else {
+			/* what does not parse would not parse again */
+			set_resource_digest (cbfile, uid, g_hash_table_lookup (extra->digests, uid));
+		}
+	}
+
+	e_cal_backend_decsync_intervals_thaw (priv->intervals);
+
+	save (cbfile, TRUE);
 
-	backend = E_CAL_BACKEND_SYNC (extra->backend);
-	e_cal_backend_decsync_receive_objects_with_decsync (backend, NULL, ical, 0, FALSE, NULL);
+	g_rw_lock_writer_unlock (&priv->lock);
+
+	notify_changes (extra->backend, &changes);
 }
 
+/* Applies the info entries staged during a refresh; called in the main
+ * loop, as it changes the ESource */
 static void
-removeEvent (const gchar *uid, Extra *extra)
+applyInfo (Extra *extra)
 {
-	ECalComponentId *id;
-	GSList *ids;
-	GSList *old_components, *new_components;
-
-	id = e_cal_component_id_new (uid, NULL);
-	ids = g_slist_prepend (NULL, id);
-	e_cal_backend_decsync_remove_objects_with_decsync (E_CAL_BACKEND_SYNC (extra->backend), NULL, NULL,
-			ids, E_CAL_OBJ_MOD_ALL, 0, &old_components, &new_components, NULL, FALSE);
-	if (old_components && new_components) {
-		e_cal_backend_notify_component_removed (extra->backend, id, old_components->data, new_components->data);
-		g_slist_free (old_components);
-		g_slist_free (new_components);
-	}
-	e_cal_component_id_free (id);
-	g_slist_free (ids);
+	if (extra->name)
+		updateName (extra, extra->name);
+	if (extra->color)
+		updateColor (extra, extra->color);
+	if (extra->deleted)
+		deleteCal (extra);
 }
 
 static void
@@ -3814,12 +7877,14 @@ infoListener (const gchar **path, int len, const char *datetime, const char *key
 	info = json_object_get_string (key);
 	if (strcmp (info, "deleted") == 0) {
 		if (json_object_get_boolean (value) == TRUE) {
-			deleteCal (extra);
+			extra->deleted = TRUE;
 		}
 	} else if (strcmp (info, "name") == 0) {
-		updateName(extra, json_object_get_string (value));
+		g_free (extra->name);
+		extra->name = g_strdup (json_object_get_string (value));
 	} else if (strcmp (info, "color") == 0) {
-		updateColor(extra, json_object_get_string (value));
+		g_free (extra->color);
+		extra->color = g_strdup (json_object_get_string (value));
 	} else {
 		g_warning ("Unknown info key: %s", info);
 	}
@@ -3840,10 +7905,11 @@ resourcesListener (const gchar **path, int len, const char *datetime, const char
 	}
 	uid = path[0];
 	if (value == NULL) {
-		removeEvent(uid, extra);
+		stageResource(extra, uid, NULL);
 	} else {
 		ical = json_object_get_string (value);
-		updateEvent(uid, ical, extra);
+		stageResource(extra, uid, ical);
+		json_object_put (value);
 	}
 }
 
@@ -3888,15 +7954,113 @@ getDecsyncFromSource (ECalBackendDecsyncPrivate *priv, ECalBackend *backend)
 	return TRUE;
 }
 
-static gboolean
-ecal_backend_decsync_refresh_cb (gpointer backend)
-{
+typedef struct {
 	ECalBackendDecsync *cbfile;
 	Extra extra;
+	/* see refresh_started */
+	guint serial;
+} RefreshJob;
 
-	cbfile = E_CAL_BACKEND_DECSYNC (backend);
-	extra = (Extra) {backend};
-	decsync_execute_all_new_entries (cbfile->priv->decsync, &extra);
+static void
+refresh_job_free (RefreshJob *job)
+{
+	g_hash_table_destroy (job->extra.resources);
+	g_ptr_array_unref (job->extra.resource_uids);
+	g_hash_table_destroy (job->extra.digests);
+	if (job->extra.parsed)
+		g_ptr_array_unref (job->extra.parsed);
+	g_free (job->extra.name);
+	g_free (job->extra.color);
+	g_object_unref (job->cbfile);
+	g_slice_free (RefreshJob, job);
+}
+
+/* Applies what a refresh found, in the main loop, and queues the next
+ * refresh when one was asked for meanwhile */
+static gboolean
+apply_refresh_when_idle (gpointer user_data)
+{
+	RefreshJob *job = user_data;
+	ECalBackendDecsyncPrivate *priv = job->cbfile->priv;
+
+	applyResources (&job->extra);
+	applyInfo (&job->extra);
+
+	d (g_message (G_STRLOC ": Applied %u resources, %u skipped as unchanged so far",
+		job->extra.resource_uids->len,
+		(guint) g_atomic_int_get (&priv->resource_skips)));
+
+	g_mutex_lock (&priv->refresh_lock);
+	priv->refresh_applied = job->serial;
+	g_cond_broadcast (&priv->refresh_cond);
+	g_mutex_unlock (&priv->refresh_lock);
+
+	g_atomic_int_set (&priv->refreshing, 0);
+	if (g_atomic_int_get (&priv->refresh_pending))
+		queue_refresh (job->cbfile);
+
+	refresh_job_free (job);
+
+	return FALSE;
+}
+
+/* Runs in the refresher thread: executes the new DecSync entries, which
+ * only stages the resources, and parses them */
+static void
+refresh_job_thread (gpointer data,
+                    gpointer user_data)
+{
+	RefreshJob *job = data;
+	ECalBackendDecsyncPrivate *priv = job->cbfile->priv;
+
+	g_mutex_lock (&priv->refresh_lock);
+	job->serial = ++priv->refresh_started;
+	g_mutex_unlock (&priv->refresh_lock);
+
+	decsync_execute_all_new_entries (job->cbfile->priv->decsync, &job->extra);
+	parseResources (&job->extra);
+
+	g_idle_add (apply_refresh_when_idle, job);
+}
+
+/* Queues a refresh to the refresher thread.  When one is queued or still
+ * running already, another one is queued once it was applied, as it may
+ * have missed the new entries. */
+static void
+queue_refresh (ECalBackendDecsync *cbfile)
+{
+	ECalBackendDecsyncPrivate *priv;
+	RefreshJob *job;
+
+	priv = cbfile->priv;
+
+	/* set before checking refreshing, thus apply_refresh_when_idle()
+	 * sees it when it clears that one first */
+	g_atomic_int_set (&priv->refresh_pending, 1);
+
+	if (!g_atomic_int_compare_and_exchange (&priv->refreshing, 0, 1))
+		return;
+
+	/* the job runs after the entries it was asked for were written */
+	g_atomic_int_set (&priv->refresh_pending, 0);
+
+	job = g_slice_new0 (RefreshJob);
+	job->cbfile = g_object_ref (cbfile);
+	job->extra.backend = E_CAL_BACKEND (cbfile);
+	job->extra.resources = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	job->extra.resource_uids = g_ptr_array_new_with_free_func (g_free);
+	job->extra.digests = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+	if (!priv->refresher)
+		priv->refresher = g_thread_pool_new (refresh_job_thread, NULL, 1, TRUE, NULL);
+
+	g_thread_pool_push (priv->refresher, job, NULL);
+}
+
+static gboolean
+ecal_backend_decsync_refresh_cb (gpointer backend)
+{
+	queue_refresh (E_CAL_BACKEND_DECSYNC (backend));
 	return TRUE;
 }
 
@@ -3905,7 +8069,8 @@ ecal_backend_decsync_refresh_start (ECalBackendDecsync *cbfile)
 {
 	ESource *source;
 	ESourceRefresh *extension;
-	const gchar *extension_name;
+	ESourceDecsync *decsync_extension;
+	const gchar *extension_name, *sync_type;
 	guint interval_in_minutes = 0;
 
 	source = e_backend_get_source (E_BACKEND (cbfile));
@@ -3919,19 +8084,67 @@ ecal_backend_decsync_refresh_start (ECalBackendDecsync *cbfile)
 			interval_in_minutes = 30;
 	}
 
+	if (cbfile->priv->refresh_timeout_id) {
+		g_source_remove (cbfile->priv->refresh_timeout_id);
+		cbfile->priv->refresh_timeout_id = 0;
+	}
+
 	if (interval_in_minutes > 0) {
-		e_named_timeout_add_seconds (interval_in_minutes * 60, ecal_backend_decsync_refresh_cb, cbfile);
+		cbfile->priv->refresh_timeout_id = e_named_timeout_add_seconds (interval_in_minutes * 60, ecal_backend_decsync_refresh_cb, cbfile);
+
+		switch (e_cal_backend_get_kind (E_CAL_BACKEND (cbfile))) {
+			default:
+			case I_CAL_VEVENT_COMPONENT:
+				sync_type = "calendars";
+				break;
+			case I_CAL_VTODO_COMPONENT:
+				sync_type = "tasks";
+				break;
+			case I_CAL_VJOURNAL_COMPONENT:
+				sync_type = "memos";
+				break;
+		}
+
+		extension_name = E_SOURCE_EXTENSION_DECSYNC_BACKEND;
+		decsync_extension = e_source_get_extension (source, extension_name);
+		if (!cbfile->priv->monitor)
+			cbfile->priv->monitor = decsync_monitor_new (
+				e_source_decsync_get_decsync_dir (decsync_extension), sync_type,
+				e_source_decsync_get_collection (decsync_extension),
+				e_source_decsync_get_appid (decsync_extension),
+				ecal_backend_decsync_refresh_cb, cbfile);
 	}
 	return FALSE;
 }
 
+/* Refreshes and waits until the changes of the new entries are applied,
+ * thus visible when it returns; this runs in a thread of its own, the
+ * changes are applied in the main loop */
 static void
 ecal_backend_decsync_refresh_sync (ECalBackendSync *backend,
                                  EDataCal *cal,
                                  GCancellable *cancellable,
                                  GError **error)
 {
-	ecal_backend_decsync_refresh_cb (backend);
+	ECalBackendDecsyncPrivate *priv;
+	guint serial;
+
+	priv = E_CAL_BACKEND_DECSYNC (backend)->priv;
+
+	/* any refresh started from now on sees the new entries */
+	g_mutex_lock (&priv->refresh_lock);
+	serial = priv->refresh_started + 1;
+	g_mutex_unlock (&priv->refresh_lock);
+
+	queue_refresh (E_CAL_BACKEND_DECSYNC (backend));
+
+	g_mutex_lock (&priv->refresh_lock);
+	while ((gint) (priv->refresh_applied - serial) < 0 &&
+	       !g_cancellable_set_error_if_cancelled (cancellable, error)) {
+		g_cond_wait_until (&priv->refresh_cond, &priv->refresh_lock,
+			g_get_monotonic_time () + G_TIME_SPAN_SECOND);
+	}
+	g_mutex_unlock (&priv->refresh_lock);
 }
 
 static gboolean
@@ -4001,13 +8214,29 @@ e_cal_backend_decsync_initable_init (GInitableIface *iface)
 static void
 e_cal_backend_decsync_init (ECalBackendDecsync *cbfile)
 {
+	gint ii;
+
 	cbfile->priv = e_cal_backend_decsync_get_instance_private (cbfile);
 
 	cbfile->priv->file_name = g_strdup ("calendar.ics");
 
-	g_rec_mutex_init (&cbfile->priv->idle_save_rmutex);
+	g_rw_lock_init (&cbfile->priv->lock);
+	g_mutex_init (&cbfile->priv->tz_lock);
+	g_mutex_init (&cbfile->priv->free_busy_lock);
+	g_mutex_init (&cbfile->priv->digests_lock);
+	g_mutex_init (&cbfile->priv->refresh_lock);
+	g_cond_init (&cbfile->priv->refresh_cond);
+	for (ii = 0; ii < N_COMPONENT_LOCKS; ii++)
+		g_mutex_init (&cbfile->priv->component_locks[ii]);
 
 	cbfile->priv->cached_timezones = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+	cbfile->priv->dirty_uids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	cbfile->priv->digests = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	cbfile->priv->manifest = g_key_file_new ();
+	cbfile->priv->components = e_cal_backend_decsync_registry_new ();
+	cbfile->priv->query_index = e_cal_backend_decsync_query_index_new ();
+	cbfile->priv->query_results = e_cal_backend_decsync_results_new (N_CACHED_RESULTS);
+	cbfile->priv->matcher = g_thread_pool_new (match_worker_thread, NULL, MAX (1, (gint) g_get_num_processors () - 1), FALSE, NULL);
 }
 
 void
@@ -4021,14 +8250,14 @@ e_cal_backend_decsync_set_file_name (ECalBackendDecsync *cbfile,
 	g_return_if_fail (file_name != NULL);
 
 	priv = cbfile->priv;
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
+	g_rw_lock_writer_lock (&priv->lock);
 
 	if (priv->file_name)
 		g_free (priv->file_name);
 
 	priv->file_name = g_strdup (file_name);
 
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	g_rw_lock_writer_unlock (&priv->lock);
 }
 
 const gchar *
@@ -4069,7 +8298,7 @@ test_query_by_scanning_all_objects (ECalBackendDecsync *cbfile,
 	if (!match_data.obj_sexp)
 		return;
 
-	g_rec_mutex_lock (&priv->idle_save_rmutex);
+	read_lock_all (cbfile);
 
 	if (!match_data.obj_sexp)
 	{
@@ -4080,7 +8309,7 @@ test_query_by_scanning_all_objects (ECalBackendDecsync *cbfile,
 	g_hash_table_foreach (priv->comp_uid_hash, (GHFunc) match_object_sexp,
 			&match_data);
 
-	g_rec_mutex_unlock (&priv->idle_save_rmutex);
+	g_rw_lock_reader_unlock (&priv->lock);
 
 	*objects = g_slist_reverse (match_data.comps_list);
 
@@ -4354,3 +8583,458 @@ err0:
 	return 0;
 }
 #endif
+
+#if defined (BENCH_READ_SCALING) || defined (BENCH_MASS_DELETE) || defined (BENCH_SAVE_MEMORY)
+
+/* Writes a calendar with @n_events hourly events from 2020, every 50th of
+ * them weekly recurring, as "calendar.ics" of a new temporary directory,
+ * and returns the directory */
+static gchar *
+bench_generate_calendar (gint n_events)
+{
+	GDateTime *base;
+	GString *data;
+	gchar *dir, *path;
+	gint ii;
+
+	data = g_string_new ("BEGIN:VCALENDAR\r\nPRODID:-//decsync//bench//EN\r\nVERSION:2.0\r\n");
+	base = g_date_time_new_utc (2020, 1, 1, 0, 0, 0);
+
+	for (ii = 0; ii < n_events; ii++) {
+		GDateTime *start, *end;
+		gchar *dtstart, *dtend;
+
+		start = g_date_time_add_hours (base, ii);
+		end = g_date_time_add_hours (start, 1);
+		dtstart = g_date_time_format (start, "%Y%m%dT%H%M%SZ");
+		dtend = g_date_time_format (end, "%Y%m%dT%H%M%SZ");
+
+		g_string_append_printf (data,
+			"BEGIN:VEVENT\r\n"
+			"UID:bench-%d\r\n"
+			"DTSTAMP:20200101T000000Z\r\n"
+			"DTSTART:%s\r\n"
+			"DTEND:%s\r\n"
+			"SUMMARY:Event %d\r\n"
+			"%s"
+			"END:VEVENT\r\n",
+			ii, dtstart, dtend, ii,
+			(ii % 50) == 0 ? "RRULE:FREQ=WEEKLY;COUNT=52\r\n" : "");
+
+		g_free (dtstart);
+		g_free (dtend);
+		g_date_time_unref (start);
+		g_date_time_unref (end);
+	}
+
+	g_string_append (data, "END:VCALENDAR\r\n");
+	g_date_time_unref (base);
+
+	dir = g_dir_make_tmp ("decsync-bench-XXXXXX", NULL);
+	if (!dir) {
+		g_message (G_STRLOC " Could not create a temporary directory");
+		exit (-1);
+	}
+
+	path = g_build_filename (dir, "calendar.ics", NULL);
+	if (!g_file_set_contents (path, data->str, data->len, NULL)) {
+		g_message (G_STRLOC " Could not write calendar %s", path);
+		exit (-1);
+	}
+
+	g_string_free (data, TRUE);
+	g_free (path);
+
+	return dir;
+}
+
+/* Removes @dir, as made by bench_generate_calendar(), with everything the
+ * backend wrote into it */
+static void
+bench_remove_dir (const gchar *dir)
+{
+	GDir *gdir;
+	const gchar *name;
+
+	gdir = g_dir_open (dir, 0, NULL);
+	while (gdir && (name = g_dir_read_name (gdir))) {
+		gchar *path;
+
+		path = g_build_filename (dir, name, NULL);
+		if (g_file_test (path, G_FILE_TEST_IS_DIR))
+			bench_remove_dir (path);
+		else
+			g_unlink (path);
+		g_free (path);
+	}
+
+	if (gdir)
+		g_dir_close (gdir);
+	g_rmdir (dir);
+}
+
+/* Makes an event backend on a standalone source, without a registry, with
+ * @dir as its cache directory, and opens "calendar.ics" there; the lock
+ * is held for writing on return when @keep_locked is set */
+static ECalBackendDecsync *
+bench_open_backend (const gchar *dir,
+                    gboolean keep_locked)
+{
+	ECalBackendDecsync *cbfile;
+	ESource *source;
+	GError *error = NULL;
+	gchar *path;
+
+	source = e_source_new (NULL, NULL, &error);
+	if (!source) {
+		g_message (G_STRLOC " Could not create a source: %s", error->message);
+		exit (-1);
+	}
+
+	cbfile = g_object_new (E_TYPE_CAL_BACKEND_DECSYNC,
+		"kind", I_CAL_VEVENT_COMPONENT,
+		"source", source,
+		NULL);
+	g_object_unref (source);
+
+	/* the calendar file is looked for in the cache directory */
+	e_cal_backend_set_cache_dir (E_CAL_BACKEND (cbfile), dir);
+	path = uri_to_path (E_CAL_BACKEND (cbfile));
+
+	g_rw_lock_writer_lock (&cbfile->priv->lock);
+
+	open_cal (cbfile, path, &error);
+	if (error != NULL) {
+		g_message (G_STRLOC " Could not open calendar %s: %s", path, error->message);
+		exit (-1);
+	}
+
+	if (!keep_locked)
+		g_rw_lock_writer_unlock (&cbfile->priv->lock);
+
+	g_free (path);
+
+	return cbfile;
+}
+
+#endif
+
+#ifdef BENCH_READ_SCALING
+
+/* Contention benchmark: runs time-range queries from 1, 2, 4, ... threads
+ * at once, up to the number of processors, and reports how the throughput
+ * scales with them.  Every query is for another week, so that none is
+ * answered from the cache of query results. */
+
+static gint bench_events = 20000;
+static gint bench_queries = 200;
+
+static GOptionEntry bench_entries[] =
+{
+  { "events", 'n', 0, G_OPTION_ARG_INT, &bench_events, "Number of events in the generated calendar", NULL },
+  { "queries", 'q', 0, G_OPTION_ARG_INT, &bench_queries, "Queries run by each thread", NULL },
+  { NULL }
+};
+
+typedef struct {
+	ECalBackendDecsync *cbfile;
+	gint first_query;
+	gint n_queries;
+} BenchReader;
+
+static gpointer
+bench_reader_thread (gpointer data)
+{
+	BenchReader *reader = data;
+	GDateTime *base;
+	gint ii;
+
+	base = g_date_time_new_utc (2020, 1, 1, 0, 0, 0);
+
+	for (ii = 0; ii < reader->n_queries; ii++) {
+		GDateTime *start, *end;
+		GSList *objects = NULL;
+		gchar *start_str, *end_str, *sexp;
+		gint query = reader->first_query + ii;
+
+		/* at the hour of another event each, then a minute later */
+		start = g_date_time_add_minutes (base, (query % bench_events) * 60 + query / bench_events);
+		end = g_date_time_add_weeks (start, 1);
+		start_str = g_date_time_format (start, "%Y%m%dT%H%M%SZ");
+		end_str = g_date_time_format (end, "%Y%m%dT%H%M%SZ");
+		sexp = g_strdup_printf ("(occur-in-time-range? (make-time \"%s\") (make-time \"%s\"))", start_str, end_str);
+
+		e_cal_backend_decsync_get_object_list (E_CAL_BACKEND_SYNC (reader->cbfile), NULL, NULL,
+			sexp, &objects, NULL);
+
+		g_slist_free_full (objects, g_free);
+		g_free (sexp);
+		g_free (start_str);
+		g_free (end_str);
+		g_date_time_unref (start);
+		g_date_time_unref (end);
+	}
+
+	g_date_time_unref (base);
+
+	return NULL;
+}
+
+gint
+main (gint argc,
+      gchar **argv)
+{
+	ECalBackendDecsync *cbfile;
+	GOptionContext *context;
+	GError *error = NULL;
+	BenchReader *readers;
+	gchar *dir;
+	gdouble single = 0;
+	guint n_threads, max_threads;
+	gint next_query = 0;
+
+	context = g_option_context_new ("- read scaling benchmark for the decsync calendar backend");
+	g_option_context_add_main_entries (context, bench_entries, GETTEXT_PACKAGE);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_print ("option parsing failed: %s\n", error->message);
+		exit (1);
+	}
+
+	bench_events = MAX (bench_events, 1);
+
+	dir = bench_generate_calendar (bench_events);
+	cbfile = bench_open_backend (dir, FALSE);
+
+	max_threads = g_get_num_processors ();
+	readers = g_new0 (BenchReader, max_threads);
+
+	for (n_threads = 1; ; n_threads = MIN (n_threads * 2, max_threads)) {
+		GThread **threads;
+		gint64 started;
+		gdouble rate;
+		guint ii;
+
+		threads = g_new (GThread *, n_threads);
+		started = g_get_monotonic_time ();
+
+		for (ii = 0; ii < n_threads; ii++) {
+			readers[ii].cbfile = cbfile;
+			readers[ii].first_query = next_query;
+			readers[ii].n_queries = bench_queries;
+			next_query += bench_queries;
+
+			threads[ii] = g_thread_new ("bench-reader", bench_reader_thread, &readers[ii]);
+		}
+		for (ii = 0; ii < n_threads; ii++)
+			g_thread_join (threads[ii]);
+
+		rate = (gdouble) n_threads * bench_queries * G_USEC_PER_SEC / (g_get_monotonic_time () - started);
+		if (n_threads == 1)
+			single = rate;
+
+		g_print ("%3u threads: %10.1f queries/s, %5.2fx\n", n_threads, rate, rate / single);
+
+		g_free (threads);
+
+		if (n_threads == max_threads)
+			break;
+	}
+
+	g_object_unref (cbfile);
+	bench_remove_dir (dir);
+
+	g_free (readers);
+	g_free (dir);
+
+	return 0;
+}
+#endif
+
+#ifdef BENCH_MASS_DELETE
+
+/* Removes every object of a generated calendar through remove_component(),
+ * one after another, the way a big remote removal batch does, and reports
+ * the time taken */
+
+static gint bench_events = 50000;
+
+static GOptionEntry bench_entries[] =
+{
+  { "events", 'n', 0, G_OPTION_ARG_INT, &bench_events, "Number of events in the generated calendar", NULL },
+  { NULL }
+};
+
+gint
+main (gint argc,
+      gchar **argv)
+{
+	ECalBackendDecsync *cbfile;
+	GOptionContext *context;
+	GError *error = NULL;
+	GList *uids, *link;
+	gchar *dir;
+	gint64 started;
+	guint n_removed = 0;
+
+	context = g_option_context_new ("- mass delete benchmark for the decsync calendar backend");
+	g_option_context_add_main_entries (context, bench_entries, GETTEXT_PACKAGE);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_print ("option parsing failed: %s\n", error->message);
+		exit (1);
+	}
+
+	dir = bench_generate_calendar (bench_events);
+	cbfile = bench_open_backend (dir, TRUE);
+
+	materialize_all (cbfile);
+
+	link = g_hash_table_get_keys (cbfile->priv->comp_uid_hash);
+	uids = g_list_copy_deep (link, (GCopyFunc) g_strdup, NULL);
+	g_list_free (link);
+
+	started = g_get_monotonic_time ();
+
+	for (link = uids; link; link = g_list_next (link)) {
+		ECalBackendDecsyncObject *obj_data;
+
+		obj_data = g_hash_table_lookup (cbfile->priv->comp_uid_hash, link->data);
+		if (obj_data) {
+			remove_component (cbfile, link->data, obj_data);
+			n_removed++;
+		}
+	}
+
+	g_print ("removed %u objects in %.3f s, %u left\n", n_removed,
+		(gdouble) (g_get_monotonic_time () - started) / G_USEC_PER_SEC,
+		e_cal_backend_decsync_registry_get_length (cbfile->priv->components));
+
+	g_rw_lock_writer_unlock (&cbfile->priv->lock);
+
+	g_object_unref (cbfile);
+	bench_remove_dir (dir);
+
+	g_list_free_full (uids, g_free);
+	g_free (dir);
+
+	return 0;
+}
+#endif
+
+#ifdef BENCH_SAVE_MEMORY
+
+/* Saves a generated calendar once and reports how much the resident set
+ * grew over the save, at its peak.  The peak is read from VmHWM, which is
+ * reset through /proc/self/clear_refs right before the save. */
+
+static gint bench_events = 100000;
+static gboolean bench_single_string = FALSE;
+
+static GOptionEntry bench_entries[] =
+{
+  { "events", 'n', 0, G_OPTION_ARG_INT, &bench_events, "Number of events in the generated calendar", NULL },
+  { "single-string", 's', 0, G_OPTION_ARG_NONE, &bench_single_string, "Serialize the whole calendar into one string first, for comparison", NULL },
+  { NULL }
+};
+
+/* Returns the value of @field in /proc/self/status, in kB */
+static gint64
+bench_read_status (const gchar *field)
+{
+	gchar *contents, *line;
+	gint64 value = -1;
+
+	if (!g_file_get_contents ("/proc/self/status", &contents, NULL, NULL))
+		return -1;
+
+	line = strstr (contents, field);
+	if (line)
+		value = g_ascii_strtoll (line + strlen (field), NULL, 10);
+
+	g_free (contents);
+
+	return value;
+}
+
+static void
+bench_reset_peak (void)
+{
+	gint fd;
+
+	fd = g_open ("/proc/self/clear_refs", O_WRONLY, 0);
+	if (fd == -1 || write (fd, "5", 1) != 1)
+		g_print ("cannot reset the peak resident set, it includes the open\n");
+	if (fd != -1)
+		close (fd);
+}
+
+gint
+main (gint argc,
+      gchar **argv)
+{
+	ECalBackendDecsync *cbfile;
+	GOptionContext *context;
+	GError *error = NULL;
+	GStatBuf st;
+	gchar *dir, *path;
+	gint64 rss, peak, started;
+
+	context = g_option_context_new ("- save memory benchmark for the decsync calendar backend");
+	g_option_context_add_main_entries (context, bench_entries, GETTEXT_PACKAGE);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_print ("option parsing failed: %s\n", error->message);
+		exit (1);
+	}
+
+	dir = bench_generate_calendar (bench_events);
+	cbfile = bench_open_backend (dir, TRUE);
+	path = g_strdup (cbfile->priv->path);
+
+	materialize_all (cbfile);
+
+	bench_reset_peak ();
+	rss = bench_read_status ("VmRSS:");
+	started = g_get_monotonic_time ();
+
+	if (bench_single_string) {
+		gchar *buf;
+
+		buf = i_cal_component_as_ical_string (cbfile->priv->vcalendar);
+		write_file_durably (path, buf, strlen (buf), &error);
+		g_free (buf);
+
+		g_rw_lock_writer_unlock (&cbfile->priv->lock);
+	} else {
+		SaveJob *job;
+
+		job = prepare_snapshot (cbfile);
+		g_rw_lock_writer_unlock (&cbfile->priv->lock);
+
+		write_snapshot (job, &error);
+		save_job_free (job);
+	}
+
+	peak = bench_read_status ("VmHWM:");
+
+	if (error != NULL) {
+		g_message (G_STRLOC " Could not save calendar %s: %s", path, error->message);
+		exit (-1);
+	}
+
+	if (g_stat (path, &st) != 0)
+		st.st_size = 0;
+
+	g_print ("saved %d events, %" G_GINT64_FORMAT " kB, in %.3f s\n", bench_events,
+		(gint64) st.st_size / 1024,
+		(gdouble) (g_get_monotonic_time () - started) / G_USEC_PER_SEC);
+	g_print ("resident set %" G_GINT64_FORMAT " kB, peak during the save %" G_GINT64_FORMAT " kB, delta %" G_GINT64_FORMAT " kB\n",
+		rss, peak, peak - rss);
+
+	g_object_unref (cbfile);
+	bench_remove_dir (dir);
+
+	g_free (path);
+	g_free (dir);
+
+	return 0;
+}
+#endif
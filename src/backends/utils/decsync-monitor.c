@@ -0,0 +1,238 @@
+/**
+ * Evolution-DecSync - decsync-monitor.c
+ *
+ * Copyright (C) 2018 Aldo Gunsing
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "evolution-decsync-config.h"
+
+#include <string.h>
+
+#include <libedataserver/libedataserver.h>
+
+#include "decsync-monitor.h"
+
+/* How long to wait after the last change before calling back, and at
+ * most after the first change of a burst, as a peer may write steadily */
+#define DEBOUNCE_SECONDS 5
+#define MAX_DELAY_SECONDS 30
+
+struct _DecsyncMonitor {
+	/* the collection directory, watched for new-entries to appear */
+	gchar *collection_path;
+	/* new-entries and the directory of our own entries in it */
+	gchar *entries_path;
+	gchar *own_path;
+
+	/* path -> GFileMonitor of every directory watched */
+	GHashTable *monitors;
+
+	GSourceFunc callback;
+	gpointer user_data;
+	guint debounce_id;
+	/* monotonic time of the first change since the last call back */
+	gint64 burst_started;
+};
+
+static void	watch_directory		(DecsyncMonitor *monitor,
+					 GFile *directory,
+					 gboolean recursive);
+
+static gboolean
+debounce_done_cb (gpointer user_data)
+{
+	DecsyncMonitor *monitor = user_data;
+
+	monitor->debounce_id = 0;
+	monitor->callback (monitor->user_data);
+
+	return FALSE;
+}
+
+static gboolean
+is_entries_path (DecsyncMonitor *monitor,
+                 const gchar *path)
+{
+	gsize len = strlen (monitor->entries_path);
+
+	return g_str_has_prefix (path, monitor->entries_path) &&
+		(path[len] == '\0' || path[len] == G_DIR_SEPARATOR);
+}
+
+static gboolean
+is_own_path (DecsyncMonitor *monitor,
+             const gchar *path)
+{
+	gsize len;
+
+	if (!monitor->own_path)
+		return FALSE;
+
+	len = strlen (monitor->own_path);
+
+	return g_str_has_prefix (path, monitor->own_path) &&
+		(path[len] == '\0' || path[len] == G_DIR_SEPARATOR);
+}
+
+static void
+monitor_changed_cb (GFileMonitor *file_monitor,
+                    GFile *file,
+                    GFile *other_file,
+                    GFileMonitorEvent event_type,
+                    gpointer user_data)
+{
+	DecsyncMonitor *monitor = user_data;
+	gint64 now, left;
+	gchar *path;
+
+	if (event_type == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED)
+		return;
+
+	path = g_file_get_path (file);
+	if (!path || !is_entries_path (monitor, path) || is_own_path (monitor, path)) {
+		g_free (path);
+		return;
+	}
+
+	if (event_type == G_FILE_MONITOR_EVENT_CREATED &&
+	    g_file_query_file_type (file, G_FILE_QUERY_INFO_NONE, NULL) == G_FILE_TYPE_DIRECTORY)
+		watch_directory (monitor, file, TRUE);
+	else if (event_type == G_FILE_MONITOR_EVENT_DELETED)
+		g_hash_table_remove (monitor->monitors, path);
+
+	g_free (path);
+
+	now = g_get_monotonic_time ();
+	if (monitor->debounce_id)
+		g_source_remove (monitor->debounce_id);
+	else
+		monitor->burst_started = now;
+
+	left = monitor->burst_started + MAX_DELAY_SECONDS * G_USEC_PER_SEC - now;
+	monitor->debounce_id = e_named_timeout_add (
+		CLAMP (left / 1000, 0, DEBOUNCE_SECONDS * 1000),
+		debounce_done_cb, monitor);
+}
+
+/* Watches @directory, and all its subdirectories when @recursive is set */
+static void
+watch_directory (DecsyncMonitor *monitor,
+                 GFile *directory,
+                 gboolean recursive)
+{
+	GFileMonitor *file_monitor;
+	GFileEnumerator *enumerator;
+	GFileInfo *info;
+	gchar *path;
+
+	path = g_file_get_path (directory);
+	if (!path || g_hash_table_contains (monitor->monitors, path) || is_own_path (monitor, path)) {
+		g_free (path);
+		return;
+	}
+
+	file_monitor = g_file_monitor_directory (directory, G_FILE_MONITOR_NONE, NULL, NULL);
+	if (!file_monitor) {
+		g_free (path);
+		return;
+	}
+
+	g_signal_connect (file_monitor, "changed", G_CALLBACK (monitor_changed_cb), monitor);
+	g_hash_table_insert (monitor->monitors, path, file_monitor);
+
+	if (!recursive)
+		return;
+
+	enumerator = g_file_enumerate_children (directory,
+		G_FILE_ATTRIBUTE_STANDARD_NAME "," G_FILE_ATTRIBUTE_STANDARD_TYPE,
+		G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL, NULL);
+	if (!enumerator)
+		return;
+
+	while ((info = g_file_enumerator_next_file (enumerator, NULL, NULL)) != NULL) {
+		if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY) {
+			GFile *child;
+
+			child = g_file_get_child (directory, g_file_info_get_name (info));
+			watch_directory (monitor, child, TRUE);
+			g_object_unref (child);
+		}
+
+		g_object_unref (info);
+	}
+
+	g_object_unref (enumerator);
+}
+
+static void
+free_file_monitor (gpointer data)
+{
+	GFileMonitor *file_monitor = data;
+
+	g_signal_handlers_disconnect_matched (file_monitor, G_SIGNAL_MATCH_FUNC, 0, 0, NULL, monitor_changed_cb, NULL);
+	g_file_monitor_cancel (file_monitor);
+	g_object_unref (file_monitor);
+}
+
+DecsyncMonitor *
+decsync_monitor_new (const gchar *decsync_dir, const gchar *sync_type, const gchar *collection, const gchar *appid, GSourceFunc callback, gpointer user_data)
+{
+	DecsyncMonitor *monitor;
+	GFile *file;
+
+	g_return_val_if_fail (callback != NULL, NULL);
+
+	if (decsync_dir == NULL || *decsync_dir == '\0')
+		return NULL;
+
+	monitor = g_slice_new0 (DecsyncMonitor);
+	if (collection != NULL && *collection != '\0')
+		monitor->collection_path = g_build_filename (decsync_dir, sync_type, collection, NULL);
+	else
+		monitor->collection_path = g_build_filename (decsync_dir, sync_type, NULL);
+	monitor->entries_path = g_build_filename (monitor->collection_path, "new-entries", NULL);
+	if (appid != NULL && *appid != '\0')
+		monitor->own_path = g_build_filename (monitor->entries_path, appid, NULL);
+	monitor->monitors = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, free_file_monitor);
+	monitor->callback = callback;
+	monitor->user_data = user_data;
+
+	/* new-entries may only be made by the first entry written */
+	file = g_file_new_for_path (monitor->collection_path);
+	watch_directory (monitor, file, FALSE);
+	g_object_unref (file);
+
+	file = g_file_new_for_path (monitor->entries_path);
+	watch_directory (monitor, file, TRUE);
+	g_object_unref (file);
+
+	return monitor;
+}
+
+void
+decsync_monitor_free (DecsyncMonitor *monitor)
+{
+	if (!monitor)
+		return;
+
+	if (monitor->debounce_id)
+		g_source_remove (monitor->debounce_id);
+
+	g_hash_table_destroy (monitor->monitors);
+	g_free (monitor->collection_path);
+	g_free (monitor->entries_path);
+	g_free (monitor->own_path);
+	g_slice_free (DecsyncMonitor, monitor);
+}
@@ -0,0 +1,39 @@
+/**
+ * Evolution-DecSync - decsync-monitor.h
+ *
+ * Copyright (C) 2018 Aldo Gunsing
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DECSYNC_MONITOR_H
+#define DECSYNC_MONITOR_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Watches the new-entries directory of a DecSync collection, with all its
+ * subdirectories but the one of our own app, and calls back a few seconds
+ * after the last change seen there, so that a burst of files written by
+ * a synchronization tool results in one refresh.  A steady stream of
+ * changes still gets a call back half a minute after its first one.  The
+ * callback is called in the main context the monitor was made in. */
+typedef struct _DecsyncMonitor DecsyncMonitor;
+
+DecsyncMonitor *decsync_monitor_new (const gchar *decsync_dir, const gchar *sync_type, const gchar *collection, const gchar *appid, GSourceFunc callback, gpointer user_data);
+void		decsync_monitor_free (DecsyncMonitor *monitor);
+
+G_END_DECLS
+
+#endif /* DECSYNC_MONITOR_H */